@@ -2,6 +2,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -16,6 +17,8 @@
 #define UNUSED __attribute__((unused))
 
 static const char * program;
+static struct server * server;
+static int log_level = 2;
 
 static void
 signal_sink (int signum)
@@ -24,10 +27,38 @@ signal_sink (int signum)
     exit (1);
 }
 
+/* SIGUSR1 makes the log chattier, SIGUSR2 quieter */
+static void
+signal_log_level (int signum)
+{
+    if (signum == SIGUSR1 && log_level < 2)
+        log_level++;
+    else if (signum == SIGUSR2 && log_level > 0)
+        log_level--;
+    mbs_set_log_level (server, log_level);
+}
+
 struct option options[] = {
     { "help", 0, NULL, 'h' },
     { "memsize", required_argument, NULL, 'm' },
     { "all-except", required_argument, NULL, 'x' },
+    { "clients", required_argument, NULL, 'c' },
+    { "lock-memory", 0, NULL, 'l' },
+    { "log-level", required_argument, NULL, 'v' },
+    { "log-rate", required_argument, NULL, 'r' },
+    { "io-uring", 0, NULL, 'u' },
+    { "shards", required_argument, NULL, 's' },
+    { "request-timeout", required_argument, NULL, 't' },
+    { "escalate", 0, NULL, 'e' },
+    { "share-timeout", required_argument, NULL, 'q' },
+    { "fan-out", 0, NULL, 'f' },
+    { "adaptive-downgrade", 0, NULL, 'd' },
+    { "batch-window", required_argument, NULL, 'b' },
+    { "lookahead", 0, NULL, 'k' },
+    { "repay-keep", required_argument, NULL, 'p' },
+    { "repay-delay", required_argument, NULL, 'y' },
+    { "repay-rate", required_argument, NULL, 'w' },
+    { "repay-damping", 0, NULL, 'o' },
     { NULL, 0, NULL, 0 }
 };
 
@@ -38,11 +69,42 @@ help (void)
     printf ("    --help               show this message\n");
     printf ("    --memsize AMOUNT     server owns this much memory\n");
     printf ("    --all-except AMOUNT  use MemTotal minus this much\n");
+    printf ("    --clients N          preallocate room for N clients\n");
+    printf ("    --lock-memory        lock the broker in memory (mlockall)\n");
+    printf ("    --log-level N        0 errors, 1 decisions, 2 every message\n");
+    printf ("    --log-rate N         at most N per-message log lines a second\n");
+    printf ("                         (0 for no limit)\n");
+    printf ("    --io-uring           run the event loop on io_uring if the\n");
+    printf ("                         kernel allows, epoll otherwise\n");
+    printf ("    --shards N           spread clients over N broker threads;\n");
+    printf ("                         share queries stay within a thread\n");
+    printf ("    --request-timeout MS a queued request gets this long, then\n");
+    printf ("                         goes with the pages it has\n");
+    printf ("    --escalate           retry a timed out REQUEST as a RESERVE\n");
+    printf ("    --share-timeout MS   a client that takes longer to answer a\n");
+    printf ("                         share query is taken to have denied it\n");
+    printf ("    --fan-out            a reserve asks all the clients it needs\n");
+    printf ("                         at once, not one after another\n");
+    printf ("    --adaptive-downgrade a reserve asks a source that tends to fall\n");
+    printf ("                         short at REQUEST at RESERVE straight away\n");
+    printf ("    --batch-window US    hold share queries up to US microseconds\n");
+    printf ("                         for other requests to join\n");
+    printf ("    --lookahead          share queries at REQUEST also ask for the\n");
+    printf ("                         requests likely to follow\n");
+    printf ("    --repay-keep AMOUNT  keep this much in the pool before repaying\n");
+    printf ("                         sources\n");
+    printf ("    --repay-delay MS     repay sources only once this long has gone\n");
+    printf ("                         by since the last request\n");
+    printf ("    --repay-rate AMOUNT  repay sources at most this much a second\n");
+    printf ("    --repay-damping      hold back repaying sources that keep being\n");
+    printf ("                         asked for the same pages again\n");
     printf ("\n");
     printf ("    AMOUNT is a positive number with a modifier:\n");
     printf ("       p     pages\n");
     printf ("       M     megabytes\n");
     printf ("       G     gigabytes\n");
+    printf ("\n");
+    printf ("    SIGUSR1 and SIGUSR2 raise and lower the log level.\n");
     exit (0);
 }
 
@@ -67,15 +129,15 @@ make_optstring (void)
     return optstring;
 }
 
-static int
+static int64_t
 parse_memsize (const char * arg)
 {
     char *endptr;
-    long num;
-    int multiplier;
+    long long num;
+    int64_t multiplier;
 
     errno = 0;
-    num = strtol (arg, &endptr, 10);
+    num = strtoll (arg, &endptr, 10);
 
     if (errno) {
         if (errno == ERANGE) {
@@ -120,8 +182,12 @@ parse_memsize (const char * arg)
         fprintf (stderr, "%s: memory size must be positive\n", program);
         return -1;
     }
+    if (num > INT64_MAX / multiplier) {
+        fprintf (stderr, "%s: %s is out of range\n", program, arg);
+        return -1;
+    }
 
-    return (int) (num * multiplier);
+    return num * multiplier;
 }
 
 static unsigned long
@@ -183,17 +249,17 @@ out_error:
 }
 
 static double
-pages_to_gb (int pages)
+pages_to_gb (int64_t pages)
 {
     return pages * (EXEC_PAGESIZE / 1024.0 / 1024.0 / 1024.0);
 }
 
-static int
+static int64_t
 calc_all_pages_except (const char * arg)
 {
     unsigned long kmem_kb;
-    int kmem_pages;
-    int except_pages;
+    int64_t kmem_pages;
+    int64_t except_pages;
 
     except_pages = parse_memsize (arg);
     if (except_pages < 0)
@@ -203,13 +269,14 @@ calc_all_pages_except (const char * arg)
     if (kmem_kb == (unsigned long) -1)
         return -1;
 
-    kmem_pages = (int) (((long long) kmem_kb) * 1024 / EXEC_PAGESIZE);
+    kmem_pages = ((int64_t) kmem_kb) * 1024 / EXEC_PAGESIZE;
 
-    printf ("MemTotal: %lu kB -> %d p  -> %.3f G\n", kmem_kb, kmem_pages,
-            pages_to_gb (kmem_pages));
-    printf ("Except pages: %s -> %d p  -> %.3f G\n", arg, except_pages,
-            pages_to_gb (except_pages));
-    printf ("Result: %d p -> %.3f G\n", kmem_pages - except_pages,
+    printf ("MemTotal: %lu kB -> %lld p  -> %.3f G\n", kmem_kb,
+            (long long) kmem_pages, pages_to_gb (kmem_pages));
+    printf ("Except pages: %s -> %lld p  -> %.3f G\n", arg,
+            (long long) except_pages, pages_to_gb (except_pages));
+    printf ("Result: %lld p -> %.3f G\n",
+            (long long) (kmem_pages - except_pages),
             pages_to_gb (kmem_pages - except_pages));
 
     return kmem_pages - except_pages;
@@ -221,9 +288,24 @@ int main(int argc, char ** argv)
     char * optstring;
     int c;
     void *rc;
-    struct server* server;
     int server_fd = -1;
-    int init_pages = -1;
+    int64_t init_pages = -1;
+    int clients = 0;
+    int lock_memory = 0;
+    int log_rate = -1;
+    int io_uring = 0;
+    int shards = 0;
+    int request_timeout = 0;
+    int escalate = 0;
+    int share_timeout = 0;
+    int fan_out = 0;
+    int adaptive_downgrade = 0;
+    int batch_window = 0;
+    int lookahead = 0;
+    int64_t repay_keep = 0;
+    int repay_delay = 0;
+    int64_t repay_rate = 0;
+    int repay_damping = 0;
 
     setlinebuf(stdout);
 
@@ -253,6 +335,128 @@ int main(int argc, char ** argv)
             }
             break;
 
+        case 'c':
+            clients = atoi (optarg);
+            if (clients <= 0) {
+                fprintf (stderr, "%s: bad client count '%s'\n", program, optarg);
+                free (optstring);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'l':
+            lock_memory = 1;
+            break;
+
+        case 'v':
+            log_level = atoi (optarg);
+            if (log_level < 0 || log_level > 2) {
+                fprintf (stderr, "%s: bad log level '%s'\n", program, optarg);
+                free (optstring);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'r':
+            log_rate = atoi (optarg);
+            if (log_rate < 0) {
+                fprintf (stderr, "%s: bad log rate '%s'\n", program, optarg);
+                free (optstring);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'u':
+            io_uring = 1;
+            break;
+
+        case 's':
+            shards = atoi (optarg);
+            if (shards <= 0) {
+                fprintf (stderr, "%s: bad shard count '%s'\n", program, optarg);
+                free (optstring);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 't':
+            request_timeout = atoi (optarg);
+            if (request_timeout <= 0) {
+                fprintf (stderr, "%s: bad request timeout '%s'\n", program,
+                         optarg);
+                free (optstring);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'e':
+            escalate = 1;
+            break;
+
+        case 'q':
+            share_timeout = atoi (optarg);
+            if (share_timeout <= 0) {
+                fprintf (stderr, "%s: bad share timeout '%s'\n", program,
+                         optarg);
+                free (optstring);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'f':
+            fan_out = 1;
+            break;
+
+        case 'd':
+            adaptive_downgrade = 1;
+            break;
+
+        case 'b':
+            batch_window = atoi (optarg);
+            if (batch_window <= 0) {
+                fprintf (stderr, "%s: bad batch window '%s'\n", program,
+                         optarg);
+                free (optstring);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'k':
+            lookahead = 1;
+            break;
+
+        case 'p':
+            repay_keep = parse_memsize (optarg);
+            if (repay_keep < 0) {
+                free (optstring);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'y':
+            repay_delay = atoi (optarg);
+            if (repay_delay <= 0) {
+                fprintf (stderr, "%s: bad repay delay '%s'\n", program,
+                         optarg);
+                free (optstring);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'w':
+            repay_rate = parse_memsize (optarg);
+            if (repay_rate <= 0 || repay_rate > INT_MAX) {
+                fprintf (stderr, "%s: bad repay rate '%s'\n", program,
+                         optarg);
+                free (optstring);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'o':
+            repay_damping = 1;
+            break;
+
         default:
             fprintf (stderr, "%s: unknown option %s\n", program, optarg);
             break;
@@ -277,8 +481,42 @@ int main(int argc, char ** argv)
     else
         mbs_set_pages (server, init_pages);
 
+    /* Grow the pools up front, so they are locked in along with the rest */
+    if (clients && mbs_reserve_clients (server, clients) != 0)
+        exit (EXIT_FAILURE);
+    if (lock_memory && mbs_lock_memory (server) != 0)
+        exit (EXIT_FAILURE);
+
+    mbs_set_log_level (server, log_level);
+    if (log_rate >= 0)
+        mbs_set_log_rate (server, log_rate);
+    if (io_uring && mbs_use_io_uring (server, 1) != 0)
+        fprintf (stderr, "%s: built without io_uring, using epoll\n", program);
+    if (request_timeout || escalate)
+        mbs_set_request_timeout (server, request_timeout, escalate);
+    if (share_timeout)
+        mbs_set_share_timeout (server, share_timeout);
+    if (fan_out)
+        mbs_set_fan_out (server, 1);
+    if (adaptive_downgrade)
+        mbs_set_adaptive_downgrade (server, 1);
+    if (batch_window)
+        mbs_set_batch_window (server, batch_window);
+    if (lookahead)
+        mbs_set_lookahead (server, 1);
+    if (repay_keep || repay_delay || repay_rate)
+        mbs_set_repayment (server, repay_keep, repay_delay, (int) repay_rate);
+    if (repay_damping)
+        mbs_set_repay_damping (server, 1);
+    if (shards && mbs_set_shards (server, shards) != 0) {
+        fprintf (stderr, "%s: cannot run %d shards\n", program, shards);
+        exit (EXIT_FAILURE);
+    }
+
     signal(SIGSEGV, signal_sink);
     signal(SIGBUS, signal_sink);
+    signal(SIGUSR1, signal_log_level);
+    signal(SIGUSR2, signal_log_level);
 
     rc = mbs_main (server);
     free (server);
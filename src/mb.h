@@ -47,6 +47,8 @@ typedef enum{
     AVAILABLE,
     TOTAL,
     DENY,
+    DEADLINE,
+    HELLO,
     NUM_MB_CODES
 }MbCodes; 
 
@@ -62,6 +64,33 @@ typedef enum {
     MB_BAD_PAGES = (int32_t)(0x80000000) - MB_LAST_ERROR_CODE
 } MbError;
 
+/* What a server can do; a protocol v2 client learns this on registering */
+#define MB_CAP_V2           (1 << 0)    /* batched frames, 64 bit counts, tags */
+#define MB_CAP_SEQPACKET    (1 << 1)    /* also listens on SOCK_SEQPACKET */
+#define MB_CAP_DEADLINE     (1 << 2)    /* honours DEADLINE */
+#define MB_CAP_GRANULE      (1 << 3)    /* counts in a client's own granule */
+#define MB_CAP_AVAILABLE    (1 << 4)    /* picks sharers by AVAILABLE */
+#define MB_CAP_CHUNKS       (1 << 5)    /* takes a SHARE in MB_SHARE_MORE chunks */
+#define MB_CAP_PROGRESSIVE  (1 << 6)    /* grants MB_REQUEST_PROGRESSIVE ones
+                                           as pages come in */
+
+/* A v2 SHARE's flags: part of the answer to a query or request, more to come */
+#define MB_SHARE_MORE       1
+
+/* A v2 REQUEST's flags: send the pages as they come in, in MB_SHARE_MORE
+ * SHAREs, and what is left with the last SHARE */
+#define MB_REQUEST_PROGRESSIVE 1
+
+/* One operation in a protocol v2 frame, in host byte order */
+typedef struct {
+    uint32_t code;      /* MbCodes */
+    uint32_t flags;     /* an AVAILABLE's may name its level, a SHARE's
+                           say there is more to come, a REQUEST's ask for
+                           that */
+    uint64_t tag;       /* a REQUEST's or RESERVE's, echoed on its SHARE */
+    int64_t param;
+} MbOp;
+
 #ifdef __cplusplus
 }
 #endif
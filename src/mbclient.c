@@ -28,17 +28,19 @@
 #include "mbprivate.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <malloc.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <unistd.h>
 
-#define min(a,b) ((a) < (b)) ? (a) : (b)
-#define max(a,b) ((a) > (b)) ? (a) : (b)
+#define min(a,b) (((a) < (b)) ? (a) : (b))
+#define max(a,b) (((a) > (b)) ? (a) : (b))
 
 typedef struct mbclient_struct {
     int id;
@@ -47,6 +49,18 @@ typedef struct mbclient_struct {
     int pages;
     unsigned int source_pages;
     int is_bidi;
+    int v2;                     /* asked for protocol v2 */
+    int seqpacket;
+    int proto;                  /* what the server agreed to */
+    unsigned int granule_shift; /* counts are in 2^shift pages */
+    uint64_t tag;               /* of the last REQUEST or RESERVE */
+    int granted;                /* ... pages it has had so far */
+    MbSnapshot snapshot;
+    /* Ops read with the last v2 frame(s) but not yet handed out */
+    unsigned int in_off;
+    unsigned int in_len;
+    unsigned int in_ops;        /* left in the frame at in_off */
+    unsigned char in[MB2_PACKET_MAX];
     struct mbclient_struct * next;
 } mbclient;
 
@@ -79,6 +93,9 @@ free_client(mbclient* client)
     client->pages = 0;
     client->source_pages = 0;
     client->sock.sun_family = 0;
+    client->seqpacket = 0;
+    client->granule_shift = 0;
+    client->in_off = client->in_len = client->in_ops = 0;
     
     while (needle){
         if (needle->next == client )
@@ -91,7 +108,7 @@ free_client(mbclient* client)
     }
 }
 
-static MbError validate_send(MbCodes code, int param)
+static MbError validate_send(MbCodes code, int64_t param)
 {
   MbError rc = MB_SUCCESS;
 
@@ -102,6 +119,7 @@ static MbError validate_send(MbCodes code, int param)
       case RETURN:
       case SHARE:
       case AVAILABLE:
+      case DEADLINE:
           if (param < 0)
               rc = MB_BAD_PARAM;
           break;
@@ -120,7 +138,7 @@ static MbError validate_send(MbCodes code, int param)
   return rc;
 }
 
-static MbError validate_receive(MbCodes code, int param)
+static MbError validate_receive(MbCodes code, int64_t param)
 {
     MbError rc = MB_SUCCESS;
     
@@ -157,7 +175,7 @@ create_uds(mbclient* client)
     if (client->fd != 0)
         return client->fd;
     
-    fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    fd = socket (AF_UNIX, client->seqpacket ? SOCK_SEQPACKET : SOCK_STREAM, 0);
     
     
     if (fd == -1){
@@ -192,9 +210,20 @@ contact(mbclient* client)
     {
         memset (&(client->sock), 0, sizeof(client->sock));
         client->sock.sun_family = AF_UNIX;
-        mb_socket_name(&(client->sock.sun_path[0]), sizeof(client->sock.sun_path));
+        if (client->seqpacket)
+            mb_seqpacket_name(&(client->sock.sun_path[0]), sizeof(client->sock.sun_path));
+        else
+            mb_socket_name(&(client->sock.sun_path[0]), sizeof(client->sock.sun_path));
         
         if (connect (fd, (struct sockaddr *) &(client->sock), sizeof (struct sockaddr_un)) == -1) {
+            if (client->seqpacket && (errno == ENOENT || errno == ECONNREFUSED)) {
+                /* A server that predates it has no seqpacket socket */
+                close (fd);
+                client->fd = 0;
+                client->sock.sun_family = 0;
+                client->seqpacket = 0;
+                return contact (client);
+            }
             perror ("connect");
             return -1;
         }
@@ -203,6 +232,91 @@ contact(mbclient* client)
     return fd;
 }
 
+/* Sends one message in whichever protocol the connection speaks */
+static int
+client_send(mbclient* client, MbCodes code, int64_t param)
+{
+    MbOp op;
+
+    if (client->proto < 2) {
+        if (param > INT_MAX)
+            return MB_BAD_PARAM;
+        return mb_encode_and_send (client->id, client->fd, code, param);
+    }
+
+    op.code = code;
+    op.flags = 0;
+    op.tag = (code == REQUEST || code == RESERVE) ? ++client->tag : 0;
+    op.param = param;
+    return mb2_send (client->fd, &op, 1);
+}
+
+/*
+ * Receives one message.  A v2 frame can carry several; the ones after the
+ * first are kept for the next call.
+ */
+static int
+client_receive(mbclient* client, MbOp* op)
+{
+    int ret;
+
+    if (client->proto < 2) {
+        int id, param;
+        MbCodes code;
+
+        ret = mb_receive_and_decode (client->fd, &id, &code, &param);
+        if (ret <= 0)
+            return ret;
+        if (id != client->id)
+            return MB_BAD_ID;
+        op->code = code;
+        op->flags = 0;
+        op->tag = 0;
+        op->param = param;
+        return ret;
+    }
+
+    while (!client->in_ops) {
+        if (client->in_off == client->in_len) {
+            ret = mb2_receive (client->fd, client->seqpacket, client->in,
+                               sizeof (client->in));
+            if (ret <= 0)
+                return ret;
+            client->in_off = 0;
+            client->in_len = ret;
+        }
+        /* mb2_receive() has vouched for the frames */
+        client->in_ops = (mb2_frame_size (client->in + client->in_off,
+                                          client->in_len - client->in_off)
+                          - MB2_HEADER_SIZE) / MB2_OP_SIZE;
+        client->in_off += MB2_HEADER_SIZE;
+    }
+
+    mb2_decode_op (client->in + client->in_off, op);
+    client->in_off += MB2_OP_SIZE;
+    client->in_ops--;
+    return MB2_OP_SIZE;
+}
+
+static int
+client_receive_response(mbclient* client, MbCodes code, int* param)
+{
+    MbOp op;
+    int ret = client_receive (client, &op);
+
+    if (ret > 0) {
+        if (op.code != (uint32_t) code)
+            ret = MB_BAD_CODE;
+        else if (code == SHARE && op.tag != client->tag)
+            ret = MB_BAD_ID;
+        else if (op.param < INT_MIN || op.param > INT_MAX)
+            ret = MB_BAD_PARAM;
+        else
+            *param = op.param;
+    }
+    return ret;
+}
+
 static int
 remote_page_request(mbclient* client, MbCodes type, int pages)
 {
@@ -221,10 +335,10 @@ remote_page_request(mbclient* client, MbCodes type, int pages)
 	if (fd == -1)
 	    return MB_IO;
 	
-	if ((ret = mb_encode_and_send (client->id, fd, type, pages)) < 0)
+	if ((ret = client_send (client, type, pages)) < 0)
   	    return ret;
 	
-	ret = mb_receive_response_and_decode (fd, client->id, SHARE, &param);
+	ret = client_receive_response (client, SHARE, &param);
 	
 	if (ret <= 0 )
 	    return ret;
@@ -263,15 +377,30 @@ mb_client_return_pages(MbClientHandle client, int pages)
     
         pages = min(pages, ((mbclient*)client)->pages);
         ((mbclient*)client)->pages -= pages;
-        ret = mb_encode_and_send (((mbclient*)client)->id, fd, RETURN, pages);
+        ret = client_send ((mbclient*)client, RETURN, pages);
     }
     return ret;
 }
 int
+mb_client_set_deadline(MbClientHandle client, int ms)
+{
+    int fd;
+
+    if (ms < 0)
+        return MB_BAD_PARAM;
+
+    fd = contact ((mbclient*)client);
+
+    if (fd == -1)
+        return MB_IO;
+
+    return client_send ((mbclient*)client, DEADLINE, ms);
+}
+int
 mb_client_terminate(MbClientHandle client)
 {
     int ret, param;
-    MbCodes code;
+    MbCodes code = INVALID;
     int fd;
     
     fd = create_uds ((mbclient*)client);
@@ -279,7 +408,7 @@ mb_client_terminate(MbClientHandle client)
     if (fd < 0)
         return MB_IO;
     
-    ret = mb_encode_and_send (((mbclient*)client)->id, fd, TERMINATE, 0);
+    ret = client_send ((mbclient*)client, TERMINATE, 0);
 
     if (ret != 0) {
 	do {
@@ -306,14 +435,44 @@ mb_client_status(MbClientHandle client)
     if (fd == -1)
         return MB_IO;
     
-    return mb_encode_and_send (((mbclient*)client)->id, fd, STATUS, 0);
+    return client_send ((mbclient*)client, STATUS, 0);
+}
+
+/* A v2 server answers a registration with a HELLO, a TOTAL and a QUERY */
+static int
+read_snapshot(mbclient* client)
+{
+    MbOp op;
+    int i, ret;
+
+    for (i = 0; i < 3; i++) {
+        if ((ret = client_receive (client, &op)) <= 0)
+            return ret < 0 ? ret : MB_IO;
+        if (op.code == HELLO)
+            client->snapshot.caps = op.param;
+        else if (op.code == TOTAL)
+            client->snapshot.total = op.param;
+        else if (op.code == QUERY)
+            client->snapshot.free = op.param;
+        else
+            return MB_BAD_CODE;
+    }
+    return 0;
 }
 
 static int
 client_register(mbclient* client)
 {
+    unsigned char buf[MB_FRAME_SIZE * 2];
     unsigned int arg;
-    int fd, ret;
+    int fd, ret, id, param;
+    MbCodes code;
+
+    client->proto = 1;
+    client->tag = 0;
+    client->in_off = client->in_len = client->in_ops = 0;
+    client->snapshot.caps = 0;
+    client->snapshot.total = client->snapshot.free = -1;
 
     fd = contact (client);
 
@@ -324,9 +483,56 @@ client_register(mbclient* client)
 
     arg = (client->is_bidi << 31) | client->source_pages;
 
-    if ((ret = mb_encode_and_send (((mbclient*)client)->id, fd, REGISTER, arg)) < 0)
+    if (client->seqpacket) {
+        MbOp op;
+
+        op.code = REGISTER;
+        op.flags = (client->is_bidi ? MB2_BIDI : 0) |
+                   MB_GRANULE_BITS(client->granule_shift);
+        op.tag = client->id;
+        op.param = client->source_pages;
+        client->proto = 2;
+        if ((ret = mb2_send (fd, &op, 1)) < 0 ||
+            (ret = read_snapshot (client)) < 0)
+            return ret;
+    } else if (client->v2) {
+        /*
+         * One write, so that the server takes the TOTAL in along with the
+         * REGISTER, before it could send a bidi client anything else.
+         */
+        mb_encode (client->id, REGISTER, arg, buf);
+        mb_encode (client->id, TOTAL,
+                   MB_HELLO_V2 | MB_GRANULE_BITS(client->granule_shift),
+                   buf + MB_FRAME_SIZE);
+        if ((ret = mb_send_all (fd, buf, sizeof (buf))) < 0)
+            return ret;
+
+        ret = mb_receive_and_decode (fd, &id, &code, &param);
+        if (ret <= 0)
+            return ret < 0 ? ret : MB_IO;
+        if (id != client->id)
+            return MB_BAD_ID;
+        if (code == TOTAL) {
+            /* The server predates v2 and took it for a plain TOTAL */
+            client->snapshot.total = param;
+        } else if (code == HELLO) {
+            client->proto = 2;
+            if ((ret = read_snapshot (client)) < 0)
+                return ret;
+        } else {
+            return MB_BAD_CODE;
+        }
+    } else if ((ret = mb_encode_and_send (((mbclient*)client)->id, fd, REGISTER, arg)) < 0)
         return ret;
 
+    if (client->granule_shift && !(client->snapshot.caps & MB_CAP_GRANULE)) {
+        /* It would take our granules for pages; better not to stay */
+        close (fd);
+        client->fd = 0;
+        client->sock.sun_family = 0;
+        return MB_BAD_PARAM;
+    }
+
     if (!client->is_bidi)
         fd = 0;
 
@@ -339,6 +545,8 @@ mb_register(int is_bidi)
     mb_default_client.id = getpid();
     mb_default_client.is_bidi = is_bidi ? 1 : 0;
     mb_default_client.source_pages = 0;
+    mb_default_client.v2 = 0;
+    mb_default_client.granule_shift = 0;
     return client_register(&mb_default_client);
 }
 int
@@ -347,6 +555,38 @@ mb_register_source(int pages)
     mb_default_client.id = getpid();
     mb_default_client.is_bidi = 1;
     mb_default_client.source_pages = pages < 0 ? 0 : pages;
+    mb_default_client.v2 = 0;
+    mb_default_client.granule_shift = 0;
+    return client_register(&mb_default_client);
+}
+/* log2 of a granule in pages, or -1 if it is not one */
+static int
+granule_shift(size_t granule)
+{
+    int shift = 0;
+
+    if (granule == 0)
+        return 0;
+    if (granule < EXEC_PAGESIZE || (granule & (granule - 1)))
+        return -1;
+    while (((size_t) EXEC_PAGESIZE << shift) < granule)
+        shift++;
+    return shift > MB_GRANULE_SHIFT_MAX ? -1 : shift;
+}
+
+int
+mb_connect(int flags, int source_pages, size_t granule)
+{
+    int shift = granule_shift(granule);
+
+    if (source_pages < 0 || shift < 0)
+        return MB_BAD_PARAM;
+    mb_default_client.id = getpid();
+    mb_default_client.is_bidi = (flags & MB_CLIENT_BIDI) || source_pages > 0;
+    mb_default_client.source_pages = source_pages;
+    mb_default_client.v2 = 1;
+    mb_default_client.seqpacket = (flags & MB_CLIENT_SEQPACKET) != 0;
+    mb_default_client.granule_shift = shift;
     return client_register(&mb_default_client);
 }   
 MbClientHandle
@@ -364,6 +604,9 @@ mb_client_register(int id, int is_bidi)
         client->source_pages = 0;
         client->fd = 0;
         client->is_bidi = is_bidi ? 1 : 0;
+        client->v2 = 0;
+        client->seqpacket = 0;
+        client->granule_shift = 0;
         if (client_register(client) < 0) {
             free (client);
             return NULL;
@@ -392,6 +635,9 @@ mb_client_register_source(int id, int pages)
         client->source_pages = pages < 0 ? 0 : pages;
         client->fd = 0;
         client->is_bidi = 1;
+        client->v2 = 0;
+        client->seqpacket = 0;
+        client->granule_shift = 0;
         if (client_register(client) < 0) {
             free(client);
             return NULL;
@@ -406,6 +652,43 @@ mb_client_register_source(int id, int pages)
     }
     return client;
 }   
+MbClientHandle
+mb_client_connect(int id, int flags, int source_pages, size_t granule)
+{
+    int is_bidi = (flags & MB_CLIENT_BIDI) || source_pages > 0;
+    int shift = granule_shift(granule);
+    mbclient* client;
+
+    if (source_pages < 0 || shift < 0)
+        return NULL;
+
+    client = get_client_by_id(id);
+    if (client) {
+        if (client->is_bidi != is_bidi ||
+            client->source_pages != (unsigned int)source_pages ||
+            client->granule_shift != (unsigned int)shift)
+            client = NULL;
+        return client;
+    }
+
+    client = calloc(1, sizeof(mbclient));
+    if (client == NULL)
+        return NULL;
+    client->id = id;
+    client->pages = source_pages;
+    client->source_pages = source_pages;
+    client->is_bidi = is_bidi;
+    client->v2 = 1;
+    client->seqpacket = (flags & MB_CLIENT_SEQPACKET) != 0;
+    client->granule_shift = shift;
+    if (client_register(client) < 0) {
+        free(client);
+        return NULL;
+    }
+    client->next = mb_default_client.next;
+    mb_default_client.next = client;
+    return client;
+}
 int
 mb_client_query_server(MbClientHandle client)
 {
@@ -421,14 +704,14 @@ mb_client_query_server(MbClientHandle client)
         return MB_BAD_PAGES + MB_IO;
     
     
-    if ((ret = mb_encode_and_send (((mbclient*)client)->id, fd, QUERY, 0)) < 0)
+    if ((ret = client_send ((mbclient*)client, QUERY, 0)) < 0)
         return MB_BAD_PAGES + ret;
     
-    ret = mb_receive_response_and_decode (fd, ((mbclient*)client)->id, 
-                                          QUERY, &param);
+    ret = client_receive_response ((mbclient*)client, QUERY, &param);
     
-    if (ret < 0)
-        return MB_BAD_PAGES + ret;
+    /* 0 is the server hanging up */
+    if (ret <= 0)
+        return MB_BAD_PAGES + (ret ? ret : MB_IO);
 
     return param;
 }
@@ -446,14 +729,14 @@ mb_client_query_total(MbClientHandle client)
     if (fd == -1)
         return MB_IO;
     
-    if ((ret = mb_encode_and_send (((mbclient*)client)->id, fd, TOTAL, 0)) < 0)
+    if ((ret = client_send ((mbclient*)client, TOTAL, 0)) < 0)
         return ret;
     
-    ret = mb_receive_response_and_decode (fd, ((mbclient*)client)->id,
-                                          TOTAL, &param);
+    ret = client_receive_response ((mbclient*)client, TOTAL, &param);
     
-    if (ret < 0)
-        param = ret;
+    /* 0 is the server hanging up */
+    if (ret <= 0)
+        param = ret ? ret : MB_IO;
 
     return param;
 }
@@ -489,9 +772,7 @@ int mb_client_send(MbClientHandle client, MbCodes code, int param)
     if (rc < 0)
         return rc;
 
-    rc =  mb_encode_and_send(((mbclient*)client)->id, 
-                                 ((mbclient*)client)->fd,
-                                 code, param);
+    rc = client_send((mbclient*)client, code, param);
 
     if (!rc && (code == RETURN || code == SHARE))
         ((mbclient*)client)->pages -= param;
@@ -501,22 +782,120 @@ int mb_client_send(MbClientHandle client, MbCodes code, int param)
 
 int mb_client_receive(MbClientHandle client, MbCodes* code, int* param)
 {
-    int id;
+    MbOp op;
+    int ret;
+
+    op.code = INVALID;
+    ret = mb_client_receive_op(client, &op);
+    if (op.code != INVALID) {
+        *code = op.code;
+        /* Only mb_client_receive_op() can hand on a count this big */
+        if (op.param < INT_MIN || op.param > INT_MAX)
+            return MB_BAD_PARAM;
+        *param = op.param;
+    }
+
+    return ret;
+}
+
+int mb_client_send_ops(MbClientHandle handle, const MbOp* ops, int n)
+{
+    mbclient* client = handle;
+    int i, rc;
+
+    for (i = 0; i < n; i++) {
+        if ((rc = validate_send(ops[i].code, ops[i].param)) < 0)
+            return rc;
+        /* A server that cannot take chunks would take one for the answer */
+        if (ops[i].code == SHARE && (ops[i].flags & MB_SHARE_MORE) &&
+            !(client->snapshot.caps & MB_CAP_CHUNKS))
+            return MB_BAD_PARAM;
+    }
+
+    for (i = 0; i < n; i += MB2_MAX_OPS) {
+        int chunk = min(n - i, MB2_MAX_OPS);
+        int j;
+
+        if (client->proto < 2) {
+            for (j = i; j < i + chunk; j++)
+                if ((rc = client_send(client, ops[j].code, ops[j].param)) < 0)
+                    return rc;
+        } else if ((rc = mb2_send(client->fd, ops + i, chunk)) < 0) {
+            return rc;
+        }
+
+        for (j = i; j < i + chunk; j++)
+            if (ops[j].code == RETURN || ops[j].code == SHARE)
+                client->pages -= ops[j].param;
+    }
+
+    return 0;
+}
+
+int mb_client_receive_op(MbClientHandle handle, MbOp* op)
+{
+    mbclient* client = handle;
     int ret;
 
-    ret = mb_receive_and_decode(((mbclient*)client)->fd, 
-                                    &id, code, param);
+    ret = client_receive(client, op);
     if (ret > 0) {
-         if (id != ((mbclient*)client)->id)
-	     ret = MB_BAD_ID;
-	 else if (!(ret = validate_receive(*code, *param)) &&
-                  (*code == SHARE || *code == RETURN)) 
-             ((mbclient*)client)->pages += *param;
+	 if (!(ret = validate_receive(op->code, op->param)) &&
+             (op->code == SHARE || op->code == RETURN)) {
+             client->pages += op->param;
+             if (op->code == SHARE && op->tag == client->tag)
+                 client->granted += op->param;
+         }
     }
 
     return ret;
 }
 
+int mb_client_request_progressive(MbClientHandle handle, int pages)
+{
+    mbclient* client = handle;
+    MbOp op;
+
+    if (pages < 0 || client->proto < 2 ||
+        !(client->snapshot.caps & MB_CAP_PROGRESSIVE))
+        return MB_BAD_PARAM;
+
+    op.code = REQUEST;
+    op.flags = MB_REQUEST_PROGRESSIVE;
+    op.tag = ++client->tag;
+    op.param = pages;
+    client->granted = 0;
+    return mb2_send (client->fd, &op, 1);
+}
+
+int mb_client_granted(MbClientHandle client)
+{
+    return ((mbclient*)client)->granted;
+}
+
+int mb_client_pending(MbClientHandle client)
+{
+    return ((mbclient*)client)->in_ops ||
+           ((mbclient*)client)->in_off < ((mbclient*)client)->in_len;
+}
+
+int mb_client_protocol(MbClientHandle client)
+{
+    return ((mbclient*)client)->proto;
+}
+
+size_t mb_client_granule(MbClientHandle client)
+{
+    return (size_t) EXEC_PAGESIZE << ((mbclient*)client)->granule_shift;
+}
+
+int mb_client_snapshot(MbClientHandle client, MbSnapshot* snapshot)
+{
+    if (!snapshot)
+        return MB_BAD_PARAM;
+    *snapshot = ((mbclient*)client)->snapshot;
+    return 0;
+}
+
 int mb_request_pages( int pages )
 {
     return mb_client_request_pages(&mb_default_client, pages);
@@ -532,6 +911,11 @@ int mb_return_pages( int pages )
     return mb_client_return_pages(&mb_default_client, pages);
 }
 
+int mb_set_deadline( int ms )
+{
+    return mb_client_set_deadline(&mb_default_client, ms);
+}
+
 int mb_terminate()
 {
     return mb_client_terminate(&mb_default_client);
@@ -567,3 +951,8 @@ int mb_receive(MbCodes* code, int* param)
     return mb_client_receive(&mb_default_client, code, param);
 }
 
+int mb_snapshot(MbSnapshot* snapshot)
+{
+    return mb_client_snapshot(&mb_default_client, snapshot);
+}
+
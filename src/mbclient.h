@@ -26,6 +26,7 @@
 #define MBCLIENT_H
 
 #include "mb.h"
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C"
@@ -89,6 +90,47 @@ MbClientHandle mb_client_register(int id, int is_bidi);
  */
 MbClientHandle mb_client_register_source(int id, int pages);
 
+/* Options for mb_client_connect() */
+#define MB_CLIENT_BIDI          (1 << 0)
+#define MB_CLIENT_SEQPACKET     (1 << 1)    /* fall back to a stream if need be */
+
+/* What the server said about itself when the client registered */
+typedef struct {
+    uint32_t caps;      /* MB_CAP_* */
+    int64_t total;      /* as mb_client_query_total() */
+    int64_t free;       /* as mb_client_query_server(), or -1 if unknown */
+} MbSnapshot;
+
+/**
+ * Establishes a client connection with membroker using protocol v2, which
+ * batches several messages to a frame, carries 64 bit counts and echoes a
+ * tag on the SHARE that answers a REQUEST or RESERVE.  The server answers
+ * the registration with its capabilities and the state of its pool (see
+ * mb_client_snapshot()).  Against a server that predates v2, the client
+ * quietly carries on with the original protocol.
+ *
+ * @param id as for mb_client_register()
+ *
+ * @param flags MB_CLIENT_BIDI for a bidi client; MB_CLIENT_SEQPACKET to talk
+ *              over the server's SOCK_SEQPACKET socket, so that every read
+ *              is whole messages
+ *
+ * @param source_pages the pages this client loans to membroker; a client
+ *                     with any is a source, and always bidi
+ *
+ * @param granule the size in bytes of the pages this client counts in, e.g.
+ *                a huge page; a power of two no smaller than EXEC_PAGESIZE,
+ *                or 0 for EXEC_PAGESIZE.  Every count to and from the server,
+ *                source_pages and the snapshot included, is then in these,
+ *                and the server only ever grants, asks for and returns whole
+ *                ones.
+ *
+ * @return a handle to the client, or NULL as for mb_client_register(), or
+ *         if the granule is bad or the server cannot count in it
+ */
+MbClientHandle mb_client_connect(int id, int flags, int source_pages,
+                                 size_t granule);
+
 /**
  * Establishes a sink client connection with membroker
  *
@@ -121,6 +163,34 @@ int mb_register(int is_bidi);
  */
 int mb_register_source(int pages);
 
+/**
+ * Establishes this process's client connection with protocol v2; see
+ * mb_client_connect().
+ *
+ * @return as for mb_register()
+ */
+int mb_connect(int flags, int source_pages, size_t granule);
+
+/**
+ * The server's capabilities and pool as of registration, so that a client
+ * need not ask for TOTAL and QUERY separately.  A server that predates
+ * protocol v2 reports no capabilities and leaves free unknown.
+ *
+ * @return 0, or MB_BAD_PARAM if snapshot is NULL
+ */
+int mb_client_snapshot(MbClientHandle client, MbSnapshot* snapshot);
+int mb_snapshot(MbSnapshot* snapshot);
+
+/**
+ * @return the size in bytes of the pages the client counts in
+ */
+size_t mb_client_granule(MbClientHandle client);
+
+/**
+ * @return 2 if the client speaks protocol v2 with the server, otherwise 1
+ */
+int mb_client_protocol(MbClientHandle client);
+
 /**
  * Makes a low-anxiety request for memory pages from membroker. Membroker may 
  * return fewer pages than requested and will only attempt to procure easily
@@ -175,6 +245,23 @@ int mb_reserve_pages( int pages );
 int mb_client_return_pages(MbClientHandle client, int pages);
 int mb_return_pages( int pages );
 
+/**
+ * Bounds how long membroker may keep this client's later requests queued.
+ * When the time is up, a request completes with the pages acquired so far
+ * (a RESERVE with none, unless it got them all).  Servers that predate
+ * deadlines ignore this.
+ *
+ * @param ms the longest a request may wait, in milliseconds, or 0 to go by
+ *           the server's default
+ *
+ * @return 0 if the command was successful, or one of the following error codes:
+ *         MB_IO if there was an error communicating with membroker (see errno
+ *             for more details)
+ *         MB_BAD_PARAM if ms is negative
+ */
+int mb_client_set_deadline(MbClientHandle client, int ms);
+int mb_set_deadline( int ms );
+
 /**
  * Terminates the client connection with membroker, returning all borrowed
  * pages to membroker. If this is a source client, membroker assumes all source
@@ -271,6 +358,54 @@ int mb_send(MbCodes code, int param);
 int mb_client_receive(MbClientHandle client, MbCodes* code, int* param);
 int mb_receive(MbCodes* code, int* param);
 
+/**
+ * Sends several commands at once, e.g. a RETURN and a REQUEST, or the SHARE
+ * replies to more than one query.  With protocol v2 they go in as few frames
+ * as will hold them and the server applies them in order; otherwise they are
+ * sent one by one, without their tags.
+ *
+ * A bidi client that frees pages bit by bit may answer a share query with
+ * SHAREs flagged MB_SHARE_MORE as it goes, the pages going to the requests
+ * waiting at once, and then a SHARE without the flag, maybe of 0 pages, to
+ * end the answer.  This takes a server with MB_CAP_CHUNKS.
+ *
+ * @return 0 on success, or an error code as for mb_client_send()
+ */
+int mb_client_send_ops(MbClientHandle client, const MbOp* ops, int n);
+
+/**
+ * Receives a command as mb_client_receive() does, along with its tag and
+ * 64 bit param.
+ */
+int mb_client_receive_op(MbClientHandle client, MbOp* op);
+
+/**
+ * Asks for pages without waiting for them, to be sent on as they come in
+ * rather than all at once.  Each SHARE received for it with MB_SHARE_MORE in
+ * its flags is a part of them; the one without it brings what is left and
+ * says the request is over.  Needs protocol v2 and a server with
+ * MB_CAP_PROGRESSIVE.
+ *
+ * @return 0 on success, or an error code as for mb_client_send(), or
+ *         MB_BAD_PARAM if the server cannot do it
+ */
+int mb_client_request_progressive(MbClientHandle client, int pages);
+
+/**
+ * @return the pages received so far for the request last sent with
+ *         mb_client_request_progressive()
+ */
+int mb_client_granted(MbClientHandle client);
+
+/**
+ * A v2 frame can carry several commands, and the ones after the first are
+ * kept by the client library.  A poll loop should receive until this says
+ * there are none left before it waits on the file descriptor again.
+ *
+ * @return non-zero if a received command is waiting to be read
+ */
+int mb_client_pending(MbClientHandle client);
+
 /**
  * Provides access to the file descriptor used to communicate with membroker.
  * This is necessary to include the membroker client connection in a poll/select
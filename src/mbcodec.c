@@ -24,8 +24,10 @@
  */
 #include "mbprivate.h"
 #include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
@@ -39,24 +41,58 @@ i32_encode( unsigned char * buf, unsigned int i)
     buf[3] = i;
 }
 static inline unsigned int
-i32_decode( unsigned char * buf)
+i32_decode( const unsigned char * buf)
 {
     return (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
 
 }
-int
-mb_encode_and_send(int id, int fd, MbCodes code, int param)
+
+/*
+ * The server runs its sockets non-blocking.  When a frame has only been
+ * partially transferred, wait for the socket to become ready again rather
+ * than hand a half frame back to the caller.
+ */
+static void
+wait_for (int fd, short events)
 {
-    static const int size = sizeof(int) *3;
-    unsigned char buf[size];
-    int total = 0;
+    struct pollfd pfd;
 
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+    while (poll (&pfd, 1, -1) == -1 && errno == EINTR)
+        ;
+}
+
+void
+mb_encode(int id, MbCodes code, int param, unsigned char * buf)
+{
     i32_encode (buf, id);
     i32_encode (&buf[sizeof(int)], code);
     i32_encode (&buf[sizeof(int) * 2], param);
+}
+
+void
+mb_decode(const unsigned char * buf, int* id, MbCodes* code, int* param)
+{
+    *id = (int)i32_decode (buf);
+    *code = (int)i32_decode (&buf[sizeof(int)]);
+    *param = (int)i32_decode (&buf[sizeof(int) *2]);
+}
+
+int
+mb_send_all(int fd, const unsigned char * buf, size_t size)
+{
+    size_t total = 0;
 
     while ( total < size ){
         int ret = send (fd, buf + total, size - total, MSG_NOSIGNAL);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            wait_for (fd, POLLOUT);
+            continue;
+        }
         if (ret == -1 ){
             perror ("send");
             return MB_IO;
@@ -68,32 +104,153 @@ mb_encode_and_send(int id, int fd, MbCodes code, int param)
 }
 
 int
-mb_receive_and_decode(int fd, int* id, MbCodes* code, int* param)
-{    
-    static const int size = sizeof(int) *3;
-    unsigned char buf[size];
+mb_encode_and_send(int id, int fd, MbCodes code, int param)
+{
+    unsigned char buf[MB_FRAME_SIZE];
+
+    mb_encode (id, code, param, buf);
+    return mb_send_all (fd, buf, sizeof (buf));
+}
+
+/*
+ * Reads exactly size bytes.  Returns 0 if a non-blocking socket has
+ * nothing pending, so callers can tell that from a short message.
+ */
+static int
+receive_all(int fd, unsigned char * buf, int size)
+{
     int total = 0;
 
     while (total < size){
         int ret = recv (fd, buf + total, size - total, 0);
+        if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            /* Nothing pending on a non-blocking socket */
+            if (total == 0)
+                return 0;
+            wait_for (fd, POLLIN);
+            continue;
+        }
         if (ret == -1 && errno != EINTR ) {
             perror("recv");  
             return MB_IO;
         }
-        else if (ret == 0 && total == 0) {
+        else if (ret == 0) {
 	    return MB_IO;
 	}
         if (ret > 0)
             total += ret;
     }
-    
-    *id = (int)i32_decode (buf);
-    *code = (int)i32_decode (&buf[sizeof(int)]);
-    *param = (int)i32_decode (&buf[sizeof(int) *2]);
-    
+
     return total;
 }
 
+int
+mb_receive_and_decode(int fd, int* id, MbCodes* code, int* param)
+{    
+    unsigned char buf[MB_FRAME_SIZE];
+    int ret = receive_all (fd, buf, sizeof (buf));
+
+    if (ret > 0)
+        mb_decode (buf, id, code, param);
+
+    return ret;
+}
+
+/* Encodes n ops (at most MB2_MAX_OPS) as one frame; returns its size */
+size_t
+mb2_encode(const MbOp * ops, unsigned int n, unsigned char * buf)
+{
+    uint32_t len = n * MB2_OP_SIZE;
+
+    memcpy (buf, &len, MB2_HEADER_SIZE);
+    memcpy (buf + MB2_HEADER_SIZE, ops, len);
+    return MB2_HEADER_SIZE + len;
+}
+
+/*
+ * Size of the frame at the start of buf, 0 if len does not hold all of it
+ * yet, or -1 if it cannot be a frame.
+ */
+int
+mb2_frame_size(const unsigned char * buf, size_t len)
+{
+    uint32_t body;
+
+    if (len < MB2_HEADER_SIZE)
+        return 0;
+    memcpy (&body, buf, MB2_HEADER_SIZE);
+    if (body % MB2_OP_SIZE || body > MB2_MAX_OPS * MB2_OP_SIZE)
+        return -1;
+    if (len < MB2_HEADER_SIZE + body)
+        return 0;
+    return MB2_HEADER_SIZE + body;
+}
+
+void
+mb2_decode_op(const unsigned char * buf, MbOp * op)
+{
+    memcpy (op, buf, MB2_OP_SIZE);
+}
+
+int
+mb2_send(int fd, const MbOp * ops, unsigned int n)
+{
+    unsigned char buf[MB2_FRAME_MAX];
+
+    if (n > MB2_MAX_OPS)
+        return MB_BAD_PARAM;
+    return mb_send_all (fd, buf, mb2_encode (ops, n, buf));
+}
+
+/*
+ * Reads whole frames into buf: one from a stream socket, or a packet's
+ * worth from a SOCK_SEQPACKET one.  Returns the bytes read, 0 if a
+ * non-blocking socket has nothing pending, or an error.
+ */
+int
+mb2_receive(int fd, int seqpacket, unsigned char * buf, size_t size)
+{
+    int ret, len, off;
+
+    if (!seqpacket) {
+        ret = receive_all (fd, buf, MB2_HEADER_SIZE);
+        if (ret <= 0)
+            return ret;
+        len = mb2_frame_size (buf, MB2_FRAME_MAX);
+        if (len < 0 || (size_t) len > size)
+            return MB_BAD_PARAM;
+        if (len == MB2_HEADER_SIZE)
+            return len;
+        ret = receive_all (fd, buf + MB2_HEADER_SIZE, len - MB2_HEADER_SIZE);
+        if (ret == 0) {
+            wait_for (fd, POLLIN);
+            ret = receive_all (fd, buf + MB2_HEADER_SIZE,
+                               len - MB2_HEADER_SIZE);
+        }
+        return ret < 0 ? ret : len;
+    }
+
+    do {
+        ret = recv (fd, buf, size, 0);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    if (ret == -1) {
+        perror ("recv");
+        return MB_IO;
+    }
+    if (ret == 0)
+        return MB_IO;
+
+    /* A packet holds whole frames and nothing else */
+    for (off = 0; off < ret; off += len) {
+        len = mb2_frame_size (buf + off, ret - off);
+        if (len <= 0)
+            return MB_BAD_PARAM;
+    }
+    return ret;
+}
+
 int
 mb_receive_response_and_decode(int fd, int id, MbCodes code, int* param)
 {
@@ -121,6 +278,16 @@ mb_socket_name(char* buffer, size_t length)
     snprintf (buffer, length, "%s/%s", dir, MB_SOCKET_NAME);
 }
 
+void
+mb_seqpacket_name(char* buffer, size_t length)
+{
+    const char* dir = getenv("LXK_RUNTIME_DIR");
+    if (!dir)
+        dir = ".";
+
+    snprintf (buffer, length, "%s/%s.seq", dir, MB_SOCKET_NAME);
+}
+
 const char* 
 mb_code_name(MbCodes code)
 {
@@ -137,7 +304,9 @@ mb_code_name(MbCodes code)
         "QUERY_AVAILABLE",
         "AVAILABLE",
         "TOTAL",
-        "DENY"
+        "DENY",
+        "DEADLINE",
+        "HELLO"
     };
 
     if (code >= NUM_MB_CODES)
@@ -0,0 +1,427 @@
+/* membroker - A service to cooperatively manage memory usage system-wide
+ *
+ * Copyright © 2013 Lexmark International
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * (the "LGPL").
+ *
+ * You should have received a copy of the LGPL along with this library
+ * in the file COPYING; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY
+ * OF ANY KIND, either express or implied.
+ *
+ * The Original Code is the membroker service, and client library.
+ *
+ * The Initial Developer of the Original Code is Lexmark International, Inc.
+ * Author: Ian Watkins
+ *
+ * Commercial licensing is available. See the file COPYING for contact
+ * information.
+ */
+#include "mblog.h"
+#include "mbprivate.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RING_MASK (MBLOG_RECORDS - 1)
+
+/*
+ * The drain thread sleeps until the broker puts something in an empty ring;
+ * this is only a backstop, in case a wakeup ever goes astray
+ */
+#define DRAIN_BACKSTOP_MS 1000
+
+static const unsigned char event_level[NUM_LOG_EVENTS] = {
+    [LOG_SHARE_QUERY] = MBLOG_INFO,
+    [LOG_SEND_ERROR] = MBLOG_ERROR,
+    [LOG_QUEUE_FULL] = MBLOG_ERROR,
+    [LOG_QUEUE_DROPPED] = MBLOG_ERROR,
+    [LOG_SEND_FAILED] = MBLOG_ERROR,
+    [LOG_CONNECTION_REFUSED] = MBLOG_ERROR,
+    [LOG_POOL_EXHAUSTED] = MBLOG_ERROR,
+    [LOG_PROCESSED] = MBLOG_INFO,
+    [LOG_SHARE_FAILED] = MBLOG_INFO,
+    [LOG_RETURN] = MBLOG_INFO,
+    [LOG_CANT_RETURN] = MBLOG_INFO,
+    [LOG_CLOSE] = MBLOG_INFO,
+    [LOG_BAD_REGISTRATION] = MBLOG_ERROR,
+    [LOG_ALREADY_REGISTERED] = MBLOG_ERROR,
+    [LOG_REGISTER_FAILED] = MBLOG_ERROR,
+    [LOG_WRONG_ID] = MBLOG_ERROR,
+    [LOG_IMMEDIATE] = MBLOG_MESSAGE,
+    [LOG_PAGES_RETURNED] = MBLOG_MESSAGE,
+    [LOG_PAGES_SHARED] = MBLOG_MESSAGE,
+    [LOG_TERMINATED] = MBLOG_INFO,
+    [LOG_REGISTER] = MBLOG_INFO,
+    [LOG_EXPIRED] = MBLOG_INFO,
+    [LOG_ESCALATED] = MBLOG_INFO,
+    [LOG_SHARE_STALLED] = MBLOG_ERROR,
+    [LOG_STALE_SHARE] = MBLOG_INFO,
+    [LOG_BAD_FRAME] = MBLOG_ERROR,
+    [LOG_RING_BUSY] = MBLOG_ERROR,
+    [LOG_SUPPRESSED] = MBLOG_ERROR,
+    [LOG_LOST] = MBLOG_ERROR,
+    [LOG_RESOLVE] = MBLOG_ERROR,
+};
+
+static inline uint64_t
+now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+format_record (struct mblog * log, const struct mblog_record * r)
+{
+    FILE * fp = log->fp;
+    char name[MBNAME_MAX];
+
+    if (r->event == LOG_RESOLVE) {
+        mbname_refresh (log->names, r->pid);
+        return;
+    }
+    mbname_lookup (log->names, r->pid, name, sizeof (name));
+
+    switch (r->event) {
+    case LOG_SHARE_QUERY:
+        fprintf (fp, "mbserver: %s %lld pages from %s (%d)\n",
+                 r->code == REQUEST ? "request" : "reserve",
+                 (long long) r->a, name, r->id);
+        break;
+    case LOG_SEND_ERROR:
+        fprintf (fp, "mbserver: Send error to (%d)-\"%s\"\n", r->id, name);
+        break;
+    case LOG_QUEUE_FULL:
+        fprintf (fp, "mbserver: output queue full for (%d)-\"%s\", dropping %s\n",
+                 r->id, name, mb_code_name (r->code));
+        break;
+    case LOG_QUEUE_DROPPED:
+        fprintf (fp, "mbserver: dropped %d messages to (%d)-\"%s\"\n",
+                 (int) r->a, r->id, name);
+        break;
+    case LOG_SEND_FAILED:
+        fprintf (fp, "mbserver: send to (%d)-\"%s\" failed: %s\n",
+                 r->id, name, strerror ((int) r->a));
+        break;
+    case LOG_CONNECTION_REFUSED:
+        fprintf (fp, "mbserver: out of memory, refusing connection\n");
+        break;
+    case LOG_POOL_EXHAUSTED:
+        fprintf (fp, "mbserver: request pool exhausted\n");
+        break;
+    case LOG_PROCESSED:
+        fprintf (fp, "mbserver: processed client (%d)-\"%s\"  - %lld of %lld pages in %ld.%09ld sec.\n",
+                 r->id, name, (long long) r->a, (long long) r->b,
+                 (long) (r->elapsed / 1000000000),
+                 (long) (r->elapsed % 1000000000));
+        break;
+    case LOG_SHARE_FAILED:
+        fprintf (fp, "mbserver: process_request_queue: %lld pages to (%d)-\"%s\" wait for its queue to drain\n",
+                 (long long) r->a, r->id, name);
+        break;
+    case LOG_RETURN:
+        fprintf (fp, "mbserver: return %lld pages to (%d)-\"%s\"\n",
+                 (long long) r->a, r->id, name);
+        break;
+    case LOG_CANT_RETURN:
+        fprintf (fp, "mbserver: Can't return shared pages -- request queue non empty\n");
+        break;
+    case LOG_CLOSE:
+        fprintf (fp, "non terminus close - (%d)-\"%s\"\n", r->id, name);
+        break;
+    case LOG_BAD_REGISTRATION:
+        fprintf (fp, "Bad registration op %s\n", mb_code_name (r->code));
+        break;
+    case LOG_ALREADY_REGISTERED:
+        fprintf (fp, "mbserver: client (%d) is already registered\n", r->id);
+        break;
+    case LOG_REGISTER_FAILED:
+        fprintf (fp, "mbserver: out of memory, cannot register client (%d)\n",
+                 r->id);
+        break;
+    case LOG_WRONG_ID:
+        fprintf (fp, "mbserver: (%d)-\"%s\" sent %s for client (%d)\n",
+                 r->id, name, mb_code_name (r->code), (int) r->a);
+        break;
+    case LOG_IMMEDIATE:
+        fprintf (fp, "Immediate Request processed: %s (%d) - SHARE %lld\n",
+                 name, r->id, (long long) r->a);
+        break;
+    case LOG_PAGES_RETURNED:
+        fprintf (fp, "mbserver: Pages Returned: %lld\n", (long long) r->a);
+        break;
+    case LOG_PAGES_SHARED:
+        fprintf (fp, "mbserver: Pages Shared: %lld\n", (long long) r->a);
+        break;
+    case LOG_TERMINATED:
+        fprintf (fp, "mbserver: client (%d)-\"%s\" terminated, reclaimed %lld pages\n",
+                 r->id, name, (long long) r->a);
+        break;
+    case LOG_REGISTER:
+        fprintf (fp, "mbserver: Register client (%d)-\"%s\"\n", r->id, name);
+        break;
+    case LOG_EXPIRED:
+        fprintf (fp, "mbserver: %s from (%d)-\"%s\" timed out with %lld of %lld pages\n",
+                 r->code == REQUEST ? "request" : "reserve",
+                 r->id, name, (long long) r->a, (long long) r->b);
+        break;
+    case LOG_ESCALATED:
+        fprintf (fp, "mbserver: request from (%d)-\"%s\" for %lld more pages escalated to reserve\n",
+                 r->id, name, (long long) r->a);
+        break;
+    case LOG_SHARE_STALLED:
+        fprintf (fp, "mbserver: (%d)-\"%s\" did not answer %s %lld pages in time (%d in a row)\n",
+                 r->id, name, r->code == REQUEST ? "request" : "reserve",
+                 (long long) r->a, (int) r->b);
+        break;
+    case LOG_STALE_SHARE:
+        fprintf (fp, "mbserver: late share of %lld pages from (%d)-\"%s\"\n",
+                 (long long) r->a, r->id, name);
+        break;
+    case LOG_BAD_FRAME:
+        fprintf (fp, "mbserver: (%d)-\"%s\" sent a bad v2 frame (%s), dropping it\n",
+                 r->id, name, mb_code_name (r->code));
+        break;
+    case LOG_RING_BUSY:
+        fprintf (fp, "mbserver: io_uring submission queue full for (%d)-\"%s\": %s\n",
+                 r->id, name, strerror ((int) r->a));
+        break;
+    case LOG_SUPPRESSED:
+        fprintf (fp, "mbserver: %d per-message log lines suppressed\n", (int) r->a);
+        break;
+    case LOG_LOST:
+        fprintf (fp, "mbserver: log ring full, %d records lost\n", (int) r->a);
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Waits for the broker to say there is something to write, unless there
+ * already is.  Saying it is asleep before looking at the ring one last
+ * time means a record published meanwhile always gets a wakeup.
+ */
+static void
+drain_wait (struct mblog * log, unsigned int tail)
+{
+    struct pollfd pfd;
+    uint64_t count;
+
+    __atomic_store_n (&log->sleeping, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&log->head, __ATOMIC_SEQ_CST) != tail ||
+        !__atomic_load_n (&log->running, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n (&log->sleeping, 0, __ATOMIC_SEQ_CST);
+        return;
+    }
+
+    pfd.fd = log->wake_fd;
+    pfd.events = POLLIN;
+    if (poll (&pfd, 1, DRAIN_BACKSTOP_MS) > 0 &&
+        read (log->wake_fd, &count, sizeof (count)) < 0 && errno != EAGAIN)
+        perror ("mblog: read wake fd");
+    __atomic_store_n (&log->sleeping, 0, __ATOMIC_SEQ_CST);
+}
+
+static void
+drain_wake (struct mblog * log)
+{
+    uint64_t one = 1;
+
+    if (write (log->wake_fd, &one, sizeof (one)) < 0 && errno != EAGAIN)
+        perror ("mblog: wake drain thread");
+}
+
+static void *
+drain_thread (void * param)
+{
+    struct mblog * log = (struct mblog *) param;
+
+    for (;;) {
+        int running = __atomic_load_n (&log->running, __ATOMIC_ACQUIRE);
+        unsigned int head = __atomic_load_n (&log->head, __ATOMIC_ACQUIRE);
+        unsigned int tail = log->tail;
+
+        if (tail == head) {
+            if (!running)
+                break;
+            drain_wait (log, tail);
+            continue;
+        }
+
+        while (tail != head) {
+            format_record (log, &log->ring[tail & RING_MASK]);
+            tail++;
+            __atomic_store_n (&log->tail, tail, __ATOMIC_RELEASE);
+        }
+    }
+
+    return NULL;
+}
+
+int
+mblog_init (struct mblog * log, FILE * fp, struct mbname_cache * names)
+{
+    memset (log, 0, sizeof (*log));
+    log->fp = fp;
+    log->names = names;
+    log->level = MBLOG_DEFAULT;
+    log->rate = 1000;
+
+    log->ring = calloc (MBLOG_RECORDS, sizeof (struct mblog_record));
+    if (!log->ring) {
+        perror ("mblog_init(): calloc");
+        return -1;
+    }
+    return 0;
+}
+
+int
+mblog_start (struct mblog * log)
+{
+    int rc;
+
+    log->wake_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (log->wake_fd == -1) {
+        /* Not fatal; records get formatted on the spot instead */
+        fprintf (log->fp, "mbserver: no log thread: %s\n", strerror (errno));
+        return -1;
+    }
+
+    __atomic_store_n (&log->running, 1, __ATOMIC_RELEASE);
+    rc = pthread_create (&log->thread, NULL, &drain_thread, log);
+    if (rc != 0) {
+        fprintf (log->fp, "mbserver: no log thread: %s\n", strerror (rc));
+        close (log->wake_fd);
+        return -1;
+    }
+    log->started = 1;
+    return 0;
+}
+
+void
+mblog_stop (struct mblog * log)
+{
+    if (!log->started)
+        return;
+
+    __atomic_store_n (&log->running, 0, __ATOMIC_SEQ_CST);
+    drain_wake (log);
+    pthread_join (log->thread, NULL);
+    close (log->wake_fd);
+    log->started = 0;
+}
+
+/* Frees the ring of a log that has been stopped */
+void
+mblog_destroy (struct mblog * log)
+{
+    free (log->ring);
+    log->ring = NULL;
+}
+
+static inline struct mblog_record *
+claim (struct mblog * log)
+{
+    unsigned int head = log->head;
+
+    if (head - __atomic_load_n (&log->tail, __ATOMIC_ACQUIRE) >= MBLOG_RECORDS)
+        return NULL;
+    return &log->ring[head & RING_MASK];
+}
+
+/* Only a drain thread that has gone to sleep on an empty ring needs waking */
+static inline void
+publish (struct mblog * log)
+{
+    __atomic_store_n (&log->head, log->head + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&log->sleeping, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n (&log->sleeping, 0, __ATOMIC_SEQ_CST))
+        drain_wake (log);
+}
+
+static void
+put (struct mblog * log, uint64_t stamp, MbLogEvent event, int code, int id,
+     int64_t a, int64_t b, int pid, uint64_t elapsed)
+{
+    struct mblog_record local;
+    struct mblog_record * r = log->started ? claim (log) : &local;
+
+    /* Without the drain thread, names are looked up when a line needs one */
+    if (event == LOG_RESOLVE && !log->started)
+        return;
+
+    if (!r) {
+        log->lost++;
+        return;
+    }
+
+    r->stamp = stamp;
+    r->elapsed = elapsed;
+    r->event = event;
+    r->code = code;
+    r->id = id;
+    r->a = a;
+    r->b = b;
+    r->pid = pid;
+
+    if (log->started)
+        publish (log);
+    else
+        format_record (log, r);
+}
+
+/*
+ * Logs an event from the broker thread.  Never blocks: with the drain
+ * thread running this is a copy into the ring.
+ */
+void
+mblog_event (struct mblog * log, MbLogEvent event, int code, int id,
+             int64_t a, int64_t b, int pid, uint64_t elapsed)
+{
+    int level = event_level[event];
+    uint64_t stamp;
+
+    if (level > __atomic_load_n (&log->level, __ATOMIC_RELAXED))
+        return;
+
+    stamp = now_ns ();
+
+    if (log->lost && log->started && claim (log)) {
+        put (log, stamp, LOG_LOST, 0, 0, log->lost, 0, 0, 0);
+        log->lost = 0;
+    }
+
+    if (level == MBLOG_MESSAGE) {
+        unsigned int rate = __atomic_load_n (&log->rate, __ATOMIC_RELAXED);
+        uint64_t second = stamp / 1000000000;
+
+        if (second != log->window) {
+            log->window = second;
+            log->window_count = 0;
+            if (log->suppressed) {
+                put (log, stamp, LOG_SUPPRESSED, 0, 0, log->suppressed, 0,
+                     0, 0);
+                log->suppressed = 0;
+            }
+        }
+        if (rate && log->window_count++ >= rate) {
+            log->suppressed++;
+            return;
+        }
+    }
+
+    put (log, stamp, event, code, id, a, b, pid, elapsed);
+}
@@ -0,0 +1,126 @@
+/* membroker - A service to cooperatively manage memory usage system-wide
+ *
+ * Copyright © 2013 Lexmark International
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * (the "LGPL").
+ *
+ * You should have received a copy of the LGPL along with this library
+ * in the file COPYING; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY
+ * OF ANY KIND, either express or implied.
+ *
+ * The Original Code is the membroker service, and client library.
+ *
+ * The Initial Developer of the Original Code is Lexmark International, Inc.
+ * Author: Ian Watkins
+ *
+ * Commercial licensing is available. See the file COPYING for contact
+ * information.
+ */
+#ifndef MB_LOG_H
+#define MB_LOG_H
+
+#include "mb.h"
+#include "mbname.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * The broker logs into an in-memory ring of small binary records.  A
+ * separate thread turns them into text, so a slow log consumer can never
+ * hold up scheduling.  If the ring fills, records are dropped and counted.
+ */
+
+typedef enum {
+    MBLOG_ERROR = 0,    /* things going wrong */
+    MBLOG_INFO,         /* scheduling decisions */
+    MBLOG_MESSAGE,      /* a line per client message; sampled */
+    MBLOG_DEFAULT = MBLOG_MESSAGE
+} MbLogLevel;
+
+typedef enum {
+    LOG_SHARE_QUERY,
+    LOG_SEND_ERROR,
+    LOG_QUEUE_FULL,
+    LOG_QUEUE_DROPPED,
+    LOG_SEND_FAILED,
+    LOG_CONNECTION_REFUSED,
+    LOG_POOL_EXHAUSTED,
+    LOG_PROCESSED,
+    LOG_SHARE_FAILED,
+    LOG_RETURN,
+    LOG_CANT_RETURN,
+    LOG_CLOSE,
+    LOG_BAD_REGISTRATION,
+    LOG_ALREADY_REGISTERED,
+    LOG_REGISTER_FAILED,
+    LOG_WRONG_ID,
+    LOG_IMMEDIATE,
+    LOG_PAGES_RETURNED,
+    LOG_PAGES_SHARED,
+    LOG_TERMINATED,
+    LOG_REGISTER,
+    LOG_EXPIRED,
+    LOG_ESCALATED,
+    LOG_SHARE_STALLED,
+    LOG_STALE_SHARE,
+    LOG_BAD_FRAME,
+    LOG_RING_BUSY,
+    LOG_SUPPRESSED,     /* internal */
+    LOG_LOST,           /* internal */
+    LOG_RESOLVE,        /* internal: look up a client's name */
+    NUM_LOG_EVENTS
+} MbLogEvent;
+
+struct mblog_record {
+    uint64_t stamp;         /* CLOCK_MONOTONIC, ns */
+    uint64_t elapsed;       /* ns, for LOG_PROCESSED */
+    int64_t a;              /* usually a page count */
+    int64_t b;
+    uint16_t event;
+    uint16_t code;
+    int32_t id;
+    int32_t pid;            /* client name, resolved by the drain thread */
+};
+
+/* Must be a power of two */
+#define MBLOG_RECORDS 4096
+
+struct mblog {
+    FILE * fp;
+    struct mbname_cache * names;
+    int level;
+    unsigned int rate;          /* MBLOG_MESSAGE lines per second, 0 = all */
+
+    /* Producer side; only the broker thread touches these */
+    uint64_t window;            /* second the rate count applies to */
+    unsigned int window_count;
+    unsigned int suppressed;
+    unsigned int lost;
+
+    /* Written by the producer, read by the drain thread and vice versa */
+    unsigned int head;
+    unsigned int tail;
+
+    int running;
+    int started;
+    int sleeping;               /* the drain thread waits on wake_fd */
+    int wake_fd;
+    pthread_t thread;
+    struct mblog_record * ring;
+};
+
+int mblog_init (struct mblog * log, FILE * fp, struct mbname_cache * names);
+int mblog_start (struct mblog * log);
+void mblog_stop (struct mblog * log);
+void mblog_destroy (struct mblog * log);
+void mblog_event (struct mblog * log, MbLogEvent event, int code, int id,
+                  int64_t a, int64_t b, int pid, uint64_t elapsed);
+
+#endif
@@ -0,0 +1,228 @@
+/* membroker - A service to cooperatively manage memory usage system-wide
+ *
+ * Copyright © 2013 Lexmark International
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * (the "LGPL").
+ *
+ * You should have received a copy of the LGPL along with this library
+ * in the file COPYING; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY
+ * OF ANY KIND, either express or implied.
+ *
+ * The Original Code is the membroker service, and client library.
+ *
+ * The Initial Developer of the Original Code is Lexmark International, Inc.
+ * Author: Ian Watkins
+ *
+ * Commercial licensing is available. See the file COPYING for contact
+ * information.
+ */
+#include "mbname.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void
+read_cmdline (int pid, char * cmdline, size_t size)
+{
+    int fd;
+    char fname[64];
+    char buffer[1024];
+    size_t len;
+
+    snprintf (fname, sizeof (fname), "/proc/%d/cmdline", pid);
+
+    do {
+        fd = open (fname, O_RDONLY);
+    } while (fd == -1 && errno == EINTR);
+
+    if (fd == -1) {
+        snprintf (buffer, sizeof (buffer), "unknown");
+
+    } else {
+        char * cmd;
+        int bytes = 0;
+
+        do {
+            /* the cmdline file is not necessarily terminated.  Leave space. */
+            bytes = read (fd, buffer, sizeof (buffer) - 1);
+        } while (bytes < 0 && errno == EINTR);
+
+        if (bytes < 0) {
+            /* holy carp, how'd that happen? */
+            snprintf (buffer, sizeof (buffer), "unknown");
+
+        } else {
+            /* ensure termination */
+            buffer[bytes] = '\0';
+        }
+
+        close (fd);
+
+        /*
+         * /proc/pid/cmdline contains the entire command line, as fed to
+         * main()...  It has nul chars between the arguments.  So, we
+         * probably also read quite a lot of the arguments, but strlen(),
+         * strrchr(), and other string functions will stop at the first nul,
+         * which is the end of the program name.
+         *
+         * For a client that may have many instances of the same executable,
+         * the full command line could be very useful...  but just as easily
+         * could be a long string of unhelpful junk.
+         */
+
+        /* Strip off the leading path. */
+        cmd = strrchr (buffer, '/');
+
+        if (cmd) {
+            memmove (buffer, cmd + 1, strlen (cmd));
+        }
+    }
+
+    /* Names longer than the slot are cut short */
+    len = strnlen (buffer, size - 1);
+    memcpy (cmdline, buffer, len);
+    cmdline[len] = '\0';
+}
+
+int
+mbname_init (struct mbname_cache * cache)
+{
+    memset (cache, 0, sizeof (*cache));
+    pthread_mutex_init (&cache->lock, NULL);
+
+    cache->table = calloc (MBNAME_SETS * MBNAME_WAYS,
+                           sizeof (struct mbname_entry));
+    if (!cache->table) {
+        perror ("mbname_init(): calloc");
+        return -1;
+    }
+    return 0;
+}
+
+void
+mbname_destroy (struct mbname_cache * cache)
+{
+    free (cache->table);
+    cache->table = NULL;
+    pthread_mutex_destroy (&cache->lock);
+}
+
+static inline struct mbname_entry *
+set_for (struct mbname_cache * cache, int pid)
+{
+    /* Fibonacci hashing; pids handed out in a burst are consecutive */
+    unsigned int set = ((unsigned int) pid * 2654435761u) >> 16;
+
+    return &cache->table[(set & (MBNAME_SETS - 1)) * MBNAME_WAYS];
+}
+
+/* Caller holds the lock */
+static struct mbname_entry *
+find (struct mbname_cache * cache, int pid)
+{
+    struct mbname_entry * set = set_for (cache, pid);
+    int i;
+
+    for (i = 0; i < MBNAME_WAYS; i++)
+        if (set[i].pid == pid)
+            return &set[i];
+    return NULL;
+}
+
+/* Caller holds the lock */
+static void
+store (struct mbname_cache * cache, int pid, const char * name)
+{
+    struct mbname_entry * entry = find (cache, pid);
+
+    if (!entry) {
+        struct mbname_entry * set = set_for (cache, pid);
+        int i;
+
+        entry = &set[0];
+        for (i = 1; i < MBNAME_WAYS; i++)
+            if (set[i].used < entry->used)
+                entry = &set[i];
+        entry->pid = pid;
+    }
+    entry->used = ++cache->tick;
+    snprintf (entry->name, sizeof (entry->name), "%s", name);
+}
+
+/*
+ * Reads the command line of pid, replacing whatever was cached for it.
+ * Used when a client registers, since pids get reused.
+ */
+void
+mbname_refresh (struct mbname_cache * cache, int pid)
+{
+    char name[MBNAME_MAX];
+
+    if (pid <= 0)
+        return;
+
+    /* The lock is not held across the read */
+    read_cmdline (pid, name, sizeof (name));
+
+    pthread_mutex_lock (&cache->lock);
+    cache->reads++;
+    store (cache, pid, name);
+    pthread_mutex_unlock (&cache->lock);
+}
+
+/*
+ * Copies the command line of pid into buf if it is cached.  Returns buf,
+ * or NULL if it is not.
+ */
+const char *
+mbname_peek (struct mbname_cache * cache, int pid, char * buf, size_t size)
+{
+    struct mbname_entry * entry;
+
+    if (pid <= 0)
+        return NULL;
+
+    pthread_mutex_lock (&cache->lock);
+    entry = find (cache, pid);
+    if (entry) {
+        entry->used = ++cache->tick;
+        snprintf (buf, size, "%s", entry->name);
+    }
+    pthread_mutex_unlock (&cache->lock);
+    return entry ? buf : NULL;
+}
+
+/*
+ * Copies the command line of pid into buf, reading it from /proc if it
+ * is not cached.  Returns buf.
+ */
+const char *
+mbname_lookup (struct mbname_cache * cache, int pid, char * buf, size_t size)
+{
+    struct mbname_entry * entry;
+
+    if (pid <= 0) {
+        snprintf (buf, size, "unknown");
+        return buf;
+    }
+
+    if (mbname_peek (cache, pid, buf, size))
+        return buf;
+
+    mbname_refresh (cache, pid);
+
+    pthread_mutex_lock (&cache->lock);
+    entry = find (cache, pid);
+    snprintf (buf, size, "%s", entry ? entry->name : "unknown");
+    pthread_mutex_unlock (&cache->lock);
+    return buf;
+}
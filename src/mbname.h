@@ -0,0 +1,64 @@
+/* membroker - A service to cooperatively manage memory usage system-wide
+ *
+ * Copyright © 2013 Lexmark International
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * (the "LGPL").
+ *
+ * You should have received a copy of the LGPL along with this library
+ * in the file COPYING; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY
+ * OF ANY KIND, either express or implied.
+ *
+ * The Original Code is the membroker service, and client library.
+ *
+ * The Initial Developer of the Original Code is Lexmark International, Inc.
+ * Author: Ian Watkins
+ *
+ * Commercial licensing is available. See the file COPYING for contact
+ * information.
+ */
+#ifndef MB_NAME_H
+#define MB_NAME_H
+
+#include <pthread.h>
+
+/*
+ * Client command lines, keyed by pid.  Reading /proc is left to whoever
+ * needs a name (the log thread, a status dump), never to registration.
+ * The table has a fixed size; the least recently used entry of a set
+ * makes way for a new pid.
+ */
+
+#define MBNAME_MAX 128
+
+/* Must be a power of two */
+#define MBNAME_SETS 64
+#define MBNAME_WAYS 4
+
+struct mbname_entry {
+    int pid;                    /* 0 = empty */
+    unsigned int used;          /* lru stamp */
+    char name[MBNAME_MAX];
+};
+
+struct mbname_cache {
+    pthread_mutex_t lock;
+    unsigned int tick;
+    unsigned long reads;        /* /proc lookups so far */
+    struct mbname_entry * table;
+};
+
+int mbname_init (struct mbname_cache * cache);
+void mbname_destroy (struct mbname_cache * cache);
+void mbname_refresh (struct mbname_cache * cache, int pid);
+const char * mbname_peek (struct mbname_cache * cache, int pid,
+                          char * buf, size_t size);
+const char * mbname_lookup (struct mbname_cache * cache, int pid,
+                            char * buf, size_t size);
+
+#endif
@@ -27,10 +27,52 @@
 
 #include "mb.h"
 #include <unistd.h>
+
+/* A message on the wire: id, code and param, each a 32 bit big endian int */
+#define MB_FRAME_SIZE (sizeof(int) * 3)
+
+/*
+ * Protocol v2.  A client that wants it follows its REGISTER with a TOTAL
+ * carrying MB_HELLO_V2.  A server that speaks it answers with a HELLO
+ * instead of the total and from then on both sides send frames: a native
+ * endian uint32 byte count, then that many bytes of MbOps.  Connections on
+ * the SOCK_SEQPACKET socket are v2 from the start.
+ */
+#define MB_HELLO_V2 0x4d420002
+#define MB2_HEADER_SIZE sizeof(uint32_t)
+#define MB2_OP_SIZE sizeof(MbOp)
+#define MB2_MAX_OPS 16
+#define MB2_FRAME_MAX (MB2_HEADER_SIZE + MB2_MAX_OPS * MB2_OP_SIZE)
+
+/* Most a peer sends in one write; a SOCK_SEQPACKET reader needs this room */
+#define MB2_PACKET_MAX 1024
+
+/* REGISTER as a v2 op carries the id in its tag, the source pages in param */
+#define MB2_BIDI 1
+
+/*
+ * A v2 client may count in granules of 2^shift EXEC_PAGESIZE pages, e.g.
+ * huge pages.  The shift goes in bits 8-15 of the REGISTER op's flags, or of
+ * the TOTAL that asks for v2 on a stream (MB_HELLO_V2's are clear).  Every
+ * count either side sends from then on is in granules.
+ */
+#define MB_GRANULE_SHIFT_MAX 30
+#define MB_GRANULE_BITS(shift) ((uint32_t) (shift) << 8)
+#define MB_GRANULE_SHIFT(bits) (((bits) >> 8) & 0xff)
+
+void mb_encode (int id, MbCodes code, int param, unsigned char * buf);
+void mb_decode (const unsigned char * buf, int* id, MbCodes* code, int* param);
 int mb_encode_and_send (int id, int fd, MbCodes code, int param);
 int mb_receive_and_decode (int fd, int* id, MbCodes* code, int *param);
 int mb_receive_response_and_decode (int fd, int id, MbCodes code, int *param);
+size_t mb2_encode (const MbOp * ops, unsigned int n, unsigned char * buf);
+int mb2_frame_size (const unsigned char * buf, size_t len);
+void mb2_decode_op (const unsigned char * buf, MbOp * op);
+int mb_send_all (int fd, const unsigned char * buf, size_t len);
+int mb2_send (int fd, const MbOp * ops, unsigned int n);
+int mb2_receive (int fd, int seqpacket, unsigned char * buf, size_t size);
 void mb_socket_name(char* buffer, size_t length);
+void mb_seqpacket_name(char* buffer, size_t length);
 const char* mb_code_name(MbCodes code);
 
 #endif
@@ -26,24 +26,48 @@
 #include "mb.h"
 #include "mbprivate.h"
 #include "mbserver.h"
+#include "mblog.h"
+#include "mbname.h"
+#include "mbtimer.h"
+#if HAVE_IO_URING
+#include "mburing.h"
+#endif
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <malloc.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/param.h>
-#include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 
-#define min(a,b) ((a) < (b)) ? (a) : (b)
-#define max(a,b) ((a) > (b)) ? (a) : (b)
+#define min(a,b) (((a) < (b)) ? (a) : (b))
+#define max(a,b) (((a) > (b)) ? (a) : (b))
+
+/*
+ * The books are kept in EXEC_PAGESIZE pages, in 64 bits.  No one count may
+ * go over MAX_PAGES, which leaves room to add up a great many of them.
+ */
+#define MAX_PAGES (INT64_C(1) << 48)
+
+/* How register_client() is told a client is bidi */
+#define REGISTER_BIDI (INT64_C(1) << 62)
 
 #if defined(_POSIX_TIMERS) && _POSIX_TIMERS > 0
 #if defined(_POSIX_MONOTONIC_CLOCK) && (_POSIX_MONOTONIC_CLOCK >= 0)
@@ -83,56 +107,251 @@ typedef enum {
 #define is_share_outstanding(client) \
     (client->share_type != INVALID && client->needed_pages > 0)
 
-#define set_share_outstanding(client) \
-    (client->needed_pages = -client->needed_pages)
+/*
+ * Client slots: every registered client owns a small dense index, so the
+ * per-client flags request_pages() filters on can be kept as bitmaps and
+ * tested a word (64 clients) at a time.
+ */
+#define SLOT_BITS 64
+#define slot_word(slot) ((slot) / SLOT_BITS)
+#define slot_bit(slot) (UINT64_C(1) << ((slot) % SLOT_BITS))
+#define test_slot(mask, slot) ((mask)[slot_word(slot)] & slot_bit(slot))
+#define set_slot(mask, slot) ((mask)[slot_word(slot)] |= slot_bit(slot))
+#define clear_slot(mask, slot) ((mask)[slot_word(slot)] &= ~slot_bit(slot))
+
+/*
+ * Clients and requests come from slab pools that only grow when a client
+ * connects or registers, so serving requests never touches the heap.
+ */
+#define SLAB_OBJECTS 64
+
+/*
+ * Messages to a client are queued and written out once per wakeup, so a
+ * client that is slow to read never holds up the others.
+ */
+#define OUT_FRAMES 32
+
+/* Input is read in chunks of up to this many messages */
+#define IN_FRAMES 32
+
+/* ... of either protocol, v2 ones one to a frame at worst */
+#define OUT_BYTES (OUT_FRAMES * (MB2_HEADER_SIZE + MB2_OP_SIZE))
+#define IN_BYTES (IN_FRAMES * (MB2_HEADER_SIZE + MB2_OP_SIZE))
+
+/*
+ * The last few frames of the output ring are kept for the messages that
+ * move pages, SHAREs and RETURNs, so answers to queries can not crowd them
+ * out.  Should one still not fit, its pages stay put and it goes again once
+ * the client has read its queue.
+ */
+#define OUT_RESERVED (4 * (MB2_HEADER_SIZE + MB2_OP_SIZE))
+
+/* Debug socket readers served at once; the rest are turned away */
+#define MAX_DEBUG_DUMPS 4
+
+#if HAVE_IO_URING
+/*
+ * Each connection has at most a recv and a send in flight.  The completion
+ * queue is sized so it rarely spills into the kernel's overflow list.
+ */
+#define URING_ENTRIES 256
+#define URING_CQ_ENTRIES 16384
+
+/* user_data of a completion: a listen socket, or a client and an op */
+#define URING_IGNORE 0
+#define URING_ACCEPT_CLIENT 1
+#define URING_ACCEPT_DEBUG 2
+#define URING_TIMER 3
+#define URING_ACCEPT_SEQ 4
+#define URING_RECV 1
+#define URING_SEND 2
+#define URING_OP_MASK 7
+#endif
+
+/* Request deadlines are kept on a wheel of millisecond ticks */
+#define TICK_NS 1000000
+
+/* What a timer on the wheel belongs to */
+#define TIMER_REQUEST 0
+#define TIMER_CLIENT 1          /* share query deadline, then cooldown */
+#define TIMER_REPAY 2           /* pages held back from sources may go */
+
+/* A client that keeps stalling sits out at most this many times longer */
+#define MAX_COOLDOWN_SHIFT 6
+
+/* How long what a client said it could share is relied on, in ms */
+#define AVAILABLE_MAX_AGE 1000
+
+/* Index of an anxiety level in a client's estimates and share history */
+#define level_index(type) ((type) == RESERVE)
+
+/*
+ * Share history.  What a new answer counts for in a client's averages, and
+ * how long it takes for what they say to count half as much; the rest is
+ * made up from what an untried client is assumed to do.
+ */
+#define STATS_WEIGHT 0.25
+#define STATS_HALF_LIFE 5000        /* ms */
+#define STATS_PRIOR_LATENCY 0.0     /* ms */
+
+/* A client that DENYs more than this often at REQUEST is not asked there */
+#define DENIER_RATE 0.75
+#define DENIER_ANSWERS 4            /* ... once it has answered this often */
+
+/*
+ * Lookahead.  What a new request counts for in the average request size,
+ * and how many queued requests' worth of pages a share query may ask for
+ * over what it is for.
+ */
+#define LOOKAHEAD_WEIGHT 0.25
+#define LOOKAHEAD_DEPTH 4
+
+/*
+ * A source asked for pages this soon after it was repaid is seeing the same
+ * pages go back and forth.  With damping, its next repayment waits this
+ * long, twice as long for each time in a row, up to a limit.
+ */
+#define OSCILLATION_WINDOW 1000     /* ms */
+#define REPAY_BACKOFF 10            /* ms */
+#define MAX_REPAY_SHIFT 8
 
-#define clear_share(client) \
-    { \
-        client->share_type = INVALID; \
-        client->needed_pages = 0; \
-    } 
+/* Most shards mbs_set_shards() will run */
+#define MAX_SHARDS 64
 
 struct request;
+struct server;
+
+/* How a client has answered share queries at one anxiety level */
+struct share_stats {
+    unsigned int answers;
+    double latency;             /* ms, moving average */
+    double yield;               /* pages shared over pages asked for, ditto */
+    double denials;             /* how many of the answers were DENYs, ditto */
+    uint64_t updated;           /* tick of the last answer */
+};
+
+/* A connection on its way to the shard that owns its id */
+struct handoff {
+    int fd;
+    int seqpacket;
+    unsigned int len;
+    unsigned char data[IN_BYTES];   /* input read so far */
+    struct handoff * next;
+};
+
+struct shards {
+    unsigned int n;
+    struct server * shard[];    /* shard[0] is the one mbs_init() made */
+};
 
 struct client{
     int flags;
     int pid;    /* socket-reported pid of client */
     int id;     /* client-supplied id */
     int fd;
-    int pages;
-    int source_pages;
-    char * cmdline;
+    int registered;
+    int closing;
+    int failed;                 /* drop the connection */
+    int hangup;                 /* peer hung up; read on until EOF */
+    int slot;
+    int proto;                  /* 1, or 2 once the client asks for it */
+    int seqpacket;
+    unsigned int granule_shift; /* it counts in 2^shift pages; v2 only */
+    uint64_t request_tag;       /* echoed on the SHARE that answers it */
+    uint32_t request_flags;     /* ... and its flags */
+    unsigned int round;         /* last event loop round that served it */
+    int64_t pages;
+    int64_t source_pages;
     struct request * active_request;
+    int deadline;               /* ms a request may wait, 0 for the default */
     MbCodes share_type;
-    int needed_pages;
+    struct mbtimer timer;
+    unsigned int stalls;        /* share queries it never answered in time */
+    unsigned int strikes;       /* ... in a row */
+    unsigned int stale_replies; /* answers still due to timed out queries */
+    int64_t available[2];       /* pages it says it could share at REQUEST,
+                                   RESERVE */
+    uint64_t available_at[2];   /* ... as of this tick, 0 if it never said */
+    unsigned int available_due; /* AVAILABLE answers to polls still to come */
+    struct share_stats stats[2];    /* at REQUEST, RESERVE */
+    uint64_t asked_ns;          /* when its share query went out */
+    int64_t needed_pages;
+    int64_t lookahead;          /* ... of which nothing is waiting on yet */
+    int64_t shared;             /* what it has shared in chunks so far */
+    uint64_t repaid_at;         /* tick it was last repaid, 0 once asked */
+    unsigned int oscillations;  /* asked again soon after, times in a row */
+    uint64_t repay_after;       /* tick it may be repaid again */
     struct client * next;
+    struct client * prev;
+    struct client * hash_next;  /* id index chain */
+    struct client * next_closed;
+    struct client * next_ready;
+    struct client * next_flush;
+    int flush_queued;
+    int out_blocked;            /* waiting for EPOLLOUT */
+    unsigned int out_head;
+    unsigned int out_len;
+    unsigned int out_dropped;   /* since the queue last emptied */
+    int out_retry;              /* pages are waiting for the queue to empty */
+    unsigned int out_frame;     /* where the v2 frame still open for ops is */
+    unsigned int out_ops;       /* ... and how many it has, 0 if none */
+    unsigned char out[OUT_BYTES];
+    unsigned int in_len;
+    unsigned char in[IN_BYTES];
+#if HAVE_IO_URING
+    int inflight;               /* ring operations still pointing here */
+    int send_inflight;
+    struct msghdr msg;
+    struct iovec iov[2];
+    unsigned char uin[IN_BYTES];    /* recv lands here */
+#endif
 };
 
 typedef struct client Client;
 
-struct clientNode
-{
-    Client* client;
-    MbCodes code;
-    struct clientNode* next;
-};
-
-typedef struct clientNode ClientNode;
-
 struct request {
-    int needed_pages;
-    int acquired_pages;
+    int64_t needed_pages;
+    int64_t acquired_pages;
+    int64_t granted_pages;      /* sent the requester already */
+    int progressive;            /* grants pages as they come in */
     Client * requesting_client;
-    Client * sharing_client;
-    ClientNode* responded_clients;
+    unsigned int n_asking;      /* share queries out on its behalf */
+    /*
+     * Clients that have answered a share query for this request, by slot.
+     * The second third of the array marks the ones that answered at RESERVE,
+     * the last the ones it is waiting to hear from.
+     */
+    uint64_t * responded;
     struct request * next;
+    struct request * prev;
     struct timespec stamp;
+    struct mbtimer deadline;
     MbCodes type;
+    int escalated;              /* a REQUEST that ran out of time */
     int complete;
+    unsigned int seq;           /* queue order */
+    int dirty_index;            /* position in server->dirty, or -1 */
+    int blocked;
+    int asked;                  /* has had a share query lined up */
+    struct request * blocked_next;
+    struct request * blocked_prev;
+    struct request * next_complete;
 };
 
 typedef struct request Request;
 
+struct client_slab {
+    struct client_slab * next;
+    Client clients[SLAB_OBJECTS];
+};
+
+struct request_slab {
+    struct request_slab * next;
+    uint64_t * bitmaps;         /* the requests' responded arrays */
+    uint64_t * spare;           /* used while growing the slots */
+    Request requests[SLAB_OBJECTS];
+};
+
 typedef enum {
     PAGES = 1,
     CLIENT_REQUEST = 1<<1
@@ -141,1106 +360,4526 @@ typedef enum {
 struct server{
     struct sockaddr_un sock;
     int client_listen_fd;
+    struct sockaddr_un seq_sock;
+    int seq_listen_fd;          /* SOCK_SEQPACKET, v2 only; -1 if none */
     int shutdown;
-    int pages;
-    unsigned int source_pages;
+    int64_t pages;
+    int64_t source_pages;
+    int64_t client_source_pages;    /* sum of source_pages over clients */
     Client * client_list;
+    Client * client_tail;
     Request * queue;
+    Request * queue_tail;
+    Client ** id_table;         /* registered clients, hashed by id */
+    unsigned int id_buckets;    /* power of two */
+    unsigned int id_bits;       /* log2 (id_buckets) */
+    unsigned int n_clients;
+
+    /* Per-slot client flags, slot_words words each */
+    unsigned int slot_words;
+    Client ** slots;
+    uint64_t * used_mask;
+    uint64_t * bidi_mask;
+    uint64_t * source_mask;
+    uint64_t * requesting_mask;     /* has an active request */
+    uint64_t * requesting_low_mask; /* ... at REQUEST */
+    uint64_t * sharing_mask;        /* has a share query outstanding */
+    uint64_t * sharing_low_mask;    /* ... at REQUEST */
+    uint64_t * pending_mask;        /* share query about to be sent */
+    uint64_t * cooldown_mask;       /* stalled too often; not asked */
+    uint64_t * estimating_mask;     /* has said what it could share */
+    uint64_t * polled_mask;         /* ... and is yet to answer a poll */
+    uint64_t * polling_mask;        /* QUERY_AVAILABLE about to be sent */
+    uint64_t * candidate_scratch;
+
+    /*
+     * Scheduler work sets.  Only dirty requests are re-evaluated; blocked
+     * ones are waiting on a deferred client and become dirty again when any
+     * client's deferred status changes.
+     */
+    unsigned int request_seq;
+    Request ** dirty;           /* one per slot at most */
+    unsigned int n_dirty;
+    Request * blocked;
+    Request * completed;
+    Request * completed_tail;
+
+    /* Object pools; "next" links the free entries */
+    struct client_slab * client_slabs;
+    Client * free_clients;
+    unsigned int client_capacity;
+    struct request_slab * request_slabs;
+    Request * free_requests;
+    unsigned int request_capacity;
+    unsigned long allocs;
+    unsigned long frees;
+    int locked;                 /* mlockall() succeeded */
+
     int updates;
+    int update_pending;         /* run update_server() after this wakeup */
+
+    int request_timeout;        /* ms, 0 for no deadline */
+    int escalate;               /* a late REQUEST becomes a RESERVE first */
+    int share_timeout;          /* ms a client gets to answer, 0 for ever */
+    int fan_out;                /* a RESERVE asks several clients at once */
+    int adaptive_downgrade;     /* ... and skips the REQUEST to a source
+                                   that would fall short */
+    int batch_window;           /* us a share query may wait for others to
+                                   join it; 0 to send it at once */
+    int batch_us;               /* ... as it stands, by how often they do */
+    uint64_t batch_until;       /* ns the held queries go out, 0 if none */
+    unsigned int batch_asks;    /* requests lined up on them */
+    unsigned long share_queries;    /* sent */
+    unsigned long share_asks;       /* requests lined up on them */
+    unsigned long asking_requests;  /* requests that lined up any */
+    int lookahead;              /* share queries ask ahead of demand */
+    double arrival_pages;       /* moving average of request sizes */
+    unsigned int queued;        /* requests in the queue */
+    int64_t lookahead_asked;    /* pages asked for ahead of demand */
+    int64_t lookahead_shared;   /* ... and shared */
+    int grants_due;             /* progressive requests have pages to send */
+    int64_t repay_keep;         /* pages the pool keeps from sources */
+    int repay_delay;            /* ms after the last request they wait */
+    int repay_rate;             /* most pages a second they get, 0 for any */
+    int repay_damping;          /* ... and less for oscillating ones */
+    double repay_tokens;        /* pages they may get now, by the rate */
+    uint64_t repay_refilled;    /* tick repay_tokens were topped up */
+    uint64_t demand_at;         /* tick of the last request */
+    struct mbtimer repay_timer;
+    int64_t repaid_pages;
+    unsigned long repayments;
+    unsigned long oscillations;
+    unsigned long stalls;
+    int timer_fd;
+    uint64_t timer_set;         /* ns timer_fd goes off at */
+    struct mbtimer_wheel timers;
     FILE * fp;
+    struct mblog log;
+    struct mbname_cache names;  /* client command lines, by pid */
 
     struct sockaddr_un debug_sock;
     int debug_listen_fd;
+
+    int epoll_fd;
+
+    /*
+     * Sharding.  Each shard is a server of its own, on a thread of its own,
+     * with the clients whose ids hash to it.  Free pages a shard is not
+     * using are left in "spare", where any other shard may take them.
+     */
+    unsigned int n_shards;      /* mbs_set_shards() */
+    struct shards * shards;     /* NULL unless running sharded */
+    unsigned int shard_index;
+    pthread_t thread;
+    int wake_fd;                /* eventfd the other shards poke */
+    int64_t spare;
+    int hungry;                 /* requests here are short of pages */
+    struct handoff * handoffs;  /* connections moved to this shard */
+    struct debug_dump * dumps;  /* debug dumps for this shard to add to */
+#if HAVE_IO_URING
+    int want_uring;             /* mbs_use_io_uring() */
+    int uring_active;
+    struct mburing uring;
+#endif
+    unsigned int round;
+    Client * ready;     /* connections that may still have input pending */
+    Client * closed;    /* connections to release at the end of a wakeup */
+    Client * flush;     /* connections with output queued */
+    Client * flush_later;   /* ... that the ring had no room for */
 };
 
 typedef struct server Server;
 
+/* Words of bitmap each request carries per slot word */
+#define REQUEST_BITMAPS 3
 
-static Client *
-get_client_by_id( Server * server, int id)
+static inline uint64_t *
+request_reserved(Server * server, Request * request)
 {
-    Client * client = NULL;
-    Client * needle = server->client_list;
-   
-    while (needle) {
-        if ( needle->id == id ){
-            client = needle;
-            break;
-        }
-        needle = needle->next;
-    } 
+    return request->responded + server->slot_words;
+}
 
-    return client;
+static inline uint64_t *
+request_asking(Server * server, Request * request)
+{
+    return request->responded + 2 * server->slot_words;
 }
-static Client * 
-get_client_by_fd( Server * server, int fd)
+
+static inline int
+is_asking(Server * server, Request * request, Client * client)
 {
-    Client * client = NULL;
-    Client * needle = server->client_list;
+    return test_slot(request_asking(server, request), client->slot) != 0;
+}
 
-    while (needle) {
-        if (needle->fd == fd) {
-            client = needle;
-            break;
-        }
-        needle = needle->next;
-    }
+static inline void
+stop_asking(Server * server, Request * request, Client * client)
+{
+    if (!is_asking(server, request, client))
+        return;
+    clear_slot(request_asking(server, request), client->slot);
+    request->n_asking--;
+}
 
-    return client;
+/* Stops waiting on anyone; what they share later goes to the pool */
+static inline void
+forget_asking(Server * server, Request * request)
+{
+    memset (request_asking(server, request), 0,
+            server->slot_words * sizeof (uint64_t));
+    request->n_asking = 0;
 }
 
-static inline int 
-get_total_pages(Server* server)
+static inline void
+set_share_outstanding(Server * server, Client * client)
 {
-    int pages = server->source_pages;
-    Client* iter = server->client_list;
-    while(iter)
-    {
-        pages += iter->source_pages;
-        iter = iter->next;
-    }
-    return pages;
+    client->needed_pages = -client->needed_pages;
+    set_slot(server->sharing_mask, client->slot);
+    if (client->share_type == REQUEST)
+        set_slot(server->sharing_low_mask, client->slot);
 }
 
 static inline void
-give_server_pages(Server* server, int pages)
+mark_request_dirty(Server * server, Request * request)
 {
-    server->pages += pages;
-    if(pages > 0)
-        server->updates |= PAGES;
+    if (request->dirty_index >= 0 || request->complete)
+        return;
+
+    request->dirty_index = server->n_dirty;
+    server->dirty[server->n_dirty++] = request;
+    server->updates |= CLIENT_REQUEST;
 }
 
-static inline MbCodes
-has_client_responded(Client* client, Request* request)
+static inline void
+unmark_request_dirty(Server * server, Request * request)
 {
-    ClientNode* needle = request->responded_clients;
-    MbCodes rc = INVALID;
-    while (needle) {
-        if (needle->client == client) {
-            rc = needle->code;
-            break;
-        }
-        needle = needle->next;
-    }
-    return rc;
+    Request * last;
+
+    if (request->dirty_index < 0)
+        return;
+
+    last = server->dirty[--server->n_dirty];
+    server->dirty[request->dirty_index] = last;
+    last->dirty_index = request->dirty_index;
+    request->dirty_index = -1;
 }
 
+/*
+ * Some client stopped (or started) being deferred.  That can only change the
+ * outcome for requests that were left waiting on a deferred client.
+ */
 static void
-mark_client_responded(Server* server, Request* request, Client* client)
+mark_blocked_dirty(Server * server)
 {
-    ClientNode* node = request->responded_clients;
-    while (node) {
-        if (node->client == client) {
-            break;
-        }
-        node = node->next;
-    }
-
-    if (node == NULL) {
-        node = malloc(sizeof(ClientNode));
-    
-        if (!node) {
-            perror("malloc");
-            exit(10);
-        }
-        node->next = request->responded_clients;
-        request->responded_clients = node;
-        node->client = client;
-    }
+    Request * request;
 
-    node->code = client->share_type;
-    request->sharing_client = NULL;
+    for (request = server->blocked; request; request = request->blocked_next)
+        mark_request_dirty (server, request);
+}
 
-    server->updates |= CLIENT_REQUEST;
+static inline void
+block_request(Server * server, Request * request)
+{
+    if (request->blocked)
+        return;
+
+    request->blocked = 1;
+    request->blocked_prev = NULL;
+    request->blocked_next = server->blocked;
+    if (server->blocked)
+        server->blocked->blocked_prev = request;
+    server->blocked = request;
 }
 
-static void 
-request_complete(Server* server, Request* request)
+static inline void
+unblock_request(Server * server, Request * request)
 {
-    if (request->type == RESERVE && request->needed_pages) {
-        give_server_pages(server, request->acquired_pages);
-        request->needed_pages += request->acquired_pages;
-        request->acquired_pages = 0;
-    }
-    
-    request->complete = 1;
-    
-    server->updates |= CLIENT_REQUEST;
+    if (!request->blocked)
+        return;
+
+    if (request->blocked_prev)
+        request->blocked_prev->blocked_next = request->blocked_next;
+    else
+        server->blocked = request->blocked_next;
+    if (request->blocked_next)
+        request->blocked_next->blocked_prev = request->blocked_prev;
+    request->blocked = 0;
 }
 
 static inline void
-request_pages (Server * server)
+clear_share(Server * server, Client * client)
 {
-    Request* request = server->queue;
-    Client* client = NULL;
+    if (client->share_type != INVALID)
+        mark_blocked_dirty (server);
 
-    while (request) {
-        /*
-         * If the request already has an outstanding share or has already been
-         *  marked complete, skip it
-         */
-        if (request->sharing_client == NULL && !request->complete) {
-            int wait = 0;
-            client = server->client_list;
+    client->share_type = INVALID;
+    client->needed_pages = 0;
+    client->lookahead = 0;
+    client->shared = 0;
+    if (client->slot >= 0) {
+        clear_slot(server->sharing_mask, client->slot);
+        clear_slot(server->sharing_low_mask, client->slot);
+        clear_slot(server->pending_mask, client->slot);
+    }
+}
 
-            /* For each client... */
-            while (client)
-            {
-                /* 
-                 * Only ask clients to share pages that meet these conditions:
-                 *
-                 * - is bidirectional
-                 * - has not already responded to this request at the present 
-                 *   anxiety level
-                 * - is not the requesting client
-                 * - is not already processing an outstanding share query for 
-                 *   another request
-                 */
-                MbCodes last_response = has_client_responded(client, request);
-                if (is_bidirectional(client) &&
-                    last_response != request->type &&
-                    client != request->requesting_client &&
-                    request->sharing_client == NULL)
-                {
-                    /*
-                     * If this is a blocking client, set the wait flag so
-                     * we don't prematurely mark the request complete.
-                     */
-                    if (client->active_request) {
-                        if (client->active_request->type == REQUEST
-                            && request->type == RESERVE)
-                            wait = 1;
-                    } else if (is_share_outstanding(client)) {
-                        if (client->share_type == REQUEST
-                            || request->type == RESERVE)
-                            wait = 1;
-                    } else {
-                        MbCodes type = request->type;
-
-                        /*
-                         * If the request is RESERVing pages and this is a 
-                         * source client that has not already responded, 
-                         * downgrade the share query to a REQUEST to start with
-                         */
-                        if (type == RESERVE && is_source(client) && 
-                            last_response == INVALID)
-                            type = REQUEST;
-
-                        /*
-                         * Initialize the client share parameters if this is
-                         * the first request in the queue to ask this client
-                         * for pages. 
-                         */
-                        if (client->share_type == INVALID) {
-                            client->share_type = type;
-                            client->needed_pages = 0;
-                        }
-
-                        /*
-                         * Finally!
-                         * If this client's share type matches the current
-                         * request, then it is OK for the request to query
-                         * the client for pages.
-                         */
-                        if (client->share_type == type) {
-                            client->needed_pages -= request->needed_pages;
-                            request->sharing_client = client;
-                            wait = 1;
-                        }
-                    }
-                }
 
-                client = client->next;
-            }
+/*
+ * Every heap allocation the broker makes goes through these, so the counters
+ * show whether the steady state really is allocation free.
+ */
+static void *
+server_realloc (Server * server, void * ptr, size_t size)
+{
+    void * ret = realloc (ptr, size);
 
-            /**
-             * If there are no more clients for this request to query, it's
-             * done.
-             */
-            if (!wait)
-                request_complete (server, request);
-        }
+    if (ret)
+        server->allocs++;
+    return ret;
+}
 
-        request = request->next;
+static void *
+server_calloc (Server * server, size_t n, size_t size)
+{
+    void * ret = calloc (n, size);
+
+    if (ret)
+        server->allocs++;
+    return ret;
+}
+
+static void
+server_free (Server * server, void * ptr)
+{
+    if (ptr) {
+        server->frees++;
+        free (ptr);
     }
-    
-    client = server->client_list;
+}
 
+static inline unsigned int
+id_bucket( Server * server, int id)
+{
     /*
-     * Now that we've decided which requests are going to query which clients
-     * for pages, we need to send out the queries to each client...
+     * Fibonacci hashing; ids are usually pids, which cluster, so take the
+     * high bits of the product, which every bit of the id feeds into
      */
-    while (client)
-    {
-        /**
-         * Skip any clients that don't have a pending share query
-         */
-        if (is_share_pending(client))
-        {
-            /*
-             * Send the query and mark it outstanding
-             */
-            set_share_outstanding(client);
-            if (mb_encode_and_send (client->id, client->fd,
-                                    client->share_type, 
-                                    client->needed_pages) == 0 ) {
-
-                fprintf (server->fp, "mbserver: %s %d pages from %s (%d)\n", 
-                         client->share_type==REQUEST?"request":"reserve",
-                         client->needed_pages, client->cmdline, client->id);
-            } 
-            else
-            {
-                /*
-                 * If the query fails for some reason, treat the client as
-                 * having responded with no pages so the request can move on
-                 * to the next client. 
-                 *
-                 * TODO: Should we unilaterally delete the client in this case?
-                 * What about any pages it had?
-                 */
-                request = server->queue;
-                while (request) {
-                    if (request->sharing_client == client) {
-                        mark_client_responded(server, request, client);
-                    }
-                    request = request->next;
-                }
-                clear_share(client);
+    return ((uint32_t)id * 2654435761u) >> (32 - server->id_bits);
+}
 
-                fprintf (server->fp, "mbserver: Send error to (%d)-\"%s\"\n",
-                         client->id, client->cmdline);
-            }
-        }
+static Client *
+get_client_by_id( Server * server, int id)
+{
+    Client * needle;
 
-        client = client->next;
+    if (server->id_buckets == 0)
+        return NULL;
+
+    needle = server->id_table[id_bucket(server, id)];
+    while (needle) {
+        if ( needle->id == id )
+            break;
+        needle = needle->hash_next;
+    }
+
+    return needle;
+}
+
+static int
+grow_id_table( Server * server)
+{
+    unsigned int old_buckets = server->id_buckets;
+    unsigned int new_buckets = old_buckets ? old_buckets * 2 : 64;
+    Client ** old_table = server->id_table;
+    Client ** new_table;
+    unsigned int i;
+
+    new_table = server_calloc (server, new_buckets, sizeof (Client *));
+    if (!new_table) {
+        perror ("grow_id_table(): calloc");
+        return -1;
+    }
+
+    server->id_table = new_table;
+    server->id_buckets = new_buckets;
+    server->id_bits = __builtin_ctz (new_buckets);
+    for (i = 0; i < old_buckets; i++) {
+        Client * needle = old_table[i];
+        while (needle) {
+            Client * next = needle->hash_next;
+            Client ** bucket = &new_table[id_bucket(server, needle->id)];
+            needle->hash_next = *bucket;
+            *bucket = needle;
+            needle = next;
+        }
     }
+    server_free (server, old_table);
+    return 0;
 }
 
+/* The table must already have room; see reserve_clients() */
+static void
+hash_client( Server * server, Client * client)
+{
+    Client ** bucket;
+
+    bucket = &server->id_table[id_bucket(server, client->id)];
+    client->hash_next = *bucket;
+    *bucket = client;
+    server->n_clients++;
+}
 
-static char *
-get_cmdline_for (pid_t pid)
+static void
+unhash_client( Server * server, Client * client)
 {
-    int fd;
-    char fname[64];
-    char buffer[1024];
+    Client ** link = &server->id_table[id_bucket(server, client->id)];
 
-    snprintf (fname, sizeof (fname), "/proc/%d/cmdline", pid);
+    while (*link) {
+        if (*link == client) {
+            *link = client->hash_next;
+            server->n_clients--;
+            break;
+        }
+        link = &(*link)->hash_next;
+    }
+    client->hash_next = NULL;
+}
 
-    do {
-        fd = open (fname, O_RDONLY);
-    } while (fd == -1 && errno == EINTR);
+static inline int64_t
+get_total_pages(Server* server)
+{
+    struct shards * shards = server->shards;
+    int64_t total;
+    unsigned int i;
+
+    if (!shards)
+        return server->source_pages + server->client_source_pages;
+
+    total = shards->shard[0]->source_pages;
+    for (i = 0; i < shards->n; i++)
+        total += __atomic_load_n (&shards->shard[i]->client_source_pages,
+                                  __ATOMIC_RELAXED);
+    return total;
+}
 
-    if (fd == -1) {
-        snprintf (buffer, sizeof (buffer), "unknown");
+static inline void
+give_server_pages(Server* server, int64_t pages)
+{
+    server->pages += pages;
+    if(pages > 0)
+        server->updates |= PAGES;
+}
 
-    } else {
-        char * cmd;
-        int bytes = 0;
+/* Pages a client's granule has, less one */
+static inline int64_t
+granule_mask(Client * client)
+{
+    return (INT64_C(1) << client->granule_shift) - 1;
+}
 
-        do {
-            /* the cmdline file is not necessarily terminated.  Leave space. */
-            bytes = read (fd, buffer, sizeof (buffer) - 1);
-        } while (bytes < 0 && errno == EINTR);
+static inline int64_t
+granule_round_up(Client * client, int64_t pages)
+{
+    return (pages + granule_mask(client)) & ~granule_mask(client);
+}
 
-        if (bytes < 0) {
-            /* holy carp, how'd that happen? */
-            snprintf (buffer, sizeof (buffer), "unknown");
+/* Copies into the output ring at off, wrapping around its end */
+static void
+ring_put (Client * client, unsigned int off, const unsigned char * data,
+          unsigned int len)
+{
+    unsigned int first = min (len, sizeof (client->out) - off);
 
-        } else {
-            /* ensure termination */
-            buffer[bytes] = '\0';
-        }
+    memcpy (client->out + off, data, first);
+    memcpy (client->out, data + first, len - first);
+}
 
-        close (fd);
+/*
+ * Queues a message for a client.  It goes out when the wakeup is done with,
+ * in one write along with anything else queued for the client meanwhile.
+ * For a v2 client, that is as ops added to one frame for as long as it has
+ * room.  Counts are in pages and go out in the client's granules, rounded
+ * down; callers see to it that there is nothing to round.
+ */
+static int
+send_flagged(Server* server, Client* client, MbCodes code, uint32_t flags,
+             int64_t param)
+{
+    unsigned char frame[MB2_HEADER_SIZE + MB2_OP_SIZE];
+    unsigned int size, tail;
+    unsigned int room = sizeof (client->out);
+    int extend = 0;
+    MbOp op;
+
+    /* A HELLO's caps and a QUERY_AVAILABLE's level are not counts */
+    if (code != HELLO && code != QUERY_AVAILABLE)
+        param >>= client->granule_shift;
+
+    if (client->proto == 2) {
+        op.code = code;
+        op.flags = flags;
+        op.tag = code == SHARE ? client->request_tag : 0;
+        op.param = param;
+        extend = client->out_ops && client->out_ops < MB2_MAX_OPS;
+        size = mb2_encode (&op, 1, frame);
+        if (extend)
+            size -= MB2_HEADER_SIZE;
+    } else {
+        /* Only a total or a free count can be too big for v1 */
+        mb_encode (client->id, code, min(param, INT_MAX), frame);
+        size = MB_FRAME_SIZE;
+    }
 
-        /*
-         * /proc/pid/cmdline contains the entire command line, as fed to
-         * main()...  It has nul chars between the arguments.  So, we
-         * probably also read quite a lot of the arguments, but strlen(),
-         * strrchr(), and other string functions will stop at the first nul,
-         * which is the end of the program name.
-         *
-         * For a client that may have many instances of the same executable,
-         * the full command line could be very useful...  but just as easily
-         * could be a long string of unhelpful junk.
-         */
+    if (code != SHARE && code != RETURN)
+        room -= OUT_RESERVED;
+    if (client->out_len + size > room) {
+        if (code == SHARE || code == RETURN)
+            client->out_retry = 1;
+        else if (client->out_dropped++ == 0)
+            mblog_event (&server->log, LOG_QUEUE_FULL, code, client->id,
+                         0, 0, client->pid, 0);
+        return MB_IO;
+    }
 
-        /* Strip off the leading path. */
-        cmd = strrchr (buffer, '/');
+    tail = (client->out_head + client->out_len) % sizeof (client->out);
+    if (extend) {
+        uint32_t len = ++client->out_ops * MB2_OP_SIZE;
 
-        if (cmd) {
-            memmove (buffer, cmd + 1, strlen (cmd));
+        ring_put (client, client->out_frame, (unsigned char *) &len,
+                  MB2_HEADER_SIZE);
+        ring_put (client, tail, frame + MB2_HEADER_SIZE, size);
+    } else {
+        if (client->proto == 2) {
+            client->out_frame = tail;
+            client->out_ops = 1;
         }
+        ring_put (client, tail, frame, size);
     }
+    client->out_len += size;
 
-    assert (buffer);
+    if (!client->flush_queued && !client->out_blocked) {
+        client->flush_queued = 1;
+        client->next_flush = server->flush;
+        server->flush = client;
+    }
+    return 0;
+}
 
-    return strdup (buffer);
+static inline int
+send_message(Server* server, Client* client, MbCodes code, int64_t param)
+{
+    return send_flagged (server, client, code, 0, param);
 }
 
-static Client *
-create_client (Server * server, int id, int fd, unsigned int param)
+static void
+mark_client_responded(Server* server, Request* request, Client* client)
 {
-    Client * client = (Client *) calloc (1, sizeof (*client));
+    set_slot(request->responded, client->slot);
+    if (client->share_type == RESERVE)
+        set_slot(request_reserved(server, request), client->slot);
+    else
+        clear_slot(request_reserved(server, request), client->slot);
 
-    struct ucred credentials;
-    socklen_t cred_len = sizeof (credentials);
+    stop_asking(server, request, client);
 
-    if (!client)
-    {
-        perror("create_client(): calloc()\n");
-        exit (1);
-    }
+    mark_request_dirty (server, request);
+}
 
-    /* The id that comes in the client message may or may not actually be
-     * the pid of the client; if the client used the "new" api, he may have
-     * used some random number.  We want the real pid so we can provide
-     * useful debug and potentially do some credentials verification.
-     * Ask the kernel for that info.  Note that this only works because
-     * we're using unix domain sockets.
-     */
-    memset (&credentials, 0, cred_len);
-    if (0 != getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &credentials, &cred_len)) {
-        /* We lived without this info for a long time, let's not bail out
-         * just yet...  but spit out a nastygram. */
-        printf ("Membroker WARNING: could not get credentials from socket %d: %s\n",
-                fd, strerror (errno));
+static void 
+request_complete(Server* server, Request* request)
+{
+    mbtimer_cancel (&server->timers, &request->deadline);
+
+    if (request->type == RESERVE && !request->escalated &&
+        request->needed_pages) {
+        give_server_pages(server, request->acquired_pages);
+        request->needed_pages += request->acquired_pages;
+        request->acquired_pages = 0;
     }
 
-    client->pid = credentials.pid;
-    client->id = id;
-    client->fd = fd;
-    client->source_pages = param & 0x7fffffff;
-    if (param & 0x80000000)
-        set_bidirectional(client);
-    else
-        set_normal(client);
+    if (request->complete)
+        return;
 
-    client->cmdline = get_cmdline_for (client->pid);
-    if (client->cmdline == NULL)
-    {
-        perror("create_client(): strdup()");
-        exit(1);
-    }
-    client->share_type = INVALID;
+    request->complete = 1;
+    unmark_request_dirty (server, request);
+    unblock_request (server, request);
 
-    // Put source clients at front of list, others at the back
-    if (client->source_pages) {
-        client->next = server->client_list;
-        server->client_list = client;
-    } else {
-        Client* last = server->client_list;
-        client->next = NULL;
-        if (last == NULL)
-            server->client_list = client;
-        else 
-        {
-            while (last->next)
-                last = last->next;
-            last->next = client;
-        }
-    }
+    request->next_complete = NULL;
+    if (server->completed_tail)
+        server->completed_tail->next_complete = request;
+    else
+        server->completed = request;
+    server->completed_tail = request;
 
     server->updates |= CLIENT_REQUEST;
-
-    return client;
 }
 
-static inline Request*
-free_request(Server* server, Request* request, Request* previous)
+static int short_at_request (Server * server, Request * request,
+                             Client * client);
+
+/* The anxiety level a request would ask a client at */
+static inline MbCodes
+ask_type (Server * server, Request * request, Client * client)
 {
-    Request* rc = request->next;
-    ClientNode* node = request->responded_clients;
-    ClientNode* next;
-    while(node) {
-        next = node->next;
-        free(node);
-        node = next;
-    }
-    request->requesting_client->active_request = NULL;
+    /*
+     * If the request is RESERVing pages and this is a 
+     * source client that has not already responded, 
+     * downgrade the share query to a REQUEST to start with,
+     * unless it is expected to come up short at that level
+     */
+    if (request->type == RESERVE && is_source(client) && 
+        !test_slot(request->responded, client->slot) &&
+        !(server->adaptive_downgrade &&
+          short_at_request (server, request, client)))
+        return REQUEST;
+    return request->type;
+}
 
-    give_server_pages(server, request->acquired_pages);
+/*
+ * Whether a request may ask an available client for pages now; the client
+ * takes on the request's anxiety level if nothing else has asked it yet.
+ */
+static int
+may_ask (Server * server, Request * request, Client * client)
+{
+    MbCodes type = ask_type (server, request, client);
 
-    if (previous)
-        previous->next = rc;
-    else
-        server->queue = rc;
+    /*
+     * Initialize the client share parameters if this is
+     * the first request in the queue to ask this client
+     * for pages. 
+     */
+    if (client->share_type == INVALID) {
+        client->share_type = type;
+        client->needed_pages = 0;
+        set_slot(server->pending_mask, client->slot);
+    }
 
-    free(request);
+    /*
+     * Finally!
+     * If this client's share type matches the current
+     * request, then it is OK for the request to query
+     * the client for pages.
+     */
+    return client->share_type == type;
+}
 
-    server->updates |= CLIENT_REQUEST;
+static uint64_t
+now_ns (void)
+{
+    struct timespec ts;
 
-    return rc;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-static void
-free_client( Server * server, Client * client )
+static uint64_t
+now_tick (void)
 {
-    Client * needle = server->client_list;
-    Request* request = server->queue;
-    Request* previous = NULL;
+    return now_ns () / TICK_NS;
+}
 
-    give_server_pages(server, client->pages);
+/*
+ * What a client last said it could share at a level, less what it is already
+ * about to be asked for; -1 if it has not said lately.
+ */
+static inline int64_t
+known_available (Server * server, Client * client, MbCodes type)
+{
+    int level = level_index(type);
+    int64_t pages = client->available[level];
 
-    if (needle == client){
-        server->client_list = client->next;
-    } else {
-        while (needle){
-            if (needle->next == client ){
-                needle->next = client->next;
-                break;
-            }   
-            needle = needle->next;
-        }
-    }
+    if (client->available_at[level] + AVAILABLE_MAX_AGE < server->timers.now)
+        return -1;
+    if (client->needed_pages < 0)
+        pages += client->needed_pages;
+    return pages > 0 ? pages : 0;
+}
 
-    while (request) {
-        ClientNode* node = request->responded_clients;
+/* How well a client asked at type might do for a request, best first */
+enum {
+    RANK_REQUEST,       /* known to have all of it at REQUEST */
+    RANK_RESERVE,       /* ... at RESERVE */
+    RANK_UNKNOWN,
+    RANK_NOTHING,       /* known to have nothing at the level it is asked at */
+    RANK_NONE
+};
 
-        if (request->requesting_client == client) {
-            request = free_request(server, request, previous);
-            continue;
-        }
-        if (request->sharing_client == client)
-            request->sharing_client = NULL;
-            
-        while(node) {
-            if (node->client == client) {
-                node->client = NULL;
-                break;
-            }
-            node = node->next;
-        }
-        previous = request;
-        request = request->next;
+static int
+share_rank (Server * server, Request * request, Client * client, MbCodes type)
+{
+    int64_t pages = known_available (server, client, REQUEST);
+
+    if (pages >= request->needed_pages)
+        return RANK_REQUEST;
+    if (type == RESERVE) {
+        pages = known_available (server, client, RESERVE);
+        if (pages >= request->needed_pages)
+            return RANK_RESERVE;
     }
-
-    free (client->cmdline);
-    free (client);
-
-    server->updates |= CLIENT_REQUEST;
+    return pages == 0 ? RANK_NOTHING : RANK_UNKNOWN;
 }
 
+/* Has a client that tells what it could share to be asked again? */
 static inline void
-add_request (Server * server, Client * client, int pages, MbCodes op)
+check_estimates (Server * server, Client * client)
 {
-    Request * last = server->queue;
-    Request * request = (Request *) malloc (sizeof (*request));
+    int level;
+
+    if (test_slot(server->polled_mask, client->slot))
+        return;
+    for (level = 0; level < 2; level++)
+        if (client->available_at[level] + AVAILABLE_MAX_AGE <
+            server->timers.now)
+            set_slot(server->polling_mask, client->slot);
+}
 
-    if (!request)
-    {
-        perror("add_request(): malloc");
-        exit (10);
-    }
-    request->needed_pages = (unsigned)pages;
-    request->acquired_pages = 0;
-    request->requesting_client = client;
-    request->sharing_client = NULL;
-    request->responded_clients = NULL;
-    request->next = NULL;
-    MB_GET_TIME(&(request->stamp));
-    request->type = op;
-    request->complete = 0;
+/*
+ * A client's share history at a level as of now, faded toward what an
+ * untried client is assumed to do: answers at once and shares all it is
+ * asked for.  Halves what the history counts for every STATS_HALF_LIFE,
+ * in straight steps in between.
+ */
+static void
+share_history (Server * server, Client * client, MbCodes type,
+               struct share_stats * view)
+{
+    const struct share_stats * stats = &client->stats[level_index(type)];
+    uint64_t age = server->timers.now -
+                   min (stats->updated, server->timers.now);
+    uint64_t halvings = age / STATS_HALF_LIFE;
+    double weight = 0;
+
+    if (stats->answers && halvings < 32)
+        weight = (1.0 - 0.5 * (age % STATS_HALF_LIFE) / STATS_HALF_LIFE) /
+                 (UINT64_C(1) << halvings);
+
+    view->answers = stats->answers;
+    view->latency = STATS_PRIOR_LATENCY +
+                    (stats->latency - STATS_PRIOR_LATENCY) * weight;
+    view->yield = 1.0 - (1.0 - stats->yield) * weight;
+    view->denials = stats->denials * weight;
+    view->updated = stats->updated;
+}
 
-    if (last == NULL)
-        server->queue = request;
-    else {
-        while (last->next)
-            last = last->next;
+/* Pages a client can be expected to share per ms, for each page asked for */
+static double
+share_score (Server * server, Client * client, MbCodes type)
+{
+    struct share_stats view;
 
-        last->next = request;
-    }
+    /* A microsecond at best, which is what an untried client gets */
+    share_history (server, client, type, &view);
+    return view.yield / (view.latency > 0.001 ? view.latency : 0.001);
+}
 
-    client->active_request = request;
+/* Whether a client DENYs at REQUEST too often to be worth asking there */
+static int
+is_denier (Server * server, Client * client)
+{
+    struct share_stats view;
 
-    server->updates |= CLIENT_REQUEST;
-}   
+    share_history (server, client, REQUEST, &view);
+    return view.answers >= DENIER_ANSWERS && view.denials > DENIER_RATE;
+}
 
-static void
-process_request_queue (Server * server)
+/*
+ * Whether a client asked at REQUEST is expected to share less than a request
+ * still needs: by what it said it has, if it said lately, or by the part of
+ * what it was asked for it has been sharing there.
+ */
+static int
+short_at_request (Server * server, Request * request, Client * client)
 {
-    Request* previous = NULL;
-    Request* request = server->queue;
+    int64_t known = known_available (server, client, REQUEST);
+    struct share_stats view;
 
-    while(request)
-    {
-        if (request->complete) 
-        {
-            struct timespec now;
-            MB_GET_TIME(&now);
-            now.tv_nsec -= request->stamp.tv_nsec;
-            if (now.tv_nsec < 0)
-            {
-                now.tv_nsec += 1000000000;
-                now.tv_sec--;
-            }
-            now.tv_sec -= request->stamp.tv_sec;
+    if (known >= 0)
+        return known < request->needed_pages;
 
-            if (mb_encode_and_send (request->requesting_client->id,
-                                    request->requesting_client->fd, 
-                                    SHARE , request->acquired_pages ) == 0)
-            {
-                fprintf (server->fp, "mbserver: processed client (%d)-\"%s\"  - %d of %d pages in %ld.%09ld sec.\n",
-                         request->requesting_client->id,
-                         request->requesting_client->cmdline,
-                         request->acquired_pages, 
-                         request->acquired_pages + request->needed_pages,
-                         now.tv_sec, now.tv_nsec);
-                
-                request->requesting_client->pages += request->acquired_pages;
-                request->acquired_pages = 0;
-            } else {
-                fprintf (server->fp, "mbserver: %s: encode_and_send %d pages to (%d)-\"%s\" failed\n", __func__, request->acquired_pages, request->requesting_client->id, request->requesting_client->cmdline);
-            }
+    share_history (server, client, REQUEST, &view);
+    return view.answers &&
+           (int64_t) (view.yield * request->needed_pages + 0.5) <
+           request->needed_pages;
+}
 
-            request = free_request(server, request, previous);
-        }
-        else {
-            previous = request;
-            request = request->next;
-        }
+/* Adds an answer to the share query a client has outstanding to its history */
+static void
+note_answer (Server * server, Client * client, int64_t pages)
+{
+    struct share_stats * stats = &client->stats[level_index(client->share_type)];
+    struct share_stats view;
+    int64_t asked = client->needed_pages - client->lookahead;
+    double latency = (now_ns () - client->asked_ns) / 1e6;
+    double yield = pages >= asked ? 1.0 : (double) pages / asked;
+    double weight = STATS_WEIGHT;
+
+    /* Start from the history as it has faded, or from scratch */
+    share_history (server, client, client->share_type, &view);
+    if (!stats->answers)
+        weight = 1.0;
+    stats->latency = view.latency + (latency - view.latency) * weight;
+    stats->yield = view.yield + (yield - view.yield) * weight;
+    stats->denials = view.denials + ((pages == 0) - view.denials) * weight;
+    stats->updated = server->timers.now;
+    stats->answers++;
+}
 
+/*
+ * Notes that a source is being asked for pages.  One that was repaid only
+ * just now has its next repayment put off, the more so the more often
+ * that happens in a row.
+ */
+static void
+note_borrow (Server * server, Client * client)
+{
+    uint64_t now = server->timers.now;
+
+    if (!server->repay_damping || !is_source(client))
+        return;
+
+    if (client->repaid_at && now < client->repaid_at + OSCILLATION_WINDOW) {
+        if (client->oscillations < MAX_REPAY_SHIFT)
+            client->oscillations++;
+        client->repay_after = now +
+                              ((uint64_t) REPAY_BACKOFF << client->oscillations);
+        server->oscillations++;
+    } else if (client->oscillations) {
+        client->oscillations--;
     }
+    client->repaid_at = 0;
 }
 
-static void
-process_unsolicited_pages(Server* server)
+/*
+ * Picks the client a request should ask for pages next, following the rules
+ * in membroker.txt section 3.3.  The eligibility tests are done on whole
+ * words of the per-slot flag bitmaps.  Sets *wait if some client is
+ * blocking the request.
+ */
+static Client *
+find_sharing_client (Server * server, Request * request, int * wait)
 {
-    Request* request = server->queue;
+    uint64_t * responded = request->responded;
+    uint64_t * reserved = request_reserved(server, request);
+    uint64_t * available = server->candidate_scratch;
+    uint64_t blocking = 0;
+    int self = request->requesting_client->slot;
+    int reserve = (request->type == RESERVE);
+    Client * best = NULL;
+    int best_rank = RANK_NONE;
+    double best_score = 0;
+    unsigned int w;
+
+    for (w = 0; w < server->slot_words; w++) {
+        /*
+         * Only ask clients to share pages that meet these conditions:
+         *
+         * - is bidirectional
+         * - has not already responded to this request at the present 
+         *   anxiety level
+         * - is not the requesting client
+         */
+        uint64_t excluded = reserve ? reserved[w] : responded[w] & ~reserved[w];
+        uint64_t candidates = server->bidi_mask[w] & ~excluded &
+                              ~server->cooldown_mask[w];
+        uint64_t requesting, sharing;
 
-    while (request && server->pages > 0) {
-        if (request->needed_pages) {
-            int pages = min(server->pages, (int)request->needed_pages);
-                request->acquired_pages += pages;
-                request->needed_pages -= pages;
-                server->pages -= pages;            
-                if (request->needed_pages == 0)
-                    request_complete(server, request);
+        if (w == (unsigned int)slot_word(self))
+            candidates &= ~slot_bit(self);
+
+        /*
+         * Clients that are busy requesting pages or answering another share
+         * query are deferred.  Some of them block the request, so we don't
+         * prematurely mark it complete.
+         */
+        requesting = candidates & server->requesting_mask[w];
+        sharing = candidates & server->sharing_mask[w] & ~requesting;
+        if (reserve)
+            blocking |= (requesting & server->requesting_low_mask[w]) | sharing;
+        else
+            blocking |= sharing & server->sharing_low_mask[w];
+
+        available[w] = candidates & ~server->requesting_mask[w]
+            & ~server->sharing_mask[w];
+    }
+
+    *wait = (blocking != 0);
+
+    /*
+     * Of the rest, the one known to have all the request needs at the lowest
+     * anxiety goes first, and those known to have nothing last.  Source
+     * clients go before other clients, other things being equal, and then
+     * the one expected to share the most pages soonest.
+     */
+    for (w = 0; w < server->slot_words; w++) {
+        uint64_t bits = available[w];
+
+        while (bits) {
+            Client * client =
+                server->slots[w * SLOT_BITS + __builtin_ctzll (bits)];
+            MbCodes type = ask_type (server, request, client);
+            double score;
+            int rank;
+
+            bits &= bits - 1;
+            if (client->share_type != INVALID && client->share_type != type) {
+                /*
+                 * Lined up for a query at another level that a batch window
+                 * is holding back; it blocks the request as it will once it
+                 * has gone out.
+                 */
+                if (server->batch_window &&
+                    (reserve || client->share_type == REQUEST))
+                    *wait = 1;
+                continue;
+            }
+            if (request->type == REQUEST && is_denier (server, client))
+                continue;
+            if (test_slot(server->estimating_mask, client->slot))
+                check_estimates (server, client);
+            rank = share_rank (server, request, client, type);
+            if (rank > best_rank)
+                continue;
+            score = share_score (server, client, type);
+            if (best && rank == best_rank) {
+                if (is_source(best) != is_source(client)) {
+                    if (is_source(best))
+                        continue;
+                } else if (score <= best_score) {
+                    continue;
+                }
+            }
+            best = client;
+            best_rank = rank;
+            best_score = score;
         }
-        request = request->next;
     }
+
+    if (best)
+        may_ask (server, request, best);
+    return best;
 }
 
+/*
+ * Takes what a client says it could share at a level; INVALID for the level
+ * of the oldest poll it has yet to answer.  Polls go out in pairs, REQUEST
+ * first, and anything unasked for counts at RESERVE.
+ */
 static void
-process_solicited_pages(Server* server, Client* client, int shared_pages)
+note_available (Server * server, Client * client, MbCodes type, int64_t pages)
 {
-    Request* request = server->queue;
-
-    while (request)
-    {
-        if (request->sharing_client == client) {
-            int pages = min(shared_pages, request->needed_pages);
-            request->acquired_pages += pages;
-            request->needed_pages -= pages;
-            shared_pages -= pages;
-            mark_client_responded(server, request, client);
-            if (request->needed_pages == 0)
-                request_complete(server, request);
-        }
-        request = request->next;
+    if (type == INVALID) {
+        type = client->available_due == 2 ? REQUEST : RESERVE;
+        if (client->available_due && --client->available_due == 0)
+            clear_slot(server->polled_mask, client->slot);
     }
-    clear_share(client);
-
-    give_server_pages(server, shared_pages);
 
-    process_unsolicited_pages(server);
+    client->available[level_index(type)] = pages;
+    client->available_at[level_index(type)] = now_tick ();
+    set_slot(server->estimating_mask, client->slot);
 }
 
+/*
+ * Keeps a client's estimates in line with a SHARE from it, the last of its
+ * answer or a chunk with more to come.  One that answers a query with less
+ * than it was asked for had no more at that level, or at REQUEST if it was
+ * asked at RESERVE.
+ */
 static void
-return_shared_pages (Server * server)
+note_shared (Client * client, int64_t pages, int last)
 {
+    int level;
 
-    if (server->pages == 0) return;
+    for (level = 0; level < 2; level++)
+        client->available[level] = max (client->available[level] - pages, 0);
 
-    if (server->queue == NULL){
-        Client * iter = server->client_list;
-        while (iter) {
-            if (is_source(iter) && iter->pages < 0) {
-                int pages = min(server->pages, -iter->pages);
-                mb_encode_and_send (iter->id, iter->fd, RETURN, pages);  
-                fprintf (server->fp, "mbserver: return %d pages to (%d)-\"%s\"\n", pages, iter->id, iter->cmdline);
-                server->pages -= pages;
-                iter->pages += pages;
-            }
-            iter = iter->next;
+    if (last && !client->stale_replies && is_share_outstanding(client) &&
+        client->shared + pages < client->needed_pages) {
+        for (level = 0; level <= level_index(client->share_type); level++) {
+            client->available[level] = 0;
+            client->available_at[level] = now_tick ();
         }
-    } else {
-        fprintf(server->fp, "mbserver: Can't return shared pages -- request queue non empty\n");
     }
-
-    return;
 }
 
-static void
-update_server(Server* server)
+/*
+ * Most a client could share right now at a level, as far as the books know
+ * or it has said lately
+ */
+static inline int64_t
+share_estimate (Server * server, Client * client, MbCodes type)
 {
-    if (server->pages)
-        server->updates |= PAGES;
-
-    while (server->updates)
-    {
-        int updates = server->updates;
-        server->updates = 0;
+    int64_t pages = client->source_pages + client->pages;
+    int64_t known = known_available (server, client, type);
 
-        if (updates & PAGES)
-            process_unsolicited_pages(server);
-        if (updates & CLIENT_REQUEST)
-            request_pages(server);
-        process_request_queue(server);
-    }
-    return_shared_pages(server);
+    /* Less what it is already about to be asked for */
+    if (client->needed_pages < 0)
+        pages += client->needed_pages;
+    return known >= 0 && known < pages ? known : pages;
 }
 
+/*
+ * Pages to ask a client for over what the requests lined up on its query
+ * need, for the requests expected to follow: an average request's worth for
+ * each one queued, up to LOOKAHEAD_DEPTH.  What comes of it goes to the pool
+ * for them.  Only ever at REQUEST, and no more than the client is known to
+ * have to spare.
+ */
+static int64_t
+lookahead_pages (Server * server, Client * client)
+{
+    unsigned int depth = min (server->queued, LOOKAHEAD_DEPTH);
+    int64_t pages = (int64_t) (server->arrival_pages * depth + 0.5);
+    int64_t spare = share_estimate (server, client, REQUEST) -
+                    client->needed_pages;
+
+    if (!server->lookahead || client->share_type != REQUEST)
+        return 0;
+    return max (min (pages, spare), 0);
+}
 
-static inline Server *
-initialize_server()
+/*
+ * Holds the share queries lined up now back for the batch window, so that
+ * requests that come in meanwhile can join them, but sends them in time for
+ * the earliest deadline among the requests asking to be met.
+ */
+static void
+hold_queries (Server * server, Request * request)
 {
-    Server *server;
-    char * env = getenv ("GLIBC_POOL_SIZE");
+    uint64_t now = now_ns ();
 
-    server = (Server *) calloc (1,sizeof(*server));
+    if (!server->batch_until)
+        server->batch_until = now + (uint64_t) server->batch_us * 1000;
+    if (mbtimer_armed (&request->deadline)) {
+        uint64_t deadline = request->deadline.expires * TICK_NS;
+        uint64_t until = deadline > now ? now + (deadline - now) / 2 : now;
 
-    if (!server)
-    {
-        perror ("malloc");
-        exit (1);
+        if (until < server->batch_until)
+            server->batch_until = until;
     }
+    server->batch_asks++;
+}
 
-#if LOGFILE
-    server->fp = fopen(logfile, "w");
-#else
-    server->fp = stdout;
-#endif
-    setlinebuf (server->fp);
-
-    if (env) {
-        server->source_pages =
-            server->pages = atoi (env) / EXEC_PAGESIZE;
+static inline void
+ask_client (Server * server, Request * request, Client * client,
+            int64_t pages)
+{
+    client->needed_pages -= pages;
+    set_slot(request_asking(server, request), client->slot);
+    request->n_asking++;
 
-        fprintf (server->fp, "Initialized membroker with %d pages (from %s)\n", server->pages, env);
+    if (!request->asked) {
+        request->asked = 1;
+        server->asking_requests++;
     }
-
-    return server;
+    server->share_asks++;
+    if (server->batch_window)
+        hold_queries (server, request);
 }
 
-static double
-pages_to_megabytes (int pages)
+/*
+ * Widens the batch window after a batch that some request joined, and
+ * narrows it after one that none did, down to an eighth of the most.
+ */
+static void
+adapt_batch (Server * server, unsigned int queries)
 {
-    return ((double) pages) * EXEC_PAGESIZE / 1024 / 1024;
+    if (server->batch_asks > queries)
+        server->batch_us = min (server->batch_us * 2, server->batch_window);
+    else
+        server->batch_us = max (server->batch_us / 2,
+                                max (server->batch_window / 8, 1));
+    server->batch_until = 0;
+    server->batch_asks = 0;
 }
 
+/*
+ * Splits a RESERVE between as many of the clients find_sharing_client()
+ * found as it takes, by what each is known to have, and asks them all at
+ * once rather than one after another.  What they share over what the
+ * request still needs goes to the pool.  If none of them is known to have
+ * anything, first is asked for all of it, as it would have been anyway.
+ */
 static void
-dump_status (Server * server,
-             FILE * fp)
+fan_out (Server * server, Request * request, Client * first)
 {
-    Client * client;
-    int total_pages = get_total_pages (server);
-    char scratch[64];
+    uint64_t * available = server->candidate_scratch;
+    int64_t left = request->needed_pages;
+    unsigned int w;
+    int pass;
+
+    for (pass = 0; pass < 2 && left > 0; pass++) {
+        for (w = 0; w < server->slot_words && left > 0; w++) {
+            uint64_t bits = available[w] &
+                (pass == 0 ? server->source_mask[w] : ~server->source_mask[w]);
+
+            while (bits && left > 0) {
+                Client * client =
+                    server->slots[w * SLOT_BITS + __builtin_ctzll (bits)];
+                int64_t pages = min (left, share_estimate (server, client,
+                                         ask_type (server, request, client)));
+
+                bits &= bits - 1;
+                if (pages > 0 && may_ask (server, request, client)) {
+                    ask_client (server, request, client, pages);
+                    left -= pages;
+                }
+            }
+        }
+    }
 
-    if (server->source_pages) {
-        snprintf (scratch, sizeof (scratch), "%.3g%%",
-                  server->pages * 100.0 / server->source_pages);
-    } else {
-        /* Don't divide by zero.  This will happen when the server owns no
-         * pages, and relies on a source client to provide them. */
-        snprintf (scratch, sizeof (scratch), "--");
+    if (!request->n_asking) {
+        ask_client (server, request, first, request->needed_pages);
+    } else if (first->needed_pages == 0) {
+        /* Lined up by find_sharing_client(), but not needed after all */
+        first->share_type = INVALID;
+        clear_slot(server->pending_mask, first->slot);
     }
+}
 
-    fprintf (fp, "mbserver: STATUS server pages = %d of %d (%s);  total pages = %d  (%.1f M)\n",
-             server->pages, server->source_pages, scratch, /* percentage */
-             total_pages, pages_to_megabytes (total_pages));
-    client = server->client_list;
-    fprintf (fp, "mbserver: CLIENTS\n");
-    while (client){
-        /* We want to show how much of the total each client has, but it's
-         * possible for the total to be zero, so we have some icky logic. */
-        if (total_pages) {
-            snprintf (scratch, sizeof (scratch), ", %.3g%% of total",
-                      client->pages * 100.0 / total_pages);
-        } else {
-            scratch[0] = '\0'; /* leave it blank */
+static inline void
+request_pages (Server * server)
+{
+    Request* request;
+    unsigned int i, w, sent = 0;
+
+    /*
+     * Dirty requests are evaluated in queue order, as the full scan used to,
+     * since earlier requests get first claim on a client's share query.
+     * The set is mostly sorted already.
+     */
+    for (i = 1; i < server->n_dirty; i++) {
+        unsigned int j = i;
+
+        request = server->dirty[i];
+        while (j > 0 && (int)(server->dirty[j - 1]->seq - request->seq) > 0) {
+            server->dirty[j] = server->dirty[j - 1];
+            server->dirty[j]->dirty_index = j;
+            j--;
         }
-        fprintf (fp, "mbserver: (%d)-\"%s\" - %s: %d of %d pages (%.1f M)%s\n",
-                 client->id,
-                 client->cmdline,
-                 is_source(client)?"source":(is_bidirectional(client)?"bidi":"sink"),
-                 client->pages,
-                 client->source_pages,
-                 pages_to_megabytes (client->pages),
-                 scratch); /* percentage report */
+        server->dirty[j] = request;
+        request->dirty_index = j;
+    }
 
-        if (client->active_request)
-            fprintf (fp, "mbserver:     %s %d of %d pages\n",
-                     client->active_request->type==REQUEST?
-                     "Requesting":"Reserving",
-                     client->active_request->needed_pages,
-                     client->active_request->needed_pages +
-                     client->active_request->acquired_pages);
-        if (client->share_type != INVALID)
-            fprintf (fp, "mbserver:     %s to share %d pages\n",
-                     client->share_type==REQUEST?"Requested":"Reserved",
-                     client->needed_pages);
-        client = client->next;
+    for (i = 0; i < server->n_dirty; i++) {
+        int wait = 0;
+        Client * client;
+
+        request = server->dirty[i];
+        request->dirty_index = -1;
+        unblock_request (server, request);
+
+        /*
+         * If the request already has an outstanding share or has already been
+         *  marked complete, skip it
+         */
+        if (request->n_asking || request->complete)
+            continue;
+
+        client = find_sharing_client (server, request, &wait);
+
+        if (client && server->fan_out && request->type == RESERVE) {
+            fan_out (server, request, client);
+            continue;
+        }
+        if (client) {
+            ask_client (server, request, client, request->needed_pages);
+            continue;
+        }
+
+        /**
+         * If there are no more clients for this request to query, it's
+         * done.  Otherwise it waits for a deferred client to come free.
+         */
+        if (wait)
+            block_request (server, request);
+        else
+            request_complete (server, request);
     }
+    server->n_dirty = 0;
 
-    if (server->queue) {
-        Request * request = server->queue;
-        fprintf (fp, "mbserver: QUEUE\n");
-        while (request){
-            fprintf (fp, "mbserver: Client (%d)-\"%s\" %s %d of %d pages since %s",
-                     request->requesting_client->id,
-                     request->requesting_client->cmdline,
-                     request->type==REQUEST?
-                     "Requesting":"Reserving",
-                     request->needed_pages,
-                     request->needed_pages +
-                     request->acquired_pages,
-                     ctime (&(request->stamp.tv_sec)));
-            if (request->sharing_client)
-                fprintf (fp, "mbserver:     Actively %s %d pages from client (%d)-\"%s\"\n",
-                         request->sharing_client->share_type==REQUEST?
-                         "Requesting":"Reserving",
-                         request->sharing_client->needed_pages,
-                         request->sharing_client->id,
-                         request->sharing_client->cmdline);
-            if (request->responded_clients) {
-                ClientNode* node = request->responded_clients;
-                fprintf (fp, "mbserver:     Responded Clients:\n");
-                while(node) {
-                    if (node->client)
-                        fprintf (fp, "mbserver:         %s from (%d)-\"%s\"\n",
-                                 node->code==REQUEST?
-                                 "Requested":"Reserved",
-                                 node->client->id,
-                                 node->client->cmdline);
-                    node = node->next;
+    /*
+     * Now that we've decided which requests are going to query which clients
+     * for pages, we need to send out the queries to each client, once the
+     * batch window is up...
+     */
+    if (server->batch_until && now_ns () < server->batch_until)
+        goto poll;
+    for (w = 0; w < server->slot_words; w++) {
+        uint64_t bits = server->pending_mask[w];
+
+        server->pending_mask[w] = 0;
+        while (bits) {
+            Client * client = server->slots[w * SLOT_BITS + __builtin_ctzll (bits)];
+
+            bits &= bits - 1;
+
+            /**
+             * Skip any clients that don't have a pending share query
+             */
+            if (!is_share_pending(client))
+                continue;
+
+            /*
+             * Send the query and mark it outstanding.  A client can only
+             * share whole granules; what it shares over goes to the pool.
+             */
+            set_share_outstanding(server, client);
+            client->lookahead = lookahead_pages (server, client);
+            client->needed_pages += client->lookahead;
+            server->lookahead_asked += client->lookahead;
+            client->needed_pages = granule_round_up(client, client->needed_pages);
+            client->asked_ns = now_ns ();
+            if (send_message (server, client,
+                              client->share_type,
+                              client->needed_pages) == 0 ) {
+
+                mblog_event (&server->log, LOG_SHARE_QUERY,
+                             client->share_type, client->id,
+                             client->needed_pages, 0, client->pid, 0);
+                server->share_queries++;
+                sent++;
+                note_borrow (server, client);
+                if (server->share_timeout)
+                    mbtimer_arm (&server->timers, &client->timer,
+                                 server->timers.now + server->share_timeout);
+            } 
+            else
+            {
+                /*
+                 * If the query fails for some reason, treat the client as
+                 * having responded with no pages so the request can move on
+                 * to the next client. 
+                 *
+                 * TODO: Should we unilaterally delete the client in this case?
+                 * What about any pages it had?
+                 */
+                request = server->queue;
+                while (request) {
+                    if (is_asking(server, request, client)) {
+                        mark_client_responded(server, request, client);
+                    }
+                    request = request->next;
                 }
+                clear_share(server, client);
+
+                mblog_event (&server->log, LOG_SEND_ERROR, 0, client->id,
+                             0, 0, client->pid, 0);
+            }
+        }
+    }
+
+    if (server->batch_until)
+        adapt_batch (server, sent);
+
+poll:
+    /* ...and ask the ones whose estimates have gone stale for new ones */
+    for (w = 0; w < server->slot_words; w++) {
+        uint64_t bits = server->polling_mask[w];
+
+        server->polling_mask[w] = 0;
+        while (bits) {
+            Client * client = server->slots[w * SLOT_BITS + __builtin_ctzll (bits)];
+
+            bits &= bits - 1;
+            if (send_message (server, client, QUERY_AVAILABLE, REQUEST) == 0 &&
+                send_message (server, client, QUERY_AVAILABLE, RESERVE) == 0) {
+                client->available_due = 2;
+                set_slot(server->polled_mask, client->slot);
+            }
+        }
+    }
+}
+
+
+static int
+grow_client_pool (Server * server)
+{
+    struct client_slab * slab = server_calloc (server, 1, sizeof (*slab));
+    int i;
+
+    if (!slab) {
+        perror ("grow_client_pool(): calloc");
+        return -1;
+    }
+
+    slab->next = server->client_slabs;
+    server->client_slabs = slab;
+    for (i = SLAB_OBJECTS - 1; i >= 0; i--) {
+        slab->clients[i].fd = -1;
+        slab->clients[i].next = server->free_clients;
+        server->free_clients = &slab->clients[i];
+    }
+    server->client_capacity += SLAB_OBJECTS;
+    return 0;
+}
+
+static void
+put_client (Server * server, Client * client)
+{
+    client->fd = -1;
+    client->next = server->free_clients;
+    server->free_clients = client;
+}
+
+#if HAVE_IO_URING
+static int
+uring_recv (Server * server, Client * client)
+{
+    struct io_uring_sqe * sqe = mburing_get_sqe (&server->uring);
+
+    if (!sqe) {
+        mblog_event (&server->log, LOG_RING_BUSY, 0, client->id, errno, 0,
+                     client->pid, 0);
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->fd;
+    sqe->addr = (uintptr_t) client->uin;
+    sqe->len = sizeof (client->uin);
+    sqe->user_data = (uintptr_t) client | URING_RECV;
+    client->inflight++;
+    return 0;
+}
+#endif
+
+static Client *
+create_client (Server * server, int fd, int seqpacket)
+{
+    Client * client;
+    struct epoll_event event;
+
+    if (!server->free_clients && grow_client_pool (server) != 0) {
+        mblog_event (&server->log, LOG_CONNECTION_REFUSED, 0, 0, 0, 0, 0, 0);
+        close (fd);
+        return NULL;
+    }
+
+    client = server->free_clients;
+    server->free_clients = client->next;
+    memset (client, 0, sizeof (*client));
+
+    client->fd = fd;
+    client->slot = -1;
+    client->proto = seqpacket ? 2 : 1;
+    client->seqpacket = seqpacket;
+    client->share_type = INVALID;
+    client->timer.kind = TIMER_CLIENT;
+
+#if HAVE_IO_URING
+    if (server->uring_active) {
+        if (uring_recv (server, client) != 0) {
+            close (fd);
+            put_client (server, client);
+            return NULL;
+        }
+        return client;
+    }
+#endif
+
+    /* Edge triggered; the event carries the client itself so a wakeup never
+     * has to search for the connection it belongs to.  EPOLLOUT is only
+     * asked for while queued output is stuck. */
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = client;
+    if (epoll_ctl (server->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        perror ("epoll_ctl");
+        close (fd);
+        put_client (server, client);
+        return NULL;
+    }
+
+    return client;
+}
+
+static int
+grow_bitmap (Server * server, uint64_t ** mask,
+             unsigned int old_words, unsigned int new_words)
+{
+    uint64_t * grown = server_realloc (server, *mask,
+                                       new_words * sizeof (uint64_t));
+    if (!grown) {
+        perror ("grow_bitmap(): realloc");
+        return -1;
+    }
+    memset (grown + old_words, 0, (new_words - old_words) * sizeof (uint64_t));
+    *mask = grown;
+    return 0;
+}
+
+/*
+ * Makes room for more clients by doubling the slot bitmaps.  Only ever
+ * happens when a client registers.  On failure the old width stays in use.
+ */
+static int
+grow_slots (Server * server)
+{
+    unsigned int old_words = server->slot_words;
+    unsigned int new_words = old_words ? old_words * 2 : 1;
+    struct request_slab * slab;
+    void * grown;
+    int i;
+
+    if (grow_bitmap (server, &server->used_mask, old_words, new_words) ||
+        grow_bitmap (server, &server->bidi_mask, old_words, new_words) ||
+        grow_bitmap (server, &server->source_mask, old_words, new_words) ||
+        grow_bitmap (server, &server->requesting_mask, old_words, new_words) ||
+        grow_bitmap (server, &server->requesting_low_mask, old_words, new_words) ||
+        grow_bitmap (server, &server->sharing_mask, old_words, new_words) ||
+        grow_bitmap (server, &server->sharing_low_mask, old_words, new_words) ||
+        grow_bitmap (server, &server->pending_mask, old_words, new_words) ||
+        grow_bitmap (server, &server->cooldown_mask, old_words, new_words) ||
+        grow_bitmap (server, &server->estimating_mask, old_words, new_words) ||
+        grow_bitmap (server, &server->polled_mask, old_words, new_words) ||
+        grow_bitmap (server, &server->polling_mask, old_words, new_words) ||
+        grow_bitmap (server, &server->candidate_scratch, old_words, new_words))
+        return -1;
+
+    grown = server_realloc (server, server->slots,
+                            new_words * SLOT_BITS * sizeof (Client *));
+    if (!grown)
+        goto fail;
+    server->slots = grown;
+
+    grown = server_realloc (server, server->dirty,
+                            new_words * SLOT_BITS * sizeof (Request *));
+    if (!grown)
+        goto fail;
+    server->dirty = grown;
+
+    /* Pooled requests carry responded bitmaps of the old width */
+    for (slab = server->request_slabs; slab; slab = slab->next) {
+        slab->spare = server_calloc (server,
+                                     REQUEST_BITMAPS * new_words * SLAB_OBJECTS,
+                                     sizeof (uint64_t));
+        if (!slab->spare)
+            goto fail_spare;
+    }
+    for (slab = server->request_slabs; slab; slab = slab->next) {
+        for (i = 0; i < SLAB_OBJECTS; i++) {
+            Request * request = &slab->requests[i];
+            uint64_t * responded = slab->spare + REQUEST_BITMAPS * new_words * i;
+            unsigned int b;
+
+            for (b = 0; b < REQUEST_BITMAPS; b++)
+                memcpy (responded + b * new_words,
+                        request->responded + b * old_words,
+                        old_words * sizeof (uint64_t));
+            request->responded = responded;
+        }
+        server_free (server, slab->bitmaps);
+        slab->bitmaps = slab->spare;
+        slab->spare = NULL;
+    }
+
+    server->slot_words = new_words;
+    return 0;
+
+fail_spare:
+    for (slab = server->request_slabs; slab && slab->spare; slab = slab->next) {
+        server_free (server, slab->spare);
+        slab->spare = NULL;
+    }
+fail:
+    perror ("grow_slots(): realloc");
+    return -1;
+}
+
+static int
+grow_request_pool (Server * server)
+{
+    struct request_slab * slab = server_calloc (server, 1, sizeof (*slab));
+    unsigned int words = server->slot_words;
+    int i;
+
+    if (slab)
+        slab->bitmaps = server_calloc (server,
+                                       REQUEST_BITMAPS * words * SLAB_OBJECTS,
+                                       sizeof (uint64_t));
+    if (!slab || !slab->bitmaps) {
+        perror ("grow_request_pool(): calloc");
+        server_free (server, slab);
+        return -1;
+    }
+
+    slab->next = server->request_slabs;
+    server->request_slabs = slab;
+    for (i = SLAB_OBJECTS - 1; i >= 0; i--) {
+        Request * request = &slab->requests[i];
+
+        request->responded = slab->bitmaps + REQUEST_BITMAPS * words * i;
+        request->next = server->free_requests;
+        server->free_requests = request;
+    }
+    server->request_capacity += SLAB_OBJECTS;
+    return 0;
+}
+
+/*
+ * Grows every pool and table so that the given number of clients can be
+ * registered, each with a request queued, without further allocation.
+ */
+static int
+reserve_clients (Server * server, unsigned int clients)
+{
+    while (server->id_buckets < clients)
+        if (grow_id_table (server) != 0)
+            return -1;
+    while (server->slot_words * SLOT_BITS < clients)
+        if (grow_slots (server) != 0)
+            return -1;
+    while (server->request_capacity < clients)
+        if (grow_request_pool (server) != 0)
+            return -1;
+    while (server->client_capacity < clients)
+        if (grow_client_pool (server) != 0)
+            return -1;
+    return 0;
+}
+
+static void
+assign_slot (Server * server, Client * client)
+{
+    unsigned int w;
+    int slot;
+
+    /* reserve_clients() made sure there is a free one */
+    for (w = 0; w < server->slot_words; w++)
+        if (~server->used_mask[w])
+            break;
+
+    slot = w * SLOT_BITS + __builtin_ctzll (~server->used_mask[w]);
+    client->slot = slot;
+    server->slots[slot] = client;
+    set_slot(server->used_mask, slot);
+    if (is_bidirectional(client))
+        set_slot(server->bidi_mask, slot);
+    if (is_source(client))
+        set_slot(server->source_mask, slot);
+}
+
+static void
+release_slot (Server * server, Client * client)
+{
+    int slot = client->slot;
+    Request * request;
+
+    clear_slot(server->used_mask, slot);
+    clear_slot(server->bidi_mask, slot);
+    clear_slot(server->source_mask, slot);
+    clear_slot(server->requesting_mask, slot);
+    clear_slot(server->requesting_low_mask, slot);
+    clear_slot(server->sharing_mask, slot);
+    clear_slot(server->sharing_low_mask, slot);
+    clear_slot(server->pending_mask, slot);
+    clear_slot(server->cooldown_mask, slot);
+    clear_slot(server->estimating_mask, slot);
+    clear_slot(server->polled_mask, slot);
+    clear_slot(server->polling_mask, slot);
+
+    /* The slot will be reused; forget this client's answers */
+    for (request = server->queue; request; request = request->next) {
+        clear_slot(request->responded, slot);
+        clear_slot(request_reserved(server, request), slot);
+    }
+
+    server->slots[slot] = NULL;
+    client->slot = -1;
+}
+
+static int
+register_client (Server * server, Client * client, int id, int64_t param)
+{
+    int fd = client->fd;
+    struct ucred credentials;
+    socklen_t cred_len = sizeof (credentials);
+
+    /* The only place the books grow; everything after this is preallocated */
+    if (reserve_clients (server, server->n_clients + 1) != 0)
+        return -1;
+
+    /* The id that comes in the client message may or may not actually be
+     * the pid of the client; if the client used the "new" api, he may have
+     * used some random number.  We want the real pid so we can provide
+     * useful debug and potentially do some credentials verification.
+     * Ask the kernel for that info.  Note that this only works because
+     * we're using unix domain sockets.
+     */
+    memset (&credentials, 0, cred_len);
+    if (0 != getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &credentials, &cred_len)) {
+        /* We lived without this info for a long time, let's not bail out
+         * just yet...  but spit out a nastygram. */
+        printf ("Membroker WARNING: could not get credentials from socket %d: %s\n",
+                fd, strerror (errno));
+    }
+
+    client->pid = credentials.pid;
+    client->id = id;
+    client->registered = 1;
+    client->source_pages = param & ~REGISTER_BIDI;
+    if (param & REGISTER_BIDI)
+        set_bidirectional(client);
+    else
+        set_normal(client);
+
+    /* Have the log thread read /proc while the process is surely alive */
+    mblog_event (&server->log, LOG_RESOLVE, 0, client->id, 0, 0,
+                 client->pid, 0);
+
+    // Put source clients at front of list, others at the back
+    if (client->source_pages) {
+        client->prev = NULL;
+        client->next = server->client_list;
+        if (server->client_list)
+            server->client_list->prev = client;
+        else
+            server->client_tail = client;
+        server->client_list = client;
+    } else {
+        client->next = NULL;
+        client->prev = server->client_tail;
+        if (server->client_tail)
+            server->client_tail->next = client;
+        else
+            server->client_list = client;
+        server->client_tail = client;
+    }
+
+    hash_client (server, client);
+    assign_slot (server, client);
+    __atomic_add_fetch (&server->client_source_pages, client->source_pages,
+                        __ATOMIC_RELAXED);
+
+    /* A new candidate for anyone who was waiting */
+    if (is_bidirectional(client))
+        mark_blocked_dirty (server);
+
+    return 0;
+}
+
+static inline Request*
+free_request(Server* server, Request* request)
+{
+    Request* rc = request->next;
+    Client* client = request->requesting_client;
+
+    client->active_request = NULL;
+    clear_slot(server->requesting_mask, client->slot);
+    clear_slot(server->requesting_low_mask, client->slot);
+
+    give_server_pages(server, request->acquired_pages);
+
+    mbtimer_cancel(&server->timers, &request->deadline);
+    unmark_request_dirty(server, request);
+    unblock_request(server, request);
+    if (request->complete) {
+        Request ** link = &server->completed;
+        Request * prev = NULL;
+
+        while (*link && *link != request) {
+            prev = *link;
+            link = &prev->next_complete;
+        }
+        if (*link) {
+            *link = request->next_complete;
+            if (server->completed_tail == request)
+                server->completed_tail = prev;
+        }
+    }
+
+    if (request->prev)
+        request->prev->next = rc;
+    else
+        server->queue = rc;
+    if (rc)
+        rc->prev = request->prev;
+    else
+        server->queue_tail = request->prev;
+
+    request->next = server->free_requests;
+    server->free_requests = request;
+    server->queued--;
+
+    /* The requester is no longer deferred */
+    mark_blocked_dirty(server);
+
+    return rc;
+}
+
+/*
+ * Removes a client from the broker's books.  The connection itself stays
+ * open until the peer closes it.
+ */
+static void
+unregister_client( Server * server, Client * client )
+{
+    Request* request = server->queue;
+
+    give_server_pages(server, client->pages);
+
+    if (client->prev)
+        client->prev->next = client->next;
+    else
+        server->client_list = client->next;
+    if (client->next)
+        client->next->prev = client->prev;
+    else
+        server->client_tail = client->prev;
+    client->next = client->prev = NULL;
+
+    unhash_client (server, client);
+    __atomic_sub_fetch (&server->client_source_pages, client->source_pages,
+                        __ATOMIC_RELAXED);
+
+    while (request) {
+        if (request->requesting_client == client) {
+            request = free_request(server, request);
+            continue;
+        }
+        if (is_asking(server, request, client)) {
+            stop_asking(server, request, client);
+            mark_request_dirty(server, request);
+        }
+        request = request->next;
+    }
+
+    clear_share(server, client);
+    mbtimer_cancel(&server->timers, &client->timer);
+    release_slot (server, client);
+    mark_blocked_dirty(server);
+
+    client->registered = 0;
+    client->pages = 0;
+}
+
+/* How long a client's requests may wait, in ms; 0 for ever */
+static inline int
+request_deadline (Server * server, Client * client)
+{
+    return client->deadline ? client->deadline : server->request_timeout;
+}
+
+static inline int
+add_request (Server * server, Client * client, int64_t pages, MbCodes op)
+{
+    /* Registration reserved one request per client */
+    Request * request = server->free_requests;
+
+    if (!request)
+    {
+        mblog_event (&server->log, LOG_POOL_EXHAUSTED, 0, client->id,
+                     0, 0, client->pid, 0);
+        return -1;
+    }
+    server->free_requests = request->next;
+
+    memset (request->responded, 0,
+            REQUEST_BITMAPS * server->slot_words * sizeof (uint64_t));
+    request->needed_pages = pages;
+    request->acquired_pages = 0;
+    request->granted_pages = 0;
+    request->progressive = op == REQUEST &&
+                           (client->request_flags & MB_REQUEST_PROGRESSIVE);
+    request->requesting_client = client;
+    request->n_asking = 0;
+    request->next = NULL;
+    request->prev = server->queue_tail;
+    MB_GET_TIME(&(request->stamp));
+    request->deadline.kind = TIMER_REQUEST;
+    request->type = op;
+    request->escalated = 0;
+    request->complete = 0;
+    request->seq = server->request_seq++;
+    request->dirty_index = -1;
+    request->blocked = 0;
+    request->asked = 0;
+    request->next_complete = NULL;
+    server->queued++;
+
+    if (server->queue_tail)
+        server->queue_tail->next = request;
+    else
+        server->queue = request;
+    server->queue_tail = request;
+
+    client->active_request = request;
+    set_slot(server->requesting_mask, client->slot);
+    if (op == REQUEST)
+        set_slot(server->requesting_low_mask, client->slot);
+
+    if (request_deadline (server, client))
+        mbtimer_arm (&server->timers, &request->deadline,
+                     now_tick () + request_deadline (server, client));
+
+    mark_request_dirty (server, request);
+    return 0;
+}
+
+/*
+ * A request has waited as long as it may.  It goes with what it has, or,
+ * if escalation is on, a REQUEST gets a second go as a RESERVE first.
+ * Pages from a share query still out on its behalf go to the pool when
+ * they turn up.
+ */
+static void
+request_expired (Server * server, Request * request)
+{
+    Client * client = request->requesting_client;
+
+    if (request->complete)
+        return;
+
+    if (server->escalate && request->type == REQUEST) {
+        /* Stop waiting on whoever it asked last; it may be wedged */
+        forget_asking(server, request);
+        request->type = RESERVE;
+        request->escalated = 1;
+        clear_slot(server->requesting_low_mask, client->slot);
+        mbtimer_arm (&server->timers, &request->deadline,
+                     server->timers.now + request_deadline (server, client));
+        mblog_event (&server->log, LOG_ESCALATED, 0, client->id,
+                     request->needed_pages, 0, client->pid, 0);
+
+        /* Its RESERVE may now ask clients its REQUEST already asked, and
+         * requests that were blocking on it at REQUEST no longer are */
+        mark_request_dirty (server, request);
+        mark_blocked_dirty (server);
+        return;
+    }
+
+    forget_asking(server, request);
+    mblog_event (&server->log, LOG_EXPIRED, request->type, client->id,
+                 request->acquired_pages,
+                 request->acquired_pages + request->needed_pages,
+                 client->pid, 0);
+    request_complete (server, request);
+}
+
+/*
+ * A bidi client has sat on a share query for too long.  It counts as
+ * having answered DENY, so nothing waits on it any more; its answer, when
+ * it comes, is taken as an unsolicited return.  A client that does this
+ * again and again is left out for a while, longer each time.
+ */
+static void
+share_stalled (Server * server, Client * client)
+{
+    Request * request;
+
+    client->stalls++;
+    client->strikes++;
+    client->stale_replies++;
+    server->stalls++;
+    mblog_event (&server->log, LOG_SHARE_STALLED, client->share_type,
+                 client->id, client->needed_pages, client->strikes,
+                 client->pid, 0);
+
+    for (request = server->queue; request; request = request->next)
+        if (is_asking(server, request, client))
+            mark_client_responded (server, request, client);
+    clear_share (server, client);
+
+    if (client->strikes > 1) {
+        int shift = min (client->strikes - 2, MAX_COOLDOWN_SHIFT);
+
+        set_slot(server->cooldown_mask, client->slot);
+        mbtimer_arm (&server->timers, &client->timer,
+                     server->timers.now +
+                     ((uint64_t) server->share_timeout << shift));
+    }
+}
+
+static void
+client_timer (Server * server, Client * client)
+{
+    if (test_slot(server->cooldown_mask, client->slot)) {
+        /* Back in the running for anyone still waiting */
+        clear_slot(server->cooldown_mask, client->slot);
+        mark_blocked_dirty (server);
+    } else if (is_share_outstanding(client)) {
+        share_stalled (server, client);
+    }
+}
+
+static void
+expire_timers (Server * server)
+{
+    /* Also brings the wheel's clock up to date for this pass */
+    struct mbtimer * timer = mbtimer_advance (&server->timers, now_tick ());
+
+    while (timer) {
+        struct mbtimer * next = timer->next;
+
+        if (timer->kind == TIMER_REQUEST)
+            request_expired (server, (Request *) ((char *) timer -
+                                     offsetof (Request, deadline)));
+        else if (timer->kind == TIMER_REPAY)
+            ;   /* return_shared_pages() looks again */
+        else
+            client_timer (server, (Client *) ((char *) timer -
+                                  offsetof (Client, timer)));
+        timer = next;
+    }
+}
+
+/*
+ * Points timer_fd at the next thing the wheel has to do, or at the end of
+ * the batch window if that comes first
+ */
+static void
+set_timer (Server * server)
+{
+    uint64_t next = mbtimer_next (&server->timers);
+    struct itimerspec its;
+
+    if (next != MBTIMER_NEVER)
+        next *= TICK_NS;
+    if (server->batch_until && server->batch_until < next)
+        next = server->batch_until;
+    if (next == server->timer_set || server->timer_fd == -1)
+        return;
+
+    memset (&its, 0, sizeof (its));
+    if (next != MBTIMER_NEVER) {
+        its.it_value.tv_sec = next / 1000000000;
+        its.it_value.tv_nsec = next % 1000000000;
+    }
+    if (timerfd_settime (server->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) != 0)
+        perror ("timerfd_settime");
+    else
+        server->timer_set = next;
+}   
+
+/*
+ * Sends the whole granules progressive requests have gathered on to their
+ * requesters, as SHAREs with more to come
+ */
+static void
+send_grants (Server * server)
+{
+    Request * request;
+
+    server->grants_due = 0;
+    for (request = server->queue; request; request = request->next) {
+        Client * client = request->requesting_client;
+        int64_t pages = request->acquired_pages & ~granule_mask(client);
+
+        if (!request->progressive || request->complete || !pages)
+            continue;
+        if (send_flagged (server, client, SHARE, MB_SHARE_MORE, pages) == 0) {
+            client->pages += pages;
+            request->acquired_pages -= pages;
+            request->granted_pages += pages;
+        } else {
+            server->grants_due = 1;
+        }
+    }
+}
+
+static void
+process_request_queue (Server * server)
+{
+    Request ** link = &server->completed;
+    Request* request;
+    int64_t odd;
+    int deferred;
+
+    while ((request = *link))
+    {
+        struct timespec now;
+        MB_GET_TIME(&now);
+        now.tv_nsec -= request->stamp.tv_nsec;
+        if (now.tv_nsec < 0)
+        {
+            now.tv_nsec += 1000000000;
+            now.tv_sec--;
+        }
+        now.tv_sec -= request->stamp.tv_sec;
+
+        /* Whole granules only; the rest goes back for someone else */
+        odd = request->acquired_pages &
+              granule_mask(request->requesting_client);
+        if (odd) {
+            request->acquired_pages -= odd;
+            request->needed_pages += odd;
+            give_server_pages(server, odd);
+        }
+
+        deferred = request->requesting_client->out_retry;
+        if (send_message (server, request->requesting_client,
+                          SHARE , request->acquired_pages ) == 0)
+        {
+            mblog_event (&server->log, LOG_PROCESSED, 0,
+                         request->requesting_client->id,
+                         request->granted_pages + request->acquired_pages,
+                         request->granted_pages + request->acquired_pages +
+                         request->needed_pages,
+                         request->requesting_client->pid,
+                         (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec);
+
+            request->requesting_client->pages += request->acquired_pages;
+            request->acquired_pages = 0;
+        } else {
+            /*
+             * It keeps its pages, and gets no more, until it goes again once
+             * the queue has room
+             */
+            if (!deferred)
+                mblog_event (&server->log, LOG_SHARE_FAILED, 0,
+                             request->requesting_client->id,
+                             request->acquired_pages, 0,
+                             request->requesting_client->pid, 0);
+            link = &request->next_complete;
+            continue;
+        }
+
+        free_request(server, request);
+    }
+}
+
+/* Puts pages towards a request; a progressive one gets them sent on */
+static inline void
+add_request_pages(Server* server, Request* request, int64_t pages)
+{
+    request->acquired_pages += pages;
+    request->needed_pages -= pages;
+    if (request->progressive && pages)
+        server->grants_due = 1;
+}
+
+static void
+process_unsolicited_pages(Server* server)
+{
+    Request* request = server->queue;
+
+    /* A completed request leaves with what it had; a RESERVE all or none */
+    while (request && server->pages > 0) {
+        if (request->needed_pages && !request->complete) {
+            int64_t pages = min(server->pages, request->needed_pages);
+                add_request_pages(server, request, pages);
+                server->pages -= pages;            
+                if (request->needed_pages == 0)
+                    request_complete(server, request);
+        }
+        request = request->next;
+    }
+}
+
+static void
+process_solicited_pages(Server* server, Client* client, int64_t shared_pages)
+{
+    Request* request = server->queue;
+
+    while (request)
+    {
+        if (is_asking(server, request, client)) {
+            int64_t pages = request->complete ? 0 :
+                            min (shared_pages, request->needed_pages);
+            add_request_pages(server, request, pages);
+            shared_pages -= pages;
+            mark_client_responded(server, request, client);
+            if (request->needed_pages == 0 && !request->complete)
+                request_complete(server, request);
+        }
+        request = request->next;
+    }
+    clear_share(server, client);
+
+    give_server_pages(server, shared_pages);
+
+    process_unsolicited_pages(server);
+}
+
+/*
+ * Applies a chunk of a client's answer to its share query, with more to come.
+ * The requests waiting on it get the pages at once, in queue order, and the
+ * ones that have all they need stop waiting on it; what none of them needs
+ * goes to the pool.  The client gets a fresh share timeout for showing signs
+ * of life.
+ */
+static void
+process_share_chunk (Server * server, Client * client, int64_t pages)
+{
+    Request * request;
+
+    mblog_event (&server->log, LOG_PAGES_SHARED, 0, client->id, pages, 0,
+                 client->pid, 0);
+    client->pages -= pages;
+    note_shared (client, pages, 0);
+    server->update_pending = 1;
+
+    if (client->stale_replies || !is_share_outstanding(client)) {
+        give_server_pages(server, pages);
+        return;
+    }
+
+    client->shared += pages;
+    client->strikes = 0;
+    if (server->share_timeout &&
+        !test_slot(server->cooldown_mask, client->slot))
+        mbtimer_arm (&server->timers, &client->timer,
+                     server->timers.now + server->share_timeout);
+
+    for (request = server->queue; request && pages > 0;
+         request = request->next) {
+        if (is_asking(server, request, client) && !request->complete) {
+            int64_t take = min (pages, request->needed_pages);
+
+            add_request_pages(server, request, take);
+            pages -= take;
+            if (request->needed_pages == 0) {
+                mark_client_responded(server, request, client);
+                request_complete(server, request);
+            }
+        }
+    }
+
+    give_server_pages(server, pages);
+    process_unsolicited_pages(server);
+}
+
+static void
+poke_shard (Server * shard)
+{
+    uint64_t one = 1;
+
+    if (write (shard->wake_fd, &one, sizeof (one)) < 0 && errno != EAGAIN)
+        perror ("mbserver: wake shard");
+}
+
+/* Pages the queue is still waiting for */
+static int64_t
+queued_pages (Server * server)
+{
+    Request * request;
+    int64_t pages = 0;
+
+    for (request = server->queue; request; request = request->next)
+        pages += request->needed_pages;
+    return pages;
+}
+
+/* Free pages across all the shards, as best known right now */
+static int64_t
+free_pages (Server * server)
+{
+    struct shards * shards = server->shards;
+    int64_t pages = server->pages;
+    unsigned int i;
+
+    if (shards)
+        for (i = 0; i < shards->n; i++)
+            pages += __atomic_load_n (&shards->shard[i]->spare,
+                                      __ATOMIC_RELAXED);
+    return pages;
+}
+
+/*
+ * Makes up the shard's free pages to want from the spares, its own first.
+ * Each take is a single compare-and-swap, so a page is never in two pools
+ * or in none, and nothing more than needed is taken out of sight of the
+ * other shards.
+ */
+static void
+gather_pages (Server * server, int64_t want)
+{
+    struct shards * shards = server->shards;
+    unsigned int i;
+
+    for (i = 0; i < shards->n && server->pages < want; i++) {
+        Server * other = shards->shard[(server->shard_index + i) % shards->n];
+        int64_t spare = __atomic_load_n (&other->spare, __ATOMIC_ACQUIRE);
+
+        while (spare > 0) {
+            int64_t take = min (spare, want - server->pages);
+
+            if (__atomic_compare_exchange_n (&other->spare, &spare,
+                                             spare - take, 0,
+                                             __ATOMIC_ACQ_REL,
+                                             __ATOMIC_ACQUIRE)) {
+                server->pages += take;
+                break;
+            }
+        }
+    }
+}
+
+/* Pages this shard's source clients have lent out */
+static int64_t
+owed_pages (Server * server)
+{
+    Client * iter;
+    int64_t pages = 0;
+
+    /* Source clients are at the front */
+    for (iter = server->client_list; iter && is_source(iter); iter = iter->next)
+        if (iter->pages < 0)
+            pages -= iter->pages;
+    return pages;
+}
+
+/*
+ * Pages the pool can repay sources now: what it has over repay_keep, if
+ * repay_delay has gone by since the last request, and no more than
+ * repay_rate allows.  Sets *until to when it could repay more than that
+ * without any change in the pool, or MBTIMER_NEVER.
+ */
+static int64_t
+repayable_pages (Server * server, uint64_t * until)
+{
+    uint64_t now = server->timers.now;
+    int64_t pages = server->pages - server->repay_keep;
+
+    *until = MBTIMER_NEVER;
+    if (pages <= 0)
+        return 0;
+
+    if (server->repay_delay &&
+        now < server->demand_at + server->repay_delay) {
+        *until = server->demand_at + server->repay_delay;
+        return 0;
+    }
+
+    if (server->repay_rate) {
+        /* A token bucket holding up to a second's worth */
+        if (server->repay_refilled)
+            server->repay_tokens += (double) (now - server->repay_refilled) *
+                                    server->repay_rate / 1000;
+        server->repay_tokens = min (server->repay_tokens,
+                                    (double) server->repay_rate);
+        server->repay_refilled = now;
+        if (server->repay_tokens < pages) {
+            pages = (int64_t) server->repay_tokens;
+            *until = now + max (1000 / server->repay_rate, 1);
+        }
+    }
+    return pages;
+}
+
+static void
+return_shared_pages (Server * server)
+{
+    if (server->shards && server->queue == NULL)
+        gather_pages (server, owed_pages (server));
+
+    if (server->pages == 0) return;
+
+    if (server->queue == NULL){
+        Client * iter = server->client_list;
+        uint64_t wake = MBTIMER_NEVER;
+        uint64_t until;
+        int64_t spare = repayable_pages (server, &until);
+        int held = 0;
+
+        while (iter) {
+            int64_t owed = min (server->pages, -iter->pages) &
+                           ~granule_mask(iter);
+            int64_t pages = min (owed, spare) & ~granule_mask(iter);
+
+            if (!is_source(iter) || iter->pages >= 0 || owed <= 0) {
+                iter = iter->next;
+                continue;
+            }
+            if (server->repay_damping &&
+                server->timers.now < iter->repay_after) {
+                wake = min (wake, iter->repay_after);
+                iter = iter->next;
+                continue;
+            }
+            if (pages < owed)
+                held = 1;
+            if (pages > 0 && send_message (server, iter, RETURN, pages) == 0) {
+                mblog_event (&server->log, LOG_RETURN, 0, iter->id, pages, 0,
+                             iter->pid, 0);
+                server->pages -= pages;
+                iter->pages += pages;
+                spare -= pages;
+                if (server->repay_rate)
+                    server->repay_tokens -= pages;
+                iter->repaid_at = server->timers.now;
+                server->repaid_pages += pages;
+                server->repayments++;
+            }
+            iter = iter->next;
+        }
+
+        /* Come back for what was held back for a while, rather than kept */
+        if (held)
+            wake = min (wake, until);
+        if (wake != MBTIMER_NEVER)
+            mbtimer_arm (&server->timers, &server->repay_timer, wake);
+    } else {
+        mblog_event (&server->log, LOG_CANT_RETURN, 0, 0, 0, 0, 0, 0);
+    }
+
+    return;
+}
+
+/*
+ * Leaves the free pages where the other shards can get at them, and lets
+ * the ones that are short know.  A shard that is short says so before it
+ * looks at the spares one last time, and a shard with pages to spare
+ * leaves them before it looks for anyone short, so one of the two always
+ * notices the other.
+ */
+static void
+publish_pages (Server * server)
+{
+    struct shards * shards = server->shards;
+    unsigned int i;
+
+    if (server->pages) {
+        __atomic_add_fetch (&server->spare, server->pages, __ATOMIC_SEQ_CST);
+        server->pages = 0;
+        for (i = 0; i < shards->n; i++) {
+            Server * other = shards->shard[i];
+
+            if (other != server &&
+                __atomic_load_n (&other->hungry, __ATOMIC_SEQ_CST))
+                poke_shard (other);
+        }
+    }
+
+    if (!queued_pages (server)) {
+        __atomic_store_n (&server->hungry, 0, __ATOMIC_RELAXED);
+        return;
+    }
+
+    __atomic_store_n (&server->hungry, 1, __ATOMIC_SEQ_CST);
+    for (i = 0; i < shards->n; i++) {
+        Server * other = shards->shard[i];
+
+        if (other != server &&
+            __atomic_load_n (&other->spare, __ATOMIC_SEQ_CST) > 0) {
+            poke_shard (server);
+            break;
+        }
+    }
+}
+
+static void
+update_server(Server* server)
+{
+    expire_timers (server);
+
+    if (server->shards)
+        gather_pages (server, queued_pages (server));
+
+    if (server->pages)
+        server->updates |= PAGES;
+    /* Held share queries go out from request_pages() when their time comes */
+    if (server->batch_until)
+        server->updates |= CLIENT_REQUEST;
+
+    while (server->updates)
+    {
+        int updates = server->updates;
+        server->updates = 0;
+
+        if (updates & PAGES)
+            process_unsolicited_pages(server);
+        if (updates & CLIENT_REQUEST)
+            request_pages(server);
+        process_request_queue(server);
+    }
+    if (server->grants_due)
+        send_grants(server);
+    return_shared_pages(server);
+    set_timer(server);
+}
+
+
+static inline Server *
+initialize_server()
+{
+    Server *server;
+    char * env = getenv ("GLIBC_POOL_SIZE");
+
+    server = (Server *) calloc (1,sizeof(*server));
+
+    if (!server)
+    {
+        perror ("malloc");
+        exit (1);
+    }
+
+#if LOGFILE
+    server->fp = fopen(logfile, "w");
+#else
+    server->fp = stdout;
+#endif
+    setlinebuf (server->fp);
+    server->timer_fd = -1;
+    server->seq_listen_fd = -1;
+
+    if (mbname_init (&server->names) != 0 ||
+        mblog_init (&server->log, server->fp, &server->names) != 0)
+        exit (1);
+
+    if (env) {
+        server->source_pages =
+            server->pages = atoi (env) / EXEC_PAGESIZE;
+
+        fprintf (server->fp, "Initialized membroker with %lld pages (from %s)\n",
+                 (long long) server->pages, env);
+    }
+
+    return server;
+}
+
+static double
+pages_to_megabytes (int64_t pages)
+{
+    return ((double) pages) * EXEC_PAGESIZE / 1024 / 1024;
+}
+
+/*
+ * Names for the status dump come from the cache only; reading /proc is
+ * left to the log thread.
+ */
+static const char *
+client_name (Server * server, Client * client, char * buf, size_t size)
+{
+    if (mbname_peek (&server->names, client->pid, buf, size))
+        return buf;
+
+    mblog_event (&server->log, LOG_RESOLVE, 0, client->id, 0, 0,
+                 client->pid, 0);
+    snprintf (buf, size, "unknown");
+    return buf;
+}
+
+static void
+dump_status (Server * server,
+             FILE * fp)
+{
+    Client * client;
+    int64_t total_pages = get_total_pages (server);
+    char scratch[64];
+    char name[MBNAME_MAX];
+    int level;
+
+    if (server->shards)
+        fprintf (fp, "mbserver: SHARD %u of %u, %lld spare pages%s\n",
+                 server->shard_index, server->shards->n,
+                 (long long) __atomic_load_n (&server->spare, __ATOMIC_RELAXED),
+                 server->hungry ? ", short of pages" : "");
+
+    if (server->source_pages) {
+        snprintf (scratch, sizeof (scratch), "%.3g%%",
+                  server->pages * 100.0 / server->source_pages);
+    } else {
+        /* Don't divide by zero.  This will happen when the server owns no
+         * pages, and relies on a source client to provide them. */
+        snprintf (scratch, sizeof (scratch), "--");
+    }
+
+    fprintf (fp, "mbserver: STATUS server pages = %lld of %lld (%s);  total pages = %lld  (%.1f M)\n",
+             (long long) server->pages, (long long) server->source_pages,
+             scratch, /* percentage */
+             (long long) total_pages, pages_to_megabytes (total_pages));
+    fprintf (fp, "mbserver: MEMORY %lu allocations, %lu frees; room for %u clients, %u requests%s\n",
+             server->allocs, server->frees,
+             server->client_capacity, server->request_capacity,
+             server->locked ? "; locked" : "");
+    if (server->share_timeout)
+        fprintf (fp, "mbserver: STALLS %lu share queries unanswered after %d ms\n",
+                 server->stalls, server->share_timeout);
+    if (server->repay_keep || server->repay_delay || server->repay_rate ||
+        server->repay_damping) {
+        char rate[32] = "";
+
+        if (server->repay_rate)
+            snprintf (rate, sizeof (rate), ", at most %d pages/s",
+                      server->repay_rate);
+        fprintf (fp, "mbserver: REPAYMENT %lld pages in %lu returns; keeps %lld, waits %d ms%s; %lu oscillations%s\n",
+                 (long long) server->repaid_pages, server->repayments,
+                 (long long) server->repay_keep, server->repay_delay, rate,
+                 server->oscillations,
+                 server->repay_damping ? ", damped" : "");
+    }
+    if (server->lookahead)
+        fprintf (fp, "mbserver: LOOKAHEAD %lld pages asked for ahead of demand, %lld shared; %.1f pages a request lately\n",
+                 (long long) server->lookahead_asked,
+                 (long long) server->lookahead_shared, server->arrival_pages);
+    if (server->share_queries) {
+        fprintf (fp, "mbserver: BATCHING %lu share queries for %lu requests, %.2f a request; %.2f requests a query",
+                 server->share_queries, server->asking_requests,
+                 (double) server->share_queries / max (server->asking_requests, 1),
+                 (double) server->share_asks / server->share_queries);
+        if (server->batch_window)
+            fprintf (fp, "; window %d of %d us", server->batch_us,
+                     server->batch_window);
+        fprintf (fp, "\n");
+    }
+    client = server->client_list;
+    fprintf (fp, "mbserver: CLIENTS\n");
+    while (client){
+        /* We want to show how much of the total each client has, but it's
+         * possible for the total to be zero, so we have some icky logic. */
+        if (total_pages) {
+            snprintf (scratch, sizeof (scratch), ", %.3g%% of total",
+                      client->pages * 100.0 / total_pages);
+        } else {
+            scratch[0] = '\0'; /* leave it blank */
+        }
+        fprintf (fp, "mbserver: (%d)-\"%s\" - %s: %lld of %lld pages (%.1f M)%s\n",
+                 client->id,
+                 client_name (server, client, name, sizeof (name)),
+                 is_source(client)?"source":(is_bidirectional(client)?"bidi":"sink"),
+                 (long long) client->pages,
+                 (long long) client->source_pages,
+                 pages_to_megabytes (client->pages),
+                 scratch); /* percentage report */
+
+        if (client->proto == 2)
+            fprintf (fp, "mbserver:     protocol v2 over %s, %lld page granule\n",
+                     client->seqpacket ? "seqpacket" : "stream",
+                     (long long) 1 << client->granule_shift);
+        if (client->active_request)
+            fprintf (fp, "mbserver:     %s %lld of %lld pages\n",
+                     client->active_request->type==REQUEST?
+                     "Requesting":"Reserving",
+                     (long long) client->active_request->needed_pages,
+                     (long long) (client->active_request->needed_pages +
+                                  client->active_request->acquired_pages +
+                                  client->active_request->granted_pages));
+        if (client->share_type != INVALID)
+            fprintf (fp, "mbserver:     %s to share %lld pages%s",
+                     client->share_type==REQUEST?"Requested":"Reserved",
+                     (long long) client->needed_pages,
+                     client->shared ? "" : "\n");
+        if (client->shared)
+            fprintf (fp, ", %lld shared so far\n",
+                     (long long) client->shared);
+        if (test_slot(server->estimating_mask, client->slot)) {
+            char levels[2][48];
+
+            for (level = 0; level < 2; level++) {
+                if (client->available_at[level])
+                    snprintf (levels[level], sizeof (levels[level]),
+                              "%lld pages %lld ms ago",
+                              (long long) client->available[level],
+                              (long long) (now_tick () -
+                                           client->available_at[level]));
+                else
+                    snprintf (levels[level], sizeof (levels[level]), "unknown");
+            }
+            fprintf (fp, "mbserver:     Could share %s at REQUEST, %s at RESERVE%s\n",
+                     levels[0], levels[1],
+                     test_slot(server->polled_mask, client->slot) ?
+                     "; asked again" : "");
+        }
+        for (level = 0; level < 2; level++) {
+            struct share_stats view;
+
+            if (!client->stats[level].answers)
+                continue;
+            share_history (server, client, level ? RESERVE : REQUEST, &view);
+            fprintf (fp, "mbserver:     %s: %u answers in %.3f ms, %.0f%% of pages asked for, %.0f%% denied%s\n",
+                     level ? "RESERVE" : "REQUEST", view.answers,
+                     view.latency, view.yield * 100, view.denials * 100,
+                     !level && is_denier (server, client) ?
+                     "; not asked" : "");
+        }
+        if (client->stalls)
+            fprintf (fp, "mbserver:     %u share queries stalled, %u in a row%s\n",
+                     client->stalls, client->strikes,
+                     test_slot(server->cooldown_mask, client->slot) ?
+                     "; cooling off" : "");
+        if (client->oscillations)
+            fprintf (fp, "mbserver:     asked for pages soon after repayment %u times in a row%s\n",
+                     client->oscillations,
+                     server->timers.now < client->repay_after ?
+                     "; repayment held back" : "");
+        client = client->next;
+    }
+
+    if (server->queue) {
+        Request * request = server->queue;
+        fprintf (fp, "mbserver: QUEUE\n");
+        while (request){
+            unsigned int w;
+            int printed = 0;
+
+            fprintf (fp, "mbserver: Client (%d)-\"%s\" %s %lld of %lld pages since %s",
+                     request->requesting_client->id,
+                     client_name (server, request->requesting_client,
+                                  name, sizeof (name)),
+                     request->type==REQUEST?
+                     "Requesting":"Reserving",
+                     (long long) request->needed_pages,
+                     (long long) (request->needed_pages +
+                                  request->acquired_pages +
+                                  request->granted_pages),
+                     ctime (&(request->stamp.tv_sec)));
+            if (request->progressive)
+                fprintf (fp, "mbserver:     Progressive, %lld pages granted so far\n",
+                         (long long) request->granted_pages);
+            if (mbtimer_armed (&request->deadline))
+                fprintf (fp, "mbserver:     %s in %lld ms\n",
+                         server->escalate && request->type == REQUEST ?
+                         "Escalates" : "Gives up",
+                         (long long) (request->deadline.expires -
+                                      server->timers.now));
+            for (w = 0; w < server->slot_words; w++) {
+                uint64_t bits = request_asking(server, request)[w];
+
+                while (bits) {
+                    Client * node =
+                        server->slots[w * SLOT_BITS + __builtin_ctzll (bits)];
+
+                    bits &= bits - 1;
+                    fprintf (fp, "mbserver:     Actively %s %lld pages from client (%d)-\"%s\"\n",
+                             node->share_type==REQUEST?
+                             "Requesting":"Reserving",
+                             (long long) node->needed_pages,
+                             node->id,
+                             client_name (server, node, name, sizeof (name)));
+                }
+            }
+            for (w = 0; w < server->slot_words; w++) {
+                uint64_t bits = request->responded[w];
+
+                if (bits && !printed) {
+                    fprintf (fp, "mbserver:     Responded Clients:\n");
+                    printed = 1;
+                }
+                while (bits) {
+                    int slot = w * SLOT_BITS + __builtin_ctzll (bits);
+                    Client * node = server->slots[slot];
+
+                    bits &= bits - 1;
+                    fprintf (fp, "mbserver:         %s from (%d)-\"%s\"\n",
+                             test_slot(request_reserved(server, request), slot)?
+                             "Reserved":"Requested",
+                             node->id,
+                             client_name (server, node, name, sizeof (name)));
+                }
+            }
+            request = request->next;
+        }
+    }
+}
+
+/*
+ * Closes a client connection.  Events for it may still be pending in the
+ * current wakeup, so the memory is only released by reap_clients().
+ */
+static void
+close_client (Server * server, Client * client)
+{
+    if (client->registered) {
+        mblog_event (&server->log, LOG_CLOSE, 0, client->id, 0, 0,
+                     client->pid, 0);
+        unregister_client (server, client);
+        server->update_pending = 1;
+    }
+#if HAVE_IO_URING
+    /* Finishes off whatever the ring still has pending on it */
+    if (client->inflight)
+        shutdown (client->fd, SHUT_RDWR);
+#endif
+    /* No fd if it was handed off to another shard */
+    if (client->fd != -1)
+        close (client->fd);
+    client->closing = 1;
+    client->next_closed = server->closed;
+    server->closed = client;
+}
+
+static void
+watch_output (Server * server, Client * client, int blocked)
+{
+    struct epoll_event event;
+
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (blocked ? EPOLLOUT : 0);
+    event.data.ptr = client;
+    if (epoll_ctl (server->epoll_fd, EPOLL_CTL_MOD, client->fd, &event) == -1)
+        perror ("epoll_ctl");
+    client->out_blocked = blocked;
+}
+
+/*
+ * Points msg at the queued output, which may wrap around the ring.  A v2
+ * frame on its way out can take no more ops.
+ */
+static void
+output_iov (Client * client, struct msghdr * msg, struct iovec * iov)
+{
+    unsigned int first = sizeof (client->out) - client->out_head;
+
+    client->out_ops = 0;
+
+    memset (msg, 0, sizeof (*msg));
+    msg->msg_iov = iov;
+    msg->msg_iovlen = 1;
+    iov[0].iov_base = client->out + client->out_head;
+    iov[0].iov_len = first;
+    if (first >= client->out_len) {
+        iov[0].iov_len = client->out_len;
+    } else {
+        iov[1].iov_base = client->out;
+        iov[1].iov_len = client->out_len - first;
+        msg->msg_iovlen = 2;
+    }
+}
+
+static void
+output_drained (Server * server, Client * client)
+{
+    client->out_head = 0;
+    if (client->out_retry) {
+        client->out_retry = 0;
+        server->update_pending = 1;
+    }
+    if (client->out_dropped) {
+        mblog_event (&server->log, LOG_QUEUE_DROPPED, 0, client->id,
+                     client->out_dropped, 0, client->pid, 0);
+        client->out_dropped = 0;
+    }
+}
+
+#if HAVE_IO_URING
+/*
+ * One send per client is in flight at a time; it points into the output
+ * ring, and what gets queued meanwhile goes out when it completes.
+ */
+static void
+uring_send (Server * server, Client * client)
+{
+    struct io_uring_sqe * sqe = mburing_get_sqe (&server->uring);
+
+    /* The queue stays put and goes on the next pass, once the ring has room */
+    if (!sqe) {
+        mblog_event (&server->log, LOG_RING_BUSY, 0, client->id, errno, 0,
+                     client->pid, 0);
+        if (!client->flush_queued) {
+            client->flush_queued = 1;
+            client->next_flush = server->flush_later;
+            server->flush_later = client;
+        }
+        return;
+    }
+
+    output_iov (client, &client->msg, client->iov);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = client->fd;
+    sqe->addr = (uintptr_t) &client->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t) client | URING_SEND;
+    client->send_inflight = 1;
+    client->inflight++;
+}
+#endif
+
+/*
+ * Writes out a client's queued messages with as few syscalls as the socket
+ * allows.  If the socket fills up, the rest waits for EPOLLOUT.
+ */
+static void
+flush_client (Server * server, Client * client)
+{
+#if HAVE_IO_URING
+    if (server->uring_active) {
+        if (client->out_len && !client->send_inflight)
+            uring_send (server, client);
+        return;
+    }
+#endif
+
+    while (client->out_len) {
+        unsigned int size = sizeof (client->out);
+        struct iovec iov[2];
+        struct msghdr msg;
+        ssize_t ret;
+
+        output_iov (client, &msg, iov);
+        ret = sendmsg (client->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!client->out_blocked)
+                    watch_output (server, client, 1);
+                return;
+            }
+            /* The read side will find out about the connection soon enough */
+            mblog_event (&server->log, LOG_SEND_FAILED, 0, client->id,
+                         errno, 0, client->pid, 0);
+            client->out_len = 0;
+            break;
+        }
+        client->out_head = (client->out_head + ret) % size;
+        client->out_len -= ret;
+    }
+
+    if (client->out_blocked)
+        watch_output (server, client, 0);
+    output_drained (server, client);
+}
+
+static void
+flush_clients (Server * server)
+{
+    while (server->flush) {
+        Client * client = server->flush;
+        server->flush = client->next_flush;
+        client->flush_queued = 0;
+
+        if (!client->closing)
+            flush_client (server, client);
+    }
+    server->flush = server->flush_later;
+    server->flush_later = NULL;
+}
+
+static void
+reap_clients (Server * server)
+{
+    Client ** link = &server->closed;
+
+    while (*link) {
+        Client * client = *link;
+
+#if HAVE_IO_URING
+        /* Not while the ring may still complete something for it */
+        if (client->inflight || client->flush_queued) {
+            link = &client->next_closed;
+            continue;
+        }
+#endif
+        *link = client->next_closed;
+        put_client (server, client);
+    }
+}
+
+static unsigned int
+server_caps (Server * server)
+{
+    Server * first = server->shards ? server->shards->shard[0] : server;
+    unsigned int caps = MB_CAP_V2 | MB_CAP_DEADLINE | MB_CAP_GRANULE |
+                        MB_CAP_AVAILABLE | MB_CAP_CHUNKS |
+                        MB_CAP_PROGRESSIVE;
+
+    if (first->seq_listen_fd != -1)
+        caps |= MB_CAP_SEQPACKET;
+    return caps;
+}
+
+/* What a v2 client is told on registering, in one frame */
+static void
+send_snapshot (Server * server, Client * client)
+{
+    send_message (server, client, HELLO, server_caps (server));
+    send_message (server, client, TOTAL, get_total_pages (server));
+    send_message (server, client, QUERY, free_pages (server));
+}
+
+/*
+ * A stream client asks for its granule after registering, in the same
+ * write, so its source pages were taken as pages and are scaled up here.
+ */
+static int
+set_granule (Server * server, Client * client, unsigned int shift)
+{
+    int64_t extra;
+
+    if (shift > MB_GRANULE_SHIFT_MAX ||
+        client->source_pages > (MAX_PAGES >> shift))
+        return -1;
+
+    extra = (client->source_pages << shift) - client->source_pages;
+    client->granule_shift = shift;
+    client->source_pages += extra;
+    __atomic_add_fetch (&server->client_source_pages, extra,
+                        __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void drain_client (Server * server, Client * client);
+#if HAVE_IO_URING
+static void uring_take_input (Server * server, Client * client);
+#endif
+
+/*
+ * Applies one message from a client to the books.  The scheduler runs once
+ * all of the wakeup's input has been taken in.
+ */
+static void
+process_message(Server * server, Client * client, int id, MbCodes op,
+                int64_t val)
+{
+    if (!client->registered)
+    {
+        Client * owner;
+
+        if (op != REGISTER){
+            mblog_event (&server->log, LOG_BAD_REGISTRATION, op, id,
+                         0, 0, 0, 0);
+            return;
+        }
+
+        /*
+         * A client that re-registers under the same id (e.g. after
+         * mb_terminate()) may have its TERMINATE still sitting unread
+         * on the old connection.  Let the old connection have its say
+         * before deciding the id is taken.
+         */
+        owner = get_client_by_id (server, id);
+        if (owner) {
+            drain_client (server, owner);
+            owner = get_client_by_id (server, id);
+        }
+        if (owner) {
+            mblog_event (&server->log, LOG_ALREADY_REGISTERED, 0, id,
+                         0, 0, 0, 0);
+            return;
+        }
+
+        if (register_client (server, client, id, val) != 0) {
+            mblog_event (&server->log, LOG_REGISTER_FAILED, 0, id,
+                         0, 0, 0, 0);
+            client->failed = 1;
+            return;
+        }
+        server->update_pending = 1;
+    }
+    else if (id != client->id)
+    {
+        mblog_event (&server->log, LOG_WRONG_ID, op, client->id, id, 0,
+                     client->pid, 0);
+        return;
+    }
+
+    if (op == DENY) {
+        op = SHARE;
+        val = 0;
+    }
+
+    switch (op){
+        case RESERVE: /* deliberate fall through */
+        case REQUEST:
+            if (client->active_request)
+                break;
+
+            server->demand_at = now_tick ();
+            if (server->lookahead)
+                server->arrival_pages = server->arrival_pages ?
+                    server->arrival_pages +
+                    (val - server->arrival_pages) * LOOKAHEAD_WEIGHT : val;
+            if (server->shards && server->queue == NULL)
+                gather_pages (server, val);
+            if (server->pages >= val && server->queue == NULL &&
+                send_message (server, client, SHARE, val) == 0) {
+                server->pages -= val;
+                client->pages += val;
+                mblog_event (&server->log, LOG_IMMEDIATE, 0, client->id,
+                             val, 0, client->pid, 0);
+            } else if (add_request (server, client, val, (MbCodes)op) == 0) {
+                server->update_pending = 1;
+            } else {
+                send_message (server, client, SHARE, 0);
+            }
+            break;
+        case RETURN:
+            mblog_event (&server->log, LOG_PAGES_RETURNED, 0, client->id,
+                         val, 0, client->pid, 0);
+            if (client->source_pages + client->pages < val ){
+                char name[MBNAME_MAX];
+
+                mblog_stop (&server->log);
+                printf ("mbserver: (%d)-\"%s\" returns %lld pages, but has %lld\n", 
+                        client->id,
+                        mbname_lookup (&server->names, client->pid,
+                                       name, sizeof (name)), (long long) val,
+                        (long long) (client->source_pages + client->pages));
+                exit(10);
+            }
+            client->pages -= val;
+            give_server_pages(server, val);
+            server->update_pending = 1;
+            break;
+        case SHARE:
+            mblog_event (&server->log, LOG_PAGES_SHARED, 0, client->id,
+                         val, 0, client->pid, 0);
+
+            if (!is_bidirectional(client)){
+                char name[MBNAME_MAX];
+
+                mblog_stop (&server->log);
+                printf ("mbserver: %d-\"%s\" shares %lld pages, but is not bidirectional\n", client->id,
+                        mbname_lookup (&server->names, client->pid,
+                                       name, sizeof (name)),
+                        (long long) val);
+                exit(20);
+            }
+            client->pages -= val;
+            note_shared (client, val, 1);
+            if (client->stale_replies) {
+                /* Owed to a query that timed out; nobody is waiting on it */
+                client->stale_replies--;
+                mblog_event (&server->log, LOG_STALE_SHARE, 0, client->id,
+                             val, 0, client->pid, 0);
+                give_server_pages(server, val);
+            } else {
+                if (!test_slot(server->cooldown_mask, client->slot))
+                    mbtimer_cancel(&server->timers, &client->timer);
+                client->strikes = 0;
+                if (is_share_outstanding(client)) {
+                    int64_t asked = client->needed_pages - client->lookahead;
+                    int64_t answer = client->shared + val;
+
+                    note_answer (server, client, answer);
+                    server->lookahead_shared +=
+                        min (max (answer - asked, 0), client->lookahead);
+                    process_solicited_pages(server, client, val);
+                } else {
+                    /*
+                     * Unasked for; a query the batch window is still
+                     * holding back stays in place to go out later
+                     */
+                    give_server_pages(server, val);
+                }
+            }
+            server->update_pending = 1;
+            break;
+
+        case TERMINATE:
+            mblog_event (&server->log, LOG_TERMINATED, 0, client->id,
+                         client->pages, 0, client->pid, 0);
+            send_message (server, client, TERMINATE, 0);
+            unregister_client (server, client);
+            server->update_pending = 1;
+
+            /* client should close the fd */
+            break;
+        case STATUS:
+            /* This isn't really useful except for interactive debugging.
+             * It's still here for backwards compatibility.
+             * For useful debug collection, read from the debug socket,
+             * instead. */
+            dump_status (server, stdout);
+            break;
+        case QUERY:
+            send_message (server, client, QUERY, free_pages (server));
+            break;
+        case REGISTER:
+            mblog_event (&server->log, LOG_REGISTER, 0, client->id, 0, 0,
+                         client->pid, 0);
+            if (client->proto == 2)
+                send_snapshot (server, client);
+            break;
+        case TOTAL:
+            if ((val & ~MB_GRANULE_BITS(0xff)) == MB_HELLO_V2 &&
+                client->proto == 1) {
+                if (set_granule (server, client,
+                                 MB_GRANULE_SHIFT(val)) != 0) {
+                    mblog_event (&server->log, LOG_BAD_FRAME, op,
+                                 client->id, 0, 0, client->pid, 0);
+                    client->failed = 1;
+                    break;
+                }
+                /* The HELLO itself still goes in v1 framing */
+                send_message (server, client, HELLO, server_caps (server));
+                client->proto = 2;
+                send_snapshot (server, client);
+                break;
+            }
+            send_message(server, client, TOTAL, get_total_pages(server));
+            break;
+        case AVAILABLE:
+            note_available (server, client, INVALID, val);
+            break;
+        case QUERY_AVAILABLE:
+            break;
+        case DEADLINE:
+            /* Applies to requests made from now on */
+            client->deadline = val > 0 ? val : 0;
+            break;
+        case INVALID:
+        case DENY:
+        default:
+            break;
+    }
+}
+
+static Server *
+shard_for (Server * server, int id)
+{
+    struct shards * shards = server->shards;
+
+    /* Not the bits id_bucket() uses, so each shard's table stays even */
+    return shards->shard[(((unsigned int)id * 2654435761u) >> 16) % shards->n];
+}
+
+/*
+ * Moves a connection that has yet to register to the shard that owns the
+ * id, with its input from off on.  The connection is then closed here
+ * without closing the socket.
+ */
+static void
+hand_off (Server * server, Server * owner, Client * client, unsigned int off)
+{
+    struct handoff * handoff = server_calloc (server, 1, sizeof (*handoff));
+
+    if (!handoff) {
+        perror ("mbserver: hand_off");
+        return;
+    }
+    if (epoll_ctl (server->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL) == -1) {
+        perror ("epoll_ctl");
+        server_free (server, handoff);
+        return;
+    }
+
+    handoff->fd = client->fd;
+    handoff->seqpacket = client->seqpacket;
+    handoff->len = client->in_len - off;
+    memcpy (handoff->data, client->in + off, handoff->len);
+    client->fd = -1;
+
+    handoff->next = __atomic_load_n (&owner->handoffs, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n (&owner->handoffs, &handoff->next,
+                                         handoff, 0, __ATOMIC_RELEASE,
+                                         __ATOMIC_RELAXED))
+        ;
+    poke_shard (owner);
+}
+
+/*
+ * Applies an op from a v2 frame, its counts turned from the client's
+ * granules into pages.  Counts the books have no room for are refused along
+ * with the connection.
+ */
+static int
+process_op (Server * server, Client * client, const MbOp * op)
+{
+    int id = client->id;
+    int64_t val = 0;
+
+    switch (op->code) {
+    case REGISTER:
+        if (!client->registered) {
+            if (MB_GRANULE_SHIFT(op->flags) > MB_GRANULE_SHIFT_MAX)
+                goto bad;
+            client->granule_shift = MB_GRANULE_SHIFT(op->flags);
+        }
+        if (op->param < 0 || op->param > (MAX_PAGES >> client->granule_shift))
+            goto bad;
+        id = (int) op->tag;
+        val = (op->flags & MB2_BIDI ? REGISTER_BIDI : 0) |
+              (op->param << client->granule_shift);
+        break;
+    case REQUEST:
+    case RESERVE:
+        if (!client->active_request) {
+            client->request_tag = op->tag;
+            client->request_flags = op->flags;
+        }
+        /* fall through */
+    case RETURN:
+    case SHARE:
+        if (op->param < 0 || op->param > (MAX_PAGES >> client->granule_shift))
+            goto bad;
+        val = op->param << client->granule_shift;
+        /* A chunk of the answer to a share query, with more to come */
+        if (op->code == SHARE && (op->flags & MB_SHARE_MORE) &&
+            client->registered && is_bidirectional(client)) {
+            process_share_chunk (server, client, val);
+            return 0;
+        }
+        break;
+    case AVAILABLE:
+        if (op->param < 0 || op->param > (MAX_PAGES >> client->granule_shift))
+            goto bad;
+        val = op->param << client->granule_shift;
+        /* The flags may say which level it is for */
+        if (client->registered && (op->flags == REQUEST ||
+                                   op->flags == RESERVE)) {
+            note_available (server, client, (MbCodes) op->flags, val);
+            return 0;
+        }
+        break;
+    case DEADLINE:
+        if (op->param < 0 || op->param > INT_MAX)
+            goto bad;
+        val = op->param;
+        break;
+    default:
+        break;
+    }
+
+    process_message (server, client, id, (MbCodes) op->code, val);
+    return 0;
+
+bad:
+    mblog_event (&server->log, LOG_BAD_FRAME, op->code, client->id, 0, 0,
+                 client->pid, 0);
+    return -1;
+}
+
+/*
+ * Applies the v2 frames in a client's input buffer, from *off on.  Returns
+ * -1 if the connection is to be dropped.
+ */
+static int
+handle_frames (Server * server, Client * client, unsigned int * off)
+{
+    for (;;) {
+        int size = mb2_frame_size (client->in + *off, client->in_len - *off);
+        unsigned int i, n;
+        MbOp op;
+
+        if (size == 0)
+            return 0;
+        if (size < 0) {
+            mblog_event (&server->log, LOG_BAD_FRAME, 0, client->id, 0, 0,
+                         client->pid, 0);
+            return -1;
+        }
+
+        n = (size - MB2_HEADER_SIZE) / MB2_OP_SIZE;
+        for (i = 0; i < n; i++) {
+            mb2_decode_op (client->in + *off + MB2_HEADER_SIZE +
+                           i * MB2_OP_SIZE, &op);
+            if (i == 0 && server->shards && !client->registered &&
+                op.code == REGISTER) {
+                Server * owner = shard_for (server, (int) op.tag);
+
+                if (owner != server) {
+                    hand_off (server, owner, client, *off);
+                    return -1;
+                }
+            }
+            if (process_op (server, client, &op) != 0 || client->failed)
+                return -1;
+        }
+        *off += size;
+    }
+}
+
+/*
+ * Applies the complete messages in a client's input buffer.  Returns -1 if
+ * the connection is to be dropped.
+ */
+static int
+handle_input (Server * server, Client * client)
+{
+    unsigned int off = 0;
+
+    for (;;) {
+        int id, val;
+        MbCodes op;
+
+        /* A v1 client may switch to v2 part way through the buffer */
+        if (client->proto == 2) {
+            if (handle_frames (server, client, &off) != 0)
+                return -1;
+            break;
+        }
+        if (client->in_len - off < MB_FRAME_SIZE)
+            break;
+
+        mb_decode (client->in + off, &id, &op, &val);
+        if (server->shards && !client->registered && op == REGISTER) {
+            Server * owner = shard_for (server, id);
+
+            /* The connection goes, along with everything it has sent */
+            if (owner != server) {
+                hand_off (server, owner, client, off);
+                return -1;
+            }
+        }
+        off += MB_FRAME_SIZE;
+        if (op == REGISTER)
+            process_message (server, client, id, op,
+                             (val < 0 ? REGISTER_BIDI : 0) |
+                             (val & 0x7fffffff));
+        else
+            process_message (server, client, id, op, val);
+        if (client->failed)
+            return -1;
+    }
+
+    /* Keep any partial message for next time; a packet has none */
+    client->in_len -= off;
+    if (client->seqpacket && client->in_len) {
+        mblog_event (&server->log, LOG_BAD_FRAME, 0, client->id, 0, 0,
+                     client->pid, 0);
+        return -1;
+    }
+    memmove (client->in, client->in + off, client->in_len);
+    return 0;
+}
+
+/*
+ * Reads what a client has sent with a single recv() and handles every
+ * complete message in it.
+ * Returns 1 if the client may have more input pending, 0 if it has been
+ * drained, or -1 if the connection has failed or been closed by the peer.
+ */
+static int
+process_connection(Server * server, Client * client)
+{
+    ssize_t ret;
+    int full;
+
+    do {
+        ret = recv (client->fd, client->in + client->in_len,
+                    sizeof (client->in) - client->in_len, 0);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == 0)
+        return -1;
+    if (ret == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        perror ("recv");
+        return -1;
+    }
+
+    client->in_len += ret;
+    full = (client->in_len == sizeof (client->in));
+
+    if (handle_input (server, client) != 0)
+        return -1;
+
+    /*
+     * A short read says nothing about an EOF queued behind it, and a
+     * packet nothing about the ones behind it.
+     */
+    return full || client->seqpacket || client->hangup;
+}
+
+static void
+drain_client (Server * server, Client * client)
+{
+    int ret;
+
+    if (client->closing)
+        return;
+
+#if HAVE_IO_URING
+    if (server->uring_active) {
+        uring_take_input (server, client);
+        if (client->closing)
+            return;
+    }
+#endif
+
+    while ((ret = process_connection (server, client)) > 0)
+        ;
+
+    if (ret < 0)
+        close_client (server, client);
+}
+
+/*
+ * Reads from a client at most once per round.  Replies only go out at the
+ * end of the round, so a synchronous client answering them as fast as we
+ * send them cannot get to cut in front of messages that other clients
+ * sent earlier.
+ * Returns non-zero if the client may have more input pending.
+ */
+static int
+service_client (Server * server, Client * client)
+{
+    int ret;
+
+    client->round = server->round;
+    if (client->closing)
+        return 0;
+
+    ret = process_connection (server, client);
+    if (ret < 0)
+        close_client (server, client);
+
+    return ret > 0;
+}
+
+/*
+ * One round of the event loop: connections that just reported input are
+ * served first, then the ones left over from the previous round.  Edge
+ * triggered epoll only reports new input, so anything not known to be
+ * drained stays on the ready list.
+ */
+static void
+service_round (Server * server, struct epoll_event * events, int n)
+{
+    Client * carried = server->ready;
+    Client * tail = NULL;
+    int i;
+
+    server->round++;
+    server->ready = NULL;
+
+    /* .events is reused to remember which may have more input */
+    for (i = 0; i < n; i++) {
+        Client * client = (Client *)events[i].data.ptr;
+        uint32_t revents = events[i].events;
+
+        if ((revents & EPOLLOUT) && client->out_blocked && !client->closing)
+            flush_client (server, client);
+        if (revents & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            client->hangup = 1;
+
+        events[i].events = 0;
+        if (revents & ~EPOLLOUT)
+            events[i].events = service_client (server, client);
+    }
+
+    while (carried) {
+        Client * client = carried;
+        carried = client->next_ready;
+
+        if (client->round == server->round)
+            continue;
+        if (service_client (server, client)) {
+            client->next_ready = NULL;
+            if (tail)
+                tail->next_ready = client;
+            else
+                server->ready = client;
+            tail = client;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        Client * client = (Client *)events[i].data.ptr;
+        if (events[i].events && !client->closing) {
+            client->next_ready = NULL;
+            if (tail)
+                tail->next_ready = client;
+            else
+                server->ready = client;
+            tail = client;
+        }
+    }
+}
+
+Server *
+mbs_init()
+{
+    struct sockaddr_un addr;
+
+    int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror ("socket");
+        return NULL;
+    }
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    mb_socket_name (&addr.sun_path[0], sizeof (addr.sun_path));
+    unlink (&addr.sun_path[0]);
+
+    if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) == -1){
+        perror ("bind");
+        close(fd);
+        return NULL;
+    }
+
+    if (listen (fd, 20) == -1) {
+        perror ("listen");
+        close(fd);
+        return (NULL);
+    }
+
+    return mbs_init_with_fd (fd);
+}
+
+/*
+ * Listens on SOCK_SEQPACKET next to the main socket, for v2 clients that
+ * would rather never see a partial message.  The broker does without it if
+ * it cannot be had.
+ */
+static void
+listen_seqpacket (Server * server)
+{
+    int fd;
+
+    memset (&server->seq_sock, 0, sizeof (server->seq_sock));
+    server->seq_sock.sun_family = AF_UNIX;
+    if ((size_t) snprintf (server->seq_sock.sun_path,
+                           sizeof (server->seq_sock.sun_path), "%s.seq",
+                           server->sock.sun_path)
+        >= sizeof (server->seq_sock.sun_path))
+        return;
+
+    fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror ("mbserver: seqpacket socket");
+        return;
+    }
+    unlink (server->seq_sock.sun_path);
+    if (bind (fd, (struct sockaddr *) &server->seq_sock,
+              sizeof (server->seq_sock)) == -1 ||
+        listen (fd, 20) == -1) {
+        perror ("mbserver: seqpacket socket");
+        close (fd);
+        return;
+    }
+    chmod (server->seq_sock.sun_path, 0777);
+    server->seq_listen_fd = fd;
+}
+
+Server*
+mbs_init_with_fd (int fd)
+{
+    Server* server = initialize_server ();
+    socklen_t socklen;
+
+    server->client_listen_fd = fd;
+
+    if (server->client_listen_fd == -1) {
+        fprintf (stderr, "mbserver: invalid fd\n");
+        close (fd);
+        free (server);
+        return NULL;
+    }
+
+    socklen = sizeof (server->sock);
+    if (0 != getsockname (server->client_listen_fd, (struct sockaddr *)&server->sock, &socklen)) {
+        perror ("getsockname");
+        close (fd);
+        free (server);
+        return NULL;
+    }
+    if (server->sock.sun_family != AF_UNIX) {
+        fprintf (stderr, "Bad file descriptor passed to mbs_init_with_fd() -- not a unix domain socket\n");
+        close (fd);
+        free (server);
+        return NULL;
+    }
+
+    chmod(server->sock.sun_path, 0777);
+    listen_seqpacket (server);
+
+    /* Set up debug / status info socket as a side channel.  We don't do this
+     * over the main channel because we stream out lots of data for debug,
+     * whereas the main channel carries short encoded messages. */
+    server->debug_listen_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+
+    if (server->debug_listen_fd == -1) {
+        perror ("socket");
+        close (fd);
+        free (server);
+        return NULL;
+    }
+
+    memset (&server->debug_sock, 0, sizeof (server->debug_sock));
+    server->debug_sock.sun_family = AF_UNIX;
+    snprintf (server->debug_sock.sun_path,
+              sizeof (server->debug_sock.sun_path),
+              "%s/membroker.debug",
+              getenv ("LXK_RUNTIME_DIR") ? getenv ("LXK_RUNTIME_DIR") : ".");
+    if (0 == strcmp (server->debug_sock.sun_path, server->sock.sun_path)) {
+        /* This means we can't create the second socket.  Limp along with
+         * no debug. */
+        printf ("mbserver: Path truncation caused debug socket and main socket"
+                " to have same address.  Dropping the debug socket.\n");
+        close (server->debug_listen_fd);
+        server->debug_listen_fd = -1;
+        return server;
+    }
+
+    unlink (server->debug_sock.sun_path);
+    if (0 > bind (server->debug_listen_fd,
+                  (struct sockaddr *) &server->debug_sock,
+                  sizeof (server->debug_sock))) {
+        perror ("mbserver: bind debug socket");
+        close (server->debug_listen_fd);
+        server->debug_listen_fd = -1;
+        return server;
+    }
+
+    if (0 > listen (server->debug_listen_fd, 10)) {
+        perror ("mbserver: listen on debug socket");
+        close (server->debug_listen_fd);
+        server->debug_listen_fd = -1;
+        return server;
+    }
+
+    return server;
+}
+
+void
+mbs_set_pages(Server* server, int64_t pages)
+{
+    server->source_pages = server->pages = pages;
+
+    if (server->fp)
+        fprintf (server->fp, "Set membroker server pages to %lld\n",
+                 (long long) pages);
+}
+
+void
+mbs_set_log_level(Server* server, int level)
+{
+    struct shards * shards = server->shards;
+    unsigned int i;
+
+    __atomic_store_n (&server->log.level, level, __ATOMIC_RELAXED);
+    if (shards)
+        for (i = 1; i < shards->n; i++)
+            __atomic_store_n (&shards->shard[i]->log.level, level,
+                              __ATOMIC_RELAXED);
+}
+
+void
+mbs_set_log_rate(Server* server, unsigned int lines_per_sec)
+{
+    struct shards * shards = server->shards;
+    unsigned int i;
+
+    __atomic_store_n (&server->log.rate, lines_per_sec, __ATOMIC_RELAXED);
+    if (shards)
+        for (i = 1; i < shards->n; i++)
+            __atomic_store_n (&shards->shard[i]->log.rate, lines_per_sec,
+                              __ATOMIC_RELAXED);
+}
+
+void
+mbs_set_request_timeout(Server* server, int ms, int escalate)
+{
+    server->request_timeout = ms > 0 ? ms : 0;
+    server->escalate = escalate;
+}
+
+void
+mbs_set_share_timeout(Server* server, int ms)
+{
+    server->share_timeout = ms > 0 ? ms : 0;
+}
+
+void
+mbs_set_fan_out(Server* server, int enable)
+{
+    server->fan_out = enable;
+}
+
+void
+mbs_set_adaptive_downgrade(Server* server, int enable)
+{
+    server->adaptive_downgrade = enable;
+}
+
+void
+mbs_set_repayment(Server* server, int64_t keep, int delay_ms,
+                  int pages_per_sec)
+{
+    server->repay_keep = keep > 0 ? keep : 0;
+    server->repay_delay = delay_ms > 0 ? delay_ms : 0;
+    server->repay_rate = pages_per_sec > 0 ? pages_per_sec : 0;
+    /* Full to start with, so the first repayment need not wait */
+    server->repay_tokens = server->repay_rate;
+    server->repay_refilled = 0;
+}
+
+void
+mbs_set_repay_damping(Server* server, int enable)
+{
+    server->repay_damping = enable;
+}
+
+void
+mbs_set_lookahead(Server* server, int enable)
+{
+    server->lookahead = enable;
+}
+
+void
+mbs_set_batch_window(Server* server, int us)
+{
+    server->batch_window = us > 0 ? us : 0;
+    server->batch_us = server->batch_window;
+}
+
+int
+mbs_set_shards(Server* server, unsigned int shards)
+{
+    if (shards < 1 || shards > MAX_SHARDS)
+        return -1;
+    server->n_shards = shards;
+    return 0;
+}
+
+int
+mbs_use_io_uring(Server* server, int enable)
+{
+#if HAVE_IO_URING
+    server->want_uring = enable;
+    return 0;
+#else
+    (void) server;
+    return enable ? -1 : 0;
+#endif
+}
+
+unsigned long
+mbs_get_alloc_count(Server* server)
+{
+    return server->allocs;
+}
+
+int
+mbs_reserve_clients(Server* server, unsigned int clients)
+{
+    return reserve_clients (server, clients);
+}
+
+/* Touches enough stack that handling a message never faults one in */
+static void __attribute__((noinline))
+prefault_stack (void)
+{
+    volatile char stack[64 * 1024];
+    size_t i;
+
+    for (i = 0; i < sizeof (stack); i += 1024)
+        stack[i] = 0;
+}
+
+int
+mbs_lock_memory(Server* server)
+{
+    if (mlockall (MCL_CURRENT | MCL_FUTURE) != 0) {
+        perror ("mlockall");
+        return -1;
+    }
+    prefault_stack ();
+    server->locked = 1;
+    return 0;
+}
+
+/*
+ * Accepts every pending connection on a listen socket.  A burst of
+ * registrations costs one wakeup.
+ */
+static int
+accept_clients (Server * server, int listen_fd)
+{
+    for (;;) {
+        int new_fd = accept4 (listen_fd, NULL, NULL,
+                              SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (new_fd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror ("accept");
+            return -1;
+        }
+
+        create_client (server, new_fd, listen_fd == server->seq_listen_fd);
+    }
+}
+
+/*
+ * Dumps in flight.  Global rather than per server, since a dump thread
+ * may outlive the server that started it.
+ */
+static int debug_dumps;
+
+struct debug_dump {
+    pthread_t thread;
+    int fd;
+    FILE * fp;
+    char * buf;
+    size_t len;
+    struct debug_dump * next;
+};
+
+static void *
+debug_dump_thread (void * param)
+{
+    struct debug_dump * dump = (struct debug_dump *) param;
+    size_t off = 0;
+
+    while (off < dump->len) {
+        ssize_t n = write (dump->fd, dump->buf + off, dump->len - off);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        off += n;
+    }
+
+    close (dump->fd);
+    free (dump->buf);
+    free (dump);
+    __atomic_sub_fetch (&debug_dumps, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void
+drop_debug_dump (struct debug_dump * dump)
+{
+    close (dump->fd);
+    free (dump);
+    __atomic_sub_fetch (&debug_dumps, 1, __ATOMIC_RELEASE);
+}
+
+/* Hands a finished dump to a thread of its own to write */
+static void
+write_debug_dump (struct debug_dump * dump)
+{
+    pthread_attr_t attr;
+
+    fclose (dump->fp);
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create (&dump->thread, &attr, &debug_dump_thread, dump) != 0) {
+        perror ("mbserver: debug dump thread");
+        free (dump->buf);
+        drop_debug_dump (dump);
+    }
+    pthread_attr_destroy (&attr);
+}
+
+/*
+ * Adds this shard's status to a dump.  Each shard adds its own on its own
+ * thread, passing the dump on to the next, and the last one sees it written.
+ */
+static void
+add_debug_dump (Server * server, struct debug_dump * dump)
+{
+    Server * next;
+
+    dump_status (server, dump->fp);
+    if (!server->shards || server->shard_index + 1 == server->shards->n) {
+        write_debug_dump (dump);
+        return;
+    }
+
+    next = server->shards->shard[server->shard_index + 1];
+    dump->next = __atomic_load_n (&next->dumps, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n (&next->dumps, &dump->next, dump, 0,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    poke_shard (next);
+}
+
+static void
+take_debug_dumps (Server * server)
+{
+    struct debug_dump * list = __atomic_exchange_n (&server->dumps, NULL,
+                                                    __ATOMIC_ACQUIRE);
+
+    while (list) {
+        struct debug_dump * dump = list;
+
+        list = dump->next;
+        add_debug_dump (server, dump);
+    }
+}
+
+/*
+ * Renders the status into memory and leaves the writing to a thread of
+ * its own, so a reader that takes its time never holds up the broker.
+ */
+static void
+start_debug_dump (Server * server, int fd)
+{
+    static const char busy[] = "mbserver: busy, try again\n";
+    struct debug_dump * dump;
+
+    if (__atomic_add_fetch (&debug_dumps, 1, __ATOMIC_ACQUIRE)
+        > MAX_DEBUG_DUMPS) {
+        __atomic_sub_fetch (&debug_dumps, 1, __ATOMIC_RELEASE);
+        send (fd, busy, sizeof (busy) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+        close (fd);
+        return;
+    }
+
+    dump = calloc (1, sizeof (*dump));
+    if (!dump) {
+        perror ("mbserver: debug dump");
+        close (fd);
+        __atomic_sub_fetch (&debug_dumps, 1, __ATOMIC_RELEASE);
+        return;
+    }
+    dump->fd = fd;
+    dump->fp = open_memstream (&dump->buf, &dump->len);
+    if (!dump->fp) {
+        perror ("mbserver: debug dump");
+        drop_debug_dump (dump);
+        return;
+    }
+    add_debug_dump (server, dump);
+}
+
+static int
+accept_debug (Server * server)
+{
+    for (;;) {
+        int new_fd = accept4 (server->debug_listen_fd, NULL, NULL,
+                              SOCK_CLOEXEC);
+
+        if (new_fd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror ("accept");
+            return -1;
+        }
+
+        start_debug_dump (server, new_fd);
+    }
+}
+
+static int
+watch_listen_fd (Server * server, int * fd)
+{
+    struct epoll_event event;
+    int flags = fcntl (*fd, F_GETFL);
+
+    /* The fd may have come from systemd; make sure accept4() can drain it */
+    if (flags == -1 || fcntl (*fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror ("fcntl");
+        return -1;
+    }
 
-            }
-            request = request->next;
-        }
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = fd;
+    if (epoll_ctl (server->epoll_fd, EPOLL_CTL_ADD, *fd, &event) == -1) {
+        perror ("epoll_ctl");
+        return -1;
     }
+    return 0;
 }
 
-static inline int
-process_connection(Server * server, int fd)
+static int
+start_timer (Server * server)
 {
-    int ret;
-    int id;
-    MbCodes op;
-    int val;
-    Client * client; 
-    ret = mb_receive_and_decode (fd, &id, &op, (int*)&val);
-    if (ret <= 0){
+    mbtimer_init (&server->timers, now_tick ());
+    server->repay_timer.kind = TIMER_REPAY;
+    server->timer_set = MBTIMER_NEVER;
+    server->timer_fd = timerfd_create (CLOCK_MONOTONIC,
+                                       TFD_NONBLOCK | TFD_CLOEXEC);
+    if (server->timer_fd == -1) {
+        perror ("timerfd_create");
         return -1;
-    } else {
-        client = get_client_by_id (server, id);
-        
-        if (!client)
-        {
-            if (op == REGISTER){
-                client = create_client (server, id, fd, val);
-                update_server(server);
-            } else {
-                fprintf(server->fp, "Bad registration op %s\n", 
-                        mb_code_name(op));
-                return 0;
-            }
-        }
+    }
+    return 0;
+}
 
-        if (op == DENY) {
-            op = SHARE;
-            val = 0;
-        }
+static void
+timer_fired (Server * server)
+{
+    uint64_t count;
 
-        switch (op){
-            case RESERVE: /* deliberate fall through */
-            case REQUEST:
-                if (client->active_request)
-                    break;
+    if (read (server->timer_fd, &count, sizeof (count)) < 0 &&
+        errno != EAGAIN)
+        perror ("mbserver: read timer fd");
 
-                if (server->pages >= val && server->queue == NULL ){
-                    server->pages -= val;
-                    client->pages += val;
-                    mb_encode_and_send (id, fd, SHARE, val);
-                    fprintf (server->fp, "Immediate Request processed: %s (%d) - SHARE %d\n",
-                             client->cmdline, client->id, val);
-                } else {
-                    add_request (server, client, val, (MbCodes)op);
-                    update_server(server);
-                }
-                break;
-            case RETURN:
-                fprintf (server->fp, "mbserver: Pages Returned: %d\n", val);
-                if (client->source_pages + client->pages < val ){
-                    printf ("mbserver: (%d)-\"%s\" returns %d pages, but has %d\n", 
-                            client->id, client->cmdline, val,
-                            client->source_pages + client->pages);
-                    exit(10);
-                }
-                client->pages -= val;
-                give_server_pages(server, val);
-                update_server(server);
-                break;
-            case SHARE:
-                fprintf (server->fp, "mbserver: Pages Shared: %d\n", val);
+    /* The scheduler pass runs the wheel */
+    server->update_pending = 1;
+}
 
-                if (!is_bidirectional(client)){
-                    printf ("mbserver: %d-\"%s\" shares %d pages, but is not bidirectional\n", client->id, client->cmdline,
-                            val);
-                    exit(20);
-                }
-                client->pages -= val;
-                process_solicited_pages(server, client, val);
-                update_server(server);
-                break;
+#if HAVE_IO_URING
+/* Appends input the ring read to the client's buffer and applies it */
+static int
+take_input (Server * server, Client * client, const unsigned char * data,
+            size_t len)
+{
+    while (len) {
+        size_t n = min (len, sizeof (client->in) - client->in_len);
+
+        memcpy (client->in + client->in_len, data, n);
+        client->in_len += n;
+        data += n;
+        len -= n;
+        if (handle_input (server, client) != 0)
+            return -1;
+    }
+    return 0;
+}
 
-            case TERMINATE:
-                fprintf (server->fp, "mbserver: client (%d)-\"%s\" terminated, reclaimed %d pages\n", client->id, client->cmdline, client->pages);
-		mb_encode_and_send (id, fd, TERMINATE, 0);
-                free_client (server, client);
-                update_server(server);
+static void
+uring_client_done (Server * server, Client * client, int op, int res)
+{
+    client->inflight--;
+
+    if (op == URING_SEND) {
+        client->send_inflight = 0;
+        if (client->closing)
+            return;
+        if (res < 0) {
+            /* The read side will find out about the connection soon enough */
+            mblog_event (&server->log, LOG_SEND_FAILED, 0, client->id,
+                         -res, 0, client->pid, 0);
+            client->out_len = 0;
+        } else {
+            client->out_head = (client->out_head + res) % sizeof (client->out);
+            client->out_len -= res;
+        }
+        if (client->out_len)
+            uring_send (server, client);
+        else
+            output_drained (server, client);
+        return;
+    }
 
-                /* client should close the fd */
-                break;
-            case STATUS:
-                /* This isn't really useful except for interactive debugging.
-                 * It's still here for backwards compatibility.
-                 * For useful debug collection, read from the debug socket,
-                 * instead. */
-                dump_status (server, stdout);
-                break;
-            case QUERY:
-                mb_encode_and_send (id, fd, QUERY, server->pages);
-                break;
-            case REGISTER:
-                fprintf (server->fp, "mbserver: Register client (%d)-\"%s\"\n", client->id, client->cmdline);
-                break;
-            case TOTAL:
-                mb_encode_and_send(id, fd, TOTAL, get_total_pages(server));
-                break;
-            case AVAILABLE:
-                break;
-            case QUERY_AVAILABLE:
-                break;
-            case INVALID:
-            case DENY:
-            default:
-                break;
+    if (client->closing)
+        return;
+    if (res <= 0) {
+        if (res < 0) {
+            errno = -res;
+            perror ("recv");
         }
+        close_client (server, client);
+        return;
     }
+    if (take_input (server, client, client->uin, res) != 0 ||
+        uring_recv (server, client) != 0) {
+        if (!client->closing)
+            close_client (server, client);
+    }
+}
 
-    return 0;
+/*
+ * Takes in what the ring has already read for a client but the loop has
+ * not got round to yet, so that reading the socket directly keeps the
+ * messages in order.
+ */
+static void
+uring_take_input (Server * server, Client * client)
+{
+    uint64_t tag = (uintptr_t) client | URING_RECV;
+    unsigned int i, n = mburing_ready (&server->uring);
 
+    for (i = 0; i < n; i++) {
+        struct io_uring_cqe * cqe = mburing_cqe (&server->uring, i);
+
+        if (cqe->user_data == tag) {
+            cqe->user_data = URING_IGNORE;
+            uring_client_done (server, client, URING_RECV, cqe->res);
+        }
+    }
 }
 
-Server *
-mbs_init()
+/* A multishot accept; it stays posted until something goes wrong */
+static int
+uring_poll_timer (Server * server)
 {
-    struct sockaddr_un addr;
+    struct io_uring_sqe * sqe = mburing_get_sqe (&server->uring);
 
-    int fd = socket (AF_UNIX, SOCK_STREAM, 0);
-    if (fd == -1) {
-        perror ("socket");
-        return NULL;
+    if (!sqe) {
+        perror ("io_uring_enter");
+        return -1;
     }
 
-    memset (&addr, 0, sizeof (addr));
-    addr.sun_family = AF_UNIX;
-    mb_socket_name (&addr.sun_path[0], sizeof (addr.sun_path));
-    unlink (&addr.sun_path[0]);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = server->timer_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = URING_TIMER;
+    return 0;
+}
 
-    if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) == -1){
-        perror ("bind");
-        close(fd);
-        return NULL;
-    }
+static int
+uring_accept (Server * server, int fd, uint64_t tag)
+{
+    struct io_uring_sqe * sqe = mburing_get_sqe (&server->uring);
 
-    if (listen (fd, 20) == -1) {
-        perror ("listen");
-        close(fd);
-        return (NULL);
+    if (!sqe) {
+        perror ("io_uring_enter");
+        return -1;
     }
 
-    return mbs_init_with_fd (fd);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    /* Debug dumps are written by a thread that may block */
+    sqe->accept_flags = SOCK_CLOEXEC |
+                        (tag != URING_ACCEPT_DEBUG ? SOCK_NONBLOCK : 0);
+    sqe->user_data = tag;
+    return 0;
 }
 
-Server*
-mbs_init_with_fd (int fd)
+static int
+uring_complete (Server * server, const struct io_uring_cqe * cqe)
 {
-    Server* server = initialize_server ();
-    socklen_t socklen;
+    uint64_t data = cqe->user_data;
+    int fd;
 
-    server->client_listen_fd = fd;
+    if (data == URING_IGNORE)
+        return 0;
 
-    if (server->client_listen_fd == -1) {
-        fprintf (stderr, "mbserver: invalid fd\n");
-        close (fd);
-        free (server);
-        return NULL;
+    if (data == URING_TIMER) {
+        timer_fired (server);
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            return uring_poll_timer (server);
+        return 0;
     }
 
-    socklen = sizeof (server->sock);
-    if (0 != getsockname (server->client_listen_fd, (struct sockaddr *)&server->sock, &socklen)) {
-        perror ("getsockname");
-        close (fd);
-        free (server);
-        return NULL;
+    if (data != URING_ACCEPT_CLIENT && data != URING_ACCEPT_DEBUG &&
+        data != URING_ACCEPT_SEQ) {
+        uring_client_done (server,
+                           (Client *) (uintptr_t) (data & ~(uint64_t) URING_OP_MASK),
+                           data & URING_OP_MASK, cqe->res);
+        return 0;
     }
-    if (server->sock.sun_family != AF_UNIX) {
-        fprintf (stderr, "Bad file descriptor passed to mbs_init_with_fd() -- not a unix domain socket\n");
-        close (fd);
-        free (server);
-        return NULL;
+
+    fd = data == URING_ACCEPT_CLIENT ? server->client_listen_fd :
+         data == URING_ACCEPT_SEQ ? server->seq_listen_fd :
+         server->debug_listen_fd;
+    if (cqe->res >= 0) {
+        if (data == URING_ACCEPT_DEBUG)
+            start_debug_dump (server, cqe->res);
+        else
+            create_client (server, cqe->res, data == URING_ACCEPT_SEQ);
+    } else if (cqe->res != -EINTR && cqe->res != -ECONNABORTED &&
+               cqe->res != -EAGAIN) {
+        errno = -cqe->res;
+        perror ("accept");
+        return -1;
     }
 
-    chmod(server->sock.sun_path, 0777);
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        return uring_accept (server, fd, data);
+    return 0;
+}
 
-    /* Set up debug / status info socket as a side channel.  We don't do this
-     * over the main channel because we stream out lots of data for debug,
-     * whereas the main channel carries short encoded messages. */
-    server->debug_listen_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+/*
+ * The event loop on io_uring.  Accepts stay posted on the listen sockets
+ * and a recv on every connection; the replies of a wakeup are queued as
+ * sends and go to the kernel, along with the recvs to re-arm, in the same
+ * syscall that waits for the next completions.
+ */
+static void *
+uring_main (Server * server)
+{
+    struct io_uring_cqe cqe;
+    void * rc = 0;
+
+    server->uring_active = 1;
+    if (start_timer (server) != 0 || uring_poll_timer (server) != 0)
+        return ((void*)3);
+    if (uring_accept (server, server->client_listen_fd,
+                      URING_ACCEPT_CLIENT) != 0)
+        return ((void*)3);
+    if (server->seq_listen_fd != -1 &&
+        uring_accept (server, server->seq_listen_fd, URING_ACCEPT_SEQ) != 0)
+        return ((void*)3);
+    if (server->debug_listen_fd != -1 &&
+        uring_accept (server, server->debug_listen_fd,
+                      URING_ACCEPT_DEBUG) != 0)
+        return ((void*)3);
+
+    mblog_start (&server->log);
+
+    for (;;) {
+        if (mburing_submit (&server->uring, !server->update_pending) != 0 &&
+            errno != EINTR &&
+            errno != EAGAIN && errno != EBUSY) {
+            perror ("io_uring_enter");
+            rc = (void*)3;
+        }
+        if (server->shutdown) {
+            close(server->client_listen_fd);
+            unlink(&(server->sock.sun_path[0]));
+            if (server->seq_listen_fd != -1) {
+                close(server->seq_listen_fd);
+                unlink(&(server->seq_sock.sun_path[0]));
+            }
+            mburing_exit (&server->uring);
+            close(server->timer_fd);
+            mblog_stop (&server->log);
+#if LOGFILE
+            fclose(server->fp);
+#endif
+            break;
+        }
+        while (!rc && mburing_next (&server->uring, &cqe))
+            if (uring_complete (server, &cqe) != 0)
+                rc = (void*)3;
+        if (rc) {
+            mblog_stop (&server->log);
+            break;
+        }
 
-    if (server->debug_listen_fd == -1) {
-        perror ("socket");
-        close (fd);
-        free (server);
-        return NULL;
+        /* One scheduler pass for everything that came in */
+        if (server->update_pending) {
+            server->update_pending = 0;
+            update_server (server);
+        }
+        flush_clients (server);
+        reap_clients (server);
     }
+    return rc;
+}
+#endif
 
-    memset (&server->debug_sock, 0, sizeof (server->debug_sock));
-    server->debug_sock.sun_family = AF_UNIX;
-    snprintf (server->debug_sock.sun_path,
-              sizeof (server->debug_sock.sun_path),
-              "%s/membroker.debug",
-              getenv ("LXK_RUNTIME_DIR") ? getenv ("LXK_RUNTIME_DIR") : ".");
-    if (0 == strcmp (server->debug_sock.sun_path, server->sock.sun_path)) {
-        /* This means we can't create the second socket.  Limp along with
-         * no debug. */
-        printf ("mbserver: Path truncation caused debug socket and main socket"
-                " to have same address.  Dropping the debug socket.\n");
-        close (server->debug_listen_fd);
-        server->debug_listen_fd = -1;
-        return server;
-    }
+#define MAX_EVENTS 64
 
-    unlink (server->debug_sock.sun_path);
-    if (0 > bind (server->debug_listen_fd,
-                  (struct sockaddr *) &server->debug_sock,
-                  sizeof (server->debug_sock))) {
-        perror ("mbserver: bind debug socket");
-        close (server->debug_listen_fd);
-        server->debug_listen_fd = -1;
-        return server;
+/* Connections other shards have moved here, in the order they came */
+static void
+take_handoffs (Server * server)
+{
+    struct handoff * list = __atomic_exchange_n (&server->handoffs, NULL,
+                                                 __ATOMIC_ACQUIRE);
+    struct handoff * ordered = NULL;
+
+    while (list) {
+        struct handoff * next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
     }
 
-    if (0 > listen (server->debug_listen_fd, 10)) {
-        perror ("mbserver: listen on debug socket");
-        close (server->debug_listen_fd);
-        server->debug_listen_fd = -1;
-        return server;
+    while (ordered) {
+        struct handoff * handoff = ordered;
+        Client * client = create_client (server, handoff->fd,
+                                         handoff->seqpacket);
+
+        ordered = handoff->next;
+        if (client) {
+            memcpy (client->in, handoff->data, handoff->len);
+            client->in_len = handoff->len;
+            if (handle_input (server, client) != 0)
+                close_client (server, client);
+        }
+        /* Counted as made by the shard that sent it, freed by this one */
+        server_free (server, handoff);
     }
-
-    return server;
 }
 
-void
-mbs_set_pages(Server* server, int pages)
+static void
+woken (Server * server)
 {
-    server->source_pages = server->pages = pages;
+    uint64_t count;
 
-    if (server->fp)
-        fprintf (server->fp, "Set membroker server pages to %d\n",
-                 pages);
+    if (read (server->wake_fd, &count, sizeof (count)) < 0 && errno != EAGAIN)
+        perror ("mbserver: read wake fd");
+    take_handoffs (server);
+    take_debug_dumps (server);
+
+    /* Pages may have turned up in another shard */
+    server->update_pending = 1;
 }
 
-void*
-mbs_main(void* param)
+static void *
+epoll_main (Server * server)
 {
-    struct sockaddr_un remote;
-    socklen_t size = sizeof(remote);
-    fd_set master;
-    fd_set fds;
-    int max_fd;
-    Server * server = (Server*)param;
-
-    FD_ZERO( &master );
-    FD_ZERO( &fds );
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event event;
+    void * rc = 0;
+    int n;
+
+    server->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+    if (server->epoll_fd == -1) {
+        perror ("epoll_create1");
+        return ((void*)3);
+    }
 
-    FD_SET(server->client_listen_fd, &master);
-    if (server->debug_listen_fd != -1) {
-        FD_SET(server->debug_listen_fd, &master);
+    if (server->client_listen_fd != -1 &&
+        watch_listen_fd (server, &server->client_listen_fd) != 0)
+        return ((void*)3);
+    if (server->seq_listen_fd != -1 &&
+        watch_listen_fd (server, &server->seq_listen_fd) != 0)
+        return ((void*)3);
+    if (server->debug_listen_fd != -1 &&
+        watch_listen_fd (server, &server->debug_listen_fd) != 0)
+        return ((void*)3);
+    if (start_timer (server) != 0)
+        return ((void*)3);
+    event.events = EPOLLIN;
+    event.data.ptr = &server->timer_fd;
+    if (epoll_ctl (server->epoll_fd, EPOLL_CTL_ADD, server->timer_fd,
+                   &event) == -1) {
+        perror ("epoll_ctl");
+        return ((void*)3);
+    }
+    if (server->shards) {
+        event.events = EPOLLIN;
+        event.data.ptr = &server->wake_fd;
+        if (epoll_ctl (server->epoll_fd, EPOLL_CTL_ADD, server->wake_fd,
+                       &event) == -1) {
+            perror ("epoll_ctl");
+            return ((void*)3);
+        }
     }
 
-    max_fd = max (server->client_listen_fd, server->debug_listen_fd);
-    fds = master;
-    while (-1 != select (max_fd +1, &fds, NULL, NULL, NULL)){
-        int i;
-        if (server->shutdown) {
-            close(server->client_listen_fd);
-            unlink(&(server->sock.sun_path[0]));
+    mblog_start (&server->log);
+
+    while (-1 != (n = epoll_wait (server->epoll_fd, events, MAX_EVENTS,
+                                  server->ready || server->update_pending ?
+                                  0 : -1))
+           || errno == EINTR){
+        int i, m;
+        if (__atomic_load_n (&server->shutdown, __ATOMIC_ACQUIRE)) {
+            if (server->client_listen_fd != -1) {
+                close(server->client_listen_fd);
+                unlink(&(server->sock.sun_path[0]));
+            }
+            if (server->seq_listen_fd != -1) {
+                close(server->seq_listen_fd);
+                unlink(&(server->seq_sock.sun_path[0]));
+            }
+            close(server->epoll_fd);
+            close(server->timer_fd);
+            mblog_stop (&server->log);
 #if LOGFILE
-            fclose(server->fp);
+            /* Shards share it; mbs_main() closes it once they have stopped */
+            if (!server->shards)
+                fclose(server->fp);
 #endif
             break;
         }
-        for ( i = 0; i <= max_fd; i++){
-            if (FD_ISSET( i, &fds )){
-                if (i == server->client_listen_fd){
-                    int new_fd;
-                    size = sizeof (remote); 
-                    new_fd = accept (i, (struct sockaddr *)&remote, &size);
+        for (i = 0, m = 0; i < n; i++){
+            void * ptr = events[i].data.ptr;
+
+            if (ptr == &server->client_listen_fd ||
+                ptr == &server->seq_listen_fd){
+                if (accept_clients (server, *(int *) ptr) != 0)
+                    rc = (void*)3;
+            } else if (ptr == &server->debug_listen_fd){
+                if (accept_debug (server) != 0)
+                    rc = (void*)3;
+            } else if (ptr == &server->wake_fd){
+                woken (server);
+            } else if (ptr == &server->timer_fd){
+                timer_fired (server);
+            } else {
+                events[m++] = events[i];
+            }
+        }
+        if (rc) {
+            mblog_stop (&server->log);
+            break;
+        }
+        service_round (server, events, n < 0 ? 0 : m);
 
-                    if (new_fd == -1) {
-                        perror ("accept");
-                        return((void*)3);
-                    }
+        /* One scheduler pass for everything that came in */
+        if (server->update_pending) {
+            server->update_pending = 0;
+            update_server (server);
+        }
+        if (server->shards)
+            publish_pages (server);
+        flush_clients (server);
+        reap_clients (server);
+    }
+    return rc;
+}
+
+static void *
+shard_main (void * param)
+{
+    return epoll_main ((Server *) param);
+}
 
-                    max_fd = max(max_fd, new_fd);
-                    FD_SET( new_fd, &master);
+static Server *
+create_shard (Server * server, unsigned int index)
+{
+    Server * shard = calloc (1, sizeof (*shard));
 
-                } else if (i == server->debug_listen_fd){
-                    int new_fd;
-                    FILE * fp;
-                    size = sizeof (remote);
+    if (!shard) {
+        perror ("mbserver: create_shard");
+        return NULL;
+    }
 
-                    new_fd = accept (i, (struct sockaddr *)&remote, &size);
-                    if (new_fd == -1) {
-                        perror ("accept");
-                        return((void*)3);
-                    }
+    shard->fp = server->fp;
+    if (mbname_init (&shard->names) != 0 ||
+        mblog_init (&shard->log, shard->fp, &shard->names) != 0) {
+        free (shard);
+        return NULL;
+    }
+    shard->log.level = __atomic_load_n (&server->log.level, __ATOMIC_RELAXED);
+    shard->log.rate = __atomic_load_n (&server->log.rate, __ATOMIC_RELAXED);
+    shard->client_listen_fd = -1;
+    shard->debug_listen_fd = -1;
+    shard->seq_listen_fd = -1;
+    shard->timer_fd = -1;
+    shard->request_timeout = server->request_timeout;
+    shard->escalate = server->escalate;
+    shard->share_timeout = server->share_timeout;
+    shard->fan_out = server->fan_out;
+    shard->batch_window = server->batch_window;
+    shard->lookahead = server->lookahead;
+    shard->repay_keep = server->repay_keep;
+    shard->repay_delay = server->repay_delay;
+    shard->repay_rate = server->repay_rate;
+    shard->repay_tokens = server->repay_tokens;
+    shard->repay_damping = server->repay_damping;
+    shard->batch_us = server->batch_us;
+    shard->adaptive_downgrade = server->adaptive_downgrade;
+    shard->shard_index = index;
+    return shard;
+}
 
-                    fp = fdopen (new_fd, "w");
-                    if (! fp) {
-                        close (new_fd);
-                        return ((void *)3);
-                    }
+/*
+ * Sets up the shards and starts every one but the first, which is the
+ * server itself and runs on the caller's thread.
+ */
+static int
+start_shards (Server * server)
+{
+    struct shards * shards;
+    unsigned int i;
 
-                    dump_status (server, fp);
-                    fclose (fp);
+    shards = calloc (1, sizeof (*shards) + server->n_shards * sizeof (Server *));
+    if (!shards) {
+        perror ("mbserver: start_shards");
+        return -1;
+    }
+    shards->n = server->n_shards;
+    shards->shard[0] = server;
+    for (i = 1; i < shards->n; i++) {
+        shards->shard[i] = create_shard (server, i);
+        if (!shards->shard[i])
+            return -1;
+    }
 
-                } else {
-                    if (-1 == process_connection (server, i)){
-                        Client * client = get_client_by_fd (server, i);
-                        if (client) {
-                            fprintf (server->fp, "non terminus close - (%d)-\"%s\"\n", client->id, client->cmdline);
-                            free_client (server, client);
-                            update_server(server);
-                        }
-                        FD_CLR (i, &master);
-                        close (i);
-                    }
-                    
-                }
-            }
+    for (i = 0; i < shards->n; i++) {
+        Server * shard = shards->shard[i];
+
+        shard->shards = shards;
+        shard->wake_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (shard->wake_fd == -1) {
+            perror ("eventfd");
+            return -1;
+        }
+    }
 
+    for (i = 1; i < shards->n; i++) {
+        if (pthread_create (&shards->shard[i]->thread, NULL, &shard_main,
+                            shards->shard[i]) != 0) {
+            perror ("mbserver: pthread_create");
+            return -1;
         }
-        fds = master;
     }
+
+    /* Up for grabs from the start */
+    server->spare = server->pages;
+    server->pages = 0;
+
+    fprintf (server->fp, "mbserver: running %u shards\n", shards->n);
     return 0;
 }
 
+/* Lets go of everything a shard that has stopped still holds */
+static void
+destroy_shard (Server * shard)
+{
+    struct handoff * handoff;
+    struct debug_dump * dump;
+    struct client_slab * clients;
+    struct request_slab * requests;
+    int i;
+
+    while ((handoff = shard->handoffs)) {
+        shard->handoffs = handoff->next;
+        close (handoff->fd);
+        server_free (shard, handoff);
+    }
+    while ((dump = shard->dumps)) {
+        shard->dumps = dump->next;
+        fclose (dump->fp);
+        free (dump->buf);
+        drop_debug_dump (dump);
+    }
+
+    while ((clients = shard->client_slabs)) {
+        for (i = 0; i < SLAB_OBJECTS; i++) {
+            Client * client = &clients->clients[i];
+
+            if (client->fd != -1 && !client->closing)
+                close (client->fd);
+        }
+        shard->client_slabs = clients->next;
+        server_free (shard, clients);
+    }
+    while ((requests = shard->request_slabs)) {
+        shard->request_slabs = requests->next;
+        server_free (shard, requests->bitmaps);
+        server_free (shard, requests);
+    }
+
+    server_free (shard, shard->id_table);
+    server_free (shard, shard->slots);
+    server_free (shard, shard->dirty);
+    server_free (shard, shard->used_mask);
+    server_free (shard, shard->bidi_mask);
+    server_free (shard, shard->source_mask);
+    server_free (shard, shard->requesting_mask);
+    server_free (shard, shard->requesting_low_mask);
+    server_free (shard, shard->sharing_mask);
+    server_free (shard, shard->sharing_low_mask);
+    server_free (shard, shard->pending_mask);
+    server_free (shard, shard->cooldown_mask);
+    server_free (shard, shard->estimating_mask);
+    server_free (shard, shard->polled_mask);
+    server_free (shard, shard->polling_mask);
+    server_free (shard, shard->candidate_scratch);
+
+    mblog_destroy (&shard->log);
+    mbname_destroy (&shard->names);
+    close (shard->wake_fd);
+    free (shard);
+}
+
+static void
+stop_shards (Server * server)
+{
+    struct shards * shards = server->shards;
+    unsigned int i;
+
+    for (i = 1; i < shards->n; i++) {
+        Server * shard = shards->shard[i];
+
+        __atomic_store_n (&shard->shutdown, 1, __ATOMIC_RELEASE);
+        poke_shard (shard);
+        pthread_join (shard->thread, NULL);
+        destroy_shard (shard);
+    }
+    close (server->wake_fd);
+    server->shards = NULL;
+    free (shards);
+}
+
+void*
+mbs_main(void* param)
+{
+    Server * server = (Server*)param;
+    void * rc;
+
+    if (server->n_shards > 1) {
+        if (start_shards (server) != 0)
+            return ((void*)3);
+#if HAVE_IO_URING
+        if (server->want_uring)
+            fprintf (server->fp, "mbserver: io_uring is not used with shards\n");
+#endif
+        rc = epoll_main (server);
+        stop_shards (server);
+#if LOGFILE
+        fclose (server->fp);
+#endif
+        return rc;
+    }
+
+#if HAVE_IO_URING
+    if (server->want_uring) {
+        if (mburing_init (&server->uring, URING_ENTRIES,
+                          URING_CQ_ENTRIES) == 0) {
+            fprintf (server->fp, "mbserver: using io_uring\n");
+            return uring_main (server);
+        }
+        fprintf (server->fp, "mbserver: io_uring unavailable (%s), using epoll\n",
+                 strerror (errno));
+    }
+#endif
+
+    return epoll_main (server);
+}
+
 void
 mbs_shutdown(Server* server)
 {
@@ -24,6 +24,8 @@
  */
 #ifndef MBSERVER_H
 #define MBSERVER_H
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -33,7 +35,67 @@ struct server;
 
 struct server* mbs_init();
 struct server * mbs_init_with_fd (int fd);
-void mbs_set_pages(struct server* server, int pages);
+/* In EXEC_PAGESIZE pages, whatever granule the clients count in */
+void mbs_set_pages(struct server* server, int64_t pages);
+int mbs_reserve_clients(struct server* server, unsigned int clients);
+int mbs_lock_memory(struct server* server);
+unsigned long mbs_get_alloc_count(struct server* server);
+
+/* 0: errors only, 1: scheduling decisions, 2: every message (the default) */
+void mbs_set_log_level(struct server* server, int level);
+/* Cap on per-message log lines, 0 for no cap */
+void mbs_set_log_rate(struct server* server, unsigned int lines_per_sec);
+/* Runs the event loop on io_uring instead of epoll, if the kernel allows.
+ * Returns -1 if the server was built without it.  Call before mbs_main(). */
+int mbs_use_io_uring(struct server* server, int enable);
+/* Gives queued requests this long to be served before they go with what they
+ * have; 0 (the default) for no limit.  With escalate, a REQUEST that runs
+ * out of time is retried as a RESERVE for as long again.  A client's own
+ * DEADLINE takes precedence.  Call before mbs_main(). */
+void mbs_set_request_timeout(struct server* server, int ms, int escalate);
+/* Gives a bidi client this long to answer a share query, after which it is
+ * taken to have denied it; 0 (the default) for no limit.  Clients that
+ * keep this up are left out of share queries for a while.  Call before
+ * mbs_main(). */
+void mbs_set_share_timeout(struct server* server, int ms);
+/* Has a RESERVE that the pool cannot cover ask every client it takes at
+ * once, each for about what it is known to have, instead of one after
+ * another.  Off by default.  Call before mbs_main(). */
+void mbs_set_fan_out(struct server* server, int enable);
+/* Lets a RESERVE skip the REQUEST it first sends a source when the source is
+ * expected to come up short at REQUEST, by what it last said it could share
+ * or by how it has answered before.  Off by default.  Call before
+ * mbs_main(). */
+void mbs_set_adaptive_downgrade(struct server* server, int enable);
+/* Holds a share query back for up to this many microseconds, so that
+ * requests that come in meanwhile can ask the same client in the same
+ * query, but never past half the time left to a request it is for.  The
+ * window narrows when nothing joins and widens again when things do.  0
+ * (the default) sends queries at once.  Call before mbs_main(). */
+void mbs_set_batch_window(struct server* server, int us);
+/* Has a share query at REQUEST ask for more than the requests it is for
+ * need, by the size of recent requests times how many are queued, up to
+ * what the client is known to have.  The rest goes to the pool for the
+ * requests that follow.  Never done at RESERVE.  Off by default.  Call
+ * before mbs_main(). */
+void mbs_set_lookahead(struct server* server, int enable);
+/* Holds back repaying sources the pages the pool has of theirs: keeps at
+ * least keep pages in the pool, waits until delay_ms have gone by since the
+ * last request, and repays at most pages_per_sec a second.  0 for any of
+ * them does not hold back on that account, and all three are 0 by default.
+ * Call before mbs_main(). */
+void mbs_set_repayment(struct server* server, int64_t keep, int delay_ms,
+                       int pages_per_sec);
+/* Puts off repaying a source that is asked for pages again soon after it is
+ * repaid, longer each time that happens in a row.  Off by default.  Call
+ * before mbs_main(). */
+void mbs_set_repay_damping(struct server* server, int enable);
+/* Splits the broker into this many shards, each on a thread of its own and
+ * serving the clients whose ids hash to it.  The shards take each other's
+ * spare pages, but share queries never cross them, so a RESERVE may come
+ * back short where one shard would have covered it (membroker.txt
+ * 3.3.10).  Call before mbs_main(). */
+int mbs_set_shards(struct server* server, unsigned int shards);
 void* mbs_main(void* param);
 void mbs_shutdown(struct server* server);
 
@@ -0,0 +1,189 @@
+/* membroker - A service to cooperatively manage memory usage system-wide
+ *
+ * Copyright © 2013 Lexmark International
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * (the "LGPL").
+ *
+ * You should have received a copy of the LGPL along with this library
+ * in the file COPYING; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY
+ * OF ANY KIND, either express or implied.
+ *
+ * The Original Code is the membroker service, and client library.
+ *
+ * The Initial Developer of the Original Code is Lexmark International, Inc.
+ * Author: Ian Watkins
+ *
+ * Commercial licensing is available. See the file COPYING for contact
+ * information.
+ */
+#include "mbtimer.h"
+#include <string.h>
+
+#define SLOT_MASK (MBTIMER_SLOTS - 1)
+#define LEVEL_SHIFT(level) ((level) * MBTIMER_BITS)
+
+static void
+file_timer (struct mbtimer_wheel * wheel, struct mbtimer * timer)
+{
+    uint64_t expires = timer->expires;
+    uint64_t delta;
+    struct mbtimer ** slot;
+    int level;
+
+    if (expires < wheel->now)
+        expires = wheel->now;
+    delta = expires - wheel->now;
+    if (delta >= MBTIMER_SPAN) {
+        delta = MBTIMER_SPAN - 1;
+        expires = wheel->now + delta;
+    }
+
+    for (level = 0; level < MBTIMER_LEVELS - 1; level++)
+        if (delta < ((uint64_t) 1 << LEVEL_SHIFT(level + 1)))
+            break;
+
+    slot = &wheel->slots[level][(expires >> LEVEL_SHIFT(level)) & SLOT_MASK];
+    timer->next = *slot;
+    if (*slot)
+        (*slot)->pprev = &timer->next;
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+static struct mbtimer *
+take_slot (struct mbtimer ** slot)
+{
+    struct mbtimer * list = *slot;
+
+    *slot = NULL;
+    return list;
+}
+
+/* Moves the timers in a slot down to where they now belong */
+static void
+cascade (struct mbtimer_wheel * wheel, int level)
+{
+    unsigned int index = (wheel->now >> LEVEL_SHIFT(level)) & SLOT_MASK;
+    struct mbtimer * timer = take_slot (&wheel->slots[level][index]);
+
+    while (timer) {
+        struct mbtimer * next = timer->next;
+
+        file_timer (wheel, timer);
+        timer = next;
+    }
+}
+
+void
+mbtimer_init (struct mbtimer_wheel * wheel, uint64_t now)
+{
+    memset (wheel, 0, sizeof (*wheel));
+    wheel->now = now;
+}
+
+void
+mbtimer_arm (struct mbtimer_wheel * wheel, struct mbtimer * timer,
+             uint64_t expires)
+{
+    mbtimer_cancel (wheel, timer);
+
+    /* The slot for the current tick has been dealt with already */
+    if (expires <= wheel->now)
+        expires = wheel->now + 1;
+    timer->expires = expires;
+    file_timer (wheel, timer);
+    wheel->armed++;
+}
+
+void
+mbtimer_cancel (struct mbtimer_wheel * wheel, struct mbtimer * timer)
+{
+    if (!timer->pprev)
+        return;
+
+    *timer->pprev = timer->next;
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+    wheel->armed--;
+}
+
+/*
+ * Moves the wheel on to now.  Returns the timers that came due, disarmed
+ * and linked through "next", soonest first.
+ */
+struct mbtimer *
+mbtimer_advance (struct mbtimer_wheel * wheel, uint64_t now)
+{
+    struct mbtimer * expired = NULL;
+    struct mbtimer ** tail = &expired;
+
+    while (wheel->now < now) {
+        struct mbtimer * timer;
+        int level;
+
+        /* Nothing to fire on the way; skip straight there */
+        if (!wheel->armed) {
+            wheel->now = now;
+            break;
+        }
+
+        wheel->now++;
+        for (level = 1; level < MBTIMER_LEVELS; level++) {
+            if (wheel->now & (((uint64_t) 1 << LEVEL_SHIFT(level)) - 1))
+                break;
+            cascade (wheel, level);
+        }
+
+        timer = take_slot (&wheel->slots[0][wheel->now & SLOT_MASK]);
+        while (timer) {
+            struct mbtimer * next = timer->next;
+
+            timer->pprev = NULL;
+            timer->next = NULL;
+            *tail = timer;
+            tail = &timer->next;
+            wheel->armed--;
+            timer = next;
+        }
+    }
+    return expired;
+}
+
+/*
+ * The first tick at which advancing the wheel could do anything: a timer
+ * coming due, or a slot further out moving down a level.  MBTIMER_NEVER
+ * when nothing is armed.
+ */
+uint64_t
+mbtimer_next (const struct mbtimer_wheel * wheel)
+{
+    uint64_t next = MBTIMER_NEVER;
+    int level;
+
+    if (!wheel->armed)
+        return next;
+
+    for (level = 0; level < MBTIMER_LEVELS; level++) {
+        uint64_t base = wheel->now >> LEVEL_SHIFT(level);
+        unsigned int k;
+
+        for (k = 1; k <= MBTIMER_SLOTS; k++) {
+            if (wheel->slots[level][(base + k) & SLOT_MASK]) {
+                uint64_t tick = (base + k) << LEVEL_SHIFT(level);
+
+                if (tick < next)
+                    next = tick;
+                break;
+            }
+        }
+    }
+    return next;
+}
@@ -0,0 +1,73 @@
+/* membroker - A service to cooperatively manage memory usage system-wide
+ *
+ * Copyright © 2013 Lexmark International
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * (the "LGPL").
+ *
+ * You should have received a copy of the LGPL along with this library
+ * in the file COPYING; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY
+ * OF ANY KIND, either express or implied.
+ *
+ * The Original Code is the membroker service, and client library.
+ *
+ * The Initial Developer of the Original Code is Lexmark International, Inc.
+ * Author: Ian Watkins
+ *
+ * Commercial licensing is available. See the file COPYING for contact
+ * information.
+ */
+#ifndef MB_TIMER_H
+#define MB_TIMER_H
+
+#include <stdint.h>
+
+/*
+ * A hierarchical timer wheel.  Each level has MBTIMER_SLOTS slots, and a
+ * slot on one level spans a whole turn of the level below; timers move
+ * down a level as their time draws near.  Arming and cancelling are O(1)
+ * and the wheel never allocates, so timers can live inside the objects
+ * they belong to.  Time is counted in ticks of the caller's choosing.
+ */
+
+#define MBTIMER_BITS 6
+#define MBTIMER_SLOTS (1 << MBTIMER_BITS)
+#define MBTIMER_LEVELS 4
+
+/* Timers further out than this wait in the last slot and are re-filed */
+#define MBTIMER_SPAN ((uint64_t) 1 << (MBTIMER_BITS * MBTIMER_LEVELS))
+
+#define MBTIMER_NEVER UINT64_MAX
+
+struct mbtimer {
+    uint64_t expires;           /* tick */
+    int kind;                   /* the caller's, to tell its timers apart */
+    struct mbtimer * next;
+    struct mbtimer ** pprev;    /* NULL when not armed */
+};
+
+struct mbtimer_wheel {
+    uint64_t now;               /* last tick advanced to */
+    unsigned int armed;
+    struct mbtimer * slots[MBTIMER_LEVELS][MBTIMER_SLOTS];
+};
+
+void mbtimer_init (struct mbtimer_wheel * wheel, uint64_t now);
+void mbtimer_arm (struct mbtimer_wheel * wheel, struct mbtimer * timer,
+                  uint64_t expires);
+void mbtimer_cancel (struct mbtimer_wheel * wheel, struct mbtimer * timer);
+struct mbtimer * mbtimer_advance (struct mbtimer_wheel * wheel, uint64_t now);
+uint64_t mbtimer_next (const struct mbtimer_wheel * wheel);
+
+static inline int
+mbtimer_armed (const struct mbtimer * timer)
+{
+    return timer->pprev != 0;
+}
+
+#endif
@@ -0,0 +1,174 @@
+/* membroker - A service to cooperatively manage memory usage system-wide
+ *
+ * Copyright © 2013 Lexmark International
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * (the "LGPL").
+ *
+ * You should have received a copy of the LGPL along with this library
+ * in the file COPYING; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY
+ * OF ANY KIND, either express or implied.
+ *
+ * The Original Code is the membroker service, and client library.
+ *
+ * The Initial Developer of the Original Code is Lexmark International, Inc.
+ * Author: Ian Watkins
+ *
+ * Commercial licensing is available. See the file COPYING for contact
+ * information.
+ */
+#include "mburing.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int
+io_uring_setup (unsigned int entries, struct io_uring_params * p)
+{
+    return syscall (__NR_io_uring_setup, entries, p);
+}
+
+static int
+io_uring_enter (int fd, unsigned int to_submit, unsigned int min_complete,
+                unsigned int flags)
+{
+    return syscall (__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                    NULL, 0);
+}
+
+/*
+ * Completions are only posted while the broker thread is inside
+ * io_uring_enter() (IORING_SETUP_DEFER_TASKRUN), so anything it reads
+ * from a socket directly is never older than what is already in the
+ * completion queue.  Kernels without that (before 6.1) are refused.
+ */
+int
+mburing_init (struct mburing * ring, unsigned int entries,
+              unsigned int cq_entries)
+{
+    struct io_uring_params p;
+    unsigned int * array;
+    size_t sq_size, cq_size;
+    unsigned int i;
+
+    memset (ring, 0, sizeof (*ring));
+    memset (&p, 0, sizeof (p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER |
+              IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = cq_entries;
+
+    ring->fd = io_uring_setup (entries, &p);
+    if (ring->fd < 0)
+        return -1;
+
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_NODROP)) {
+        close (ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->rings = mmap (NULL, ring->rings_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->rings == MAP_FAILED) {
+        close (ring->fd);
+        return -1;
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+    ring->sqes = mmap (NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap (ring->rings, ring->rings_size);
+        close (ring->fd);
+        return -1;
+    }
+
+    ring->sq_entries = p.sq_entries;
+    ring->sq_head = (unsigned int *) ((char *) ring->rings + p.sq_off.head);
+    ring->sq_tail = (unsigned int *) ((char *) ring->rings + p.sq_off.tail);
+    ring->sq_mask = (unsigned int *) ((char *) ring->rings + p.sq_off.ring_mask);
+    ring->cq_head = (unsigned int *) ((char *) ring->rings + p.cq_off.head);
+    ring->cq_tail = (unsigned int *) ((char *) ring->rings + p.cq_off.tail);
+    ring->cq_mask = (unsigned int *) ((char *) ring->rings + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->rings + p.cq_off.cqes);
+
+    /* Submission slots are always used in order */
+    array = (unsigned int *) ((char *) ring->rings + p.sq_off.array);
+    for (i = 0; i < p.sq_entries; i++)
+        array[i] = i;
+
+    return 0;
+}
+
+void
+mburing_exit (struct mburing * ring)
+{
+    munmap (ring->sqes, ring->sqes_size);
+    munmap (ring->rings, ring->rings_size);
+    close (ring->fd);
+}
+
+/*
+ * Returns a cleared submission entry, submitting what is queued if the
+ * queue is full.  Returns NULL with errno set if there is still no room,
+ * e.g. EBUSY while the completions have to be reaped first; the caller
+ * tries again after it has.
+ */
+struct io_uring_sqe *
+mburing_get_sqe (struct mburing * ring)
+{
+    struct io_uring_sqe * sqe;
+
+    while (ring->sqe_tail - __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE)
+           >= ring->sq_entries) {
+        if (mburing_submit (ring, 0) < 0 && errno != EINTR)
+            return NULL;
+        if (ring->sqe_tail - __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE)
+            >= ring->sq_entries) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+
+    sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+    ring->sqe_tail++;
+    memset (sqe, 0, sizeof (*sqe));
+    return sqe;
+}
+
+/*
+ * Submits everything queued, and if wait is set, sleeps until at least
+ * one completion is ready.  Returns -1 with errno set on failure.
+ */
+int
+mburing_submit (struct mburing * ring, unsigned int wait)
+{
+    unsigned int to_submit = ring->sqe_tail - ring->sqe_submitted;
+    int ret;
+
+    __atomic_store_n (ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    if (!to_submit && !wait)
+        return 0;
+
+    ret = io_uring_enter (ring->fd, to_submit, wait ? 1 : 0,
+                          wait ? IORING_ENTER_GETEVENTS : 0);
+    if (ret < 0)
+        return -1;
+
+    ring->sqe_submitted += ret;
+    return 0;
+}
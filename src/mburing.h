@@ -0,0 +1,86 @@
+/* membroker - A service to cooperatively manage memory usage system-wide
+ *
+ * Copyright © 2013 Lexmark International
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * (the "LGPL").
+ *
+ * You should have received a copy of the LGPL along with this library
+ * in the file COPYING; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY
+ * OF ANY KIND, either express or implied.
+ *
+ * The Original Code is the membroker service, and client library.
+ *
+ * The Initial Developer of the Original Code is Lexmark International, Inc.
+ * Author: Ian Watkins
+ *
+ * Commercial licensing is available. See the file COPYING for contact
+ * information.
+ */
+#ifndef MB_URING_H
+#define MB_URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+/*
+ * Just enough of an io_uring to drive the broker, on raw syscalls.  Only
+ * the thread that set the ring up may use it.
+ */
+
+struct mburing {
+    int fd;
+    unsigned int sq_entries;
+    unsigned int sqe_tail;      /* entries handed out */
+    unsigned int sqe_submitted; /* entries the kernel has been told about */
+    unsigned int * sq_head;
+    unsigned int * sq_tail;
+    unsigned int * sq_mask;
+    struct io_uring_sqe * sqes;
+    unsigned int * cq_head;
+    unsigned int * cq_tail;
+    unsigned int * cq_mask;
+    struct io_uring_cqe * cqes;
+    void * rings;
+    size_t rings_size;
+    size_t sqes_size;
+};
+
+int mburing_init (struct mburing * ring, unsigned int entries,
+                  unsigned int cq_entries);
+void mburing_exit (struct mburing * ring);
+struct io_uring_sqe * mburing_get_sqe (struct mburing * ring);
+int mburing_submit (struct mburing * ring, unsigned int wait);
+
+/* Completions that have been posted but not consumed */
+static inline unsigned int
+mburing_ready (struct mburing * ring)
+{
+    return __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE) - *ring->cq_head;
+}
+
+/* The i'th unconsumed completion; i < mburing_ready() */
+static inline struct io_uring_cqe *
+mburing_cqe (struct mburing * ring, unsigned int i)
+{
+    return &ring->cqes[(*ring->cq_head + i) & *ring->cq_mask];
+}
+
+/* Copies out the oldest completion and hands its slot back.  Returns 0 if
+ * there is none. */
+static inline int
+mburing_next (struct mburing * ring, struct io_uring_cqe * cqe)
+{
+    if (!mburing_ready (ring))
+        return 0;
+    *cqe = *mburing_cqe (ring, 0);
+    __atomic_store_n (ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+#endif
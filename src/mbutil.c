@@ -1,4 +1,5 @@
 #include "mbclient.h"
+#include <limits.h>
 #include <math.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -11,7 +12,7 @@
 static const char * progname;
 
 static inline double
-pages_to_megabytes (int pages)
+pages_to_megabytes (int64_t pages)
 {
 	return (((long long) pages) * EXEC_PAGESIZE) / (1024.0 * 1024.0);
 }
@@ -75,17 +76,20 @@ error (const char * format,
 static void
 do_query (void)
 {
-	int total;
-	int server;
-	int client;
-
-	total = mb_query_total ();
+	MbSnapshot snapshot;
+	int64_t total;
+	int64_t server;
+	int64_t client;
+
+	/* A v2 server said as much when we registered */
+	mb_snapshot (&snapshot);
+	total = snapshot.total >= 0 ? snapshot.total : mb_query_total ();
 	if (total < 0) {
 		error ("mb_query_total() said %s\n",
 		       mb_error_to_string (total));;
 	}
 
-	server = mb_query_server ();
+	server = snapshot.free >= 0 ? snapshot.free : mb_query_server ();
 	if (server < 0) {
 		error ("mb_query_server() said %s\n",
 		       mb_error_to_string (server));
@@ -97,61 +101,85 @@ do_query (void)
 		       mb_error_to_string (client));
 	}
 
-	printf ("total   %9d p (%.1f M)\n",
-		total, pages_to_megabytes (total));
-	printf ("server  %9d p (%.1f M)\n",
-		server, pages_to_megabytes (server));
-	printf ("client  %9d p (%.1f M)\n",
-		client, pages_to_megabytes (client));
+	printf ("total   %9lld p (%.1f M)\n",
+		(long long) total, pages_to_megabytes (total));
+	printf ("server  %9lld p (%.1f M)\n",
+		(long long) server, pages_to_megabytes (server));
+	printf ("client  %9lld p (%.1f M)\n",
+		(long long) client, pages_to_megabytes (client));
+}
+
+/*
+ * The page calls count in ints, so an amount too big for one goes in
+ * granules of as many pages as it takes instead.
+ */
+static int64_t
+granule_pages_for (int64_t n_pages)
+{
+	int64_t granule_pages = 1;
+
+	while ((n_pages + granule_pages - 1) / granule_pages > INT_MAX)
+		granule_pages *= 2;
+
+	return granule_pages;
 }
 
 static void
-do_reserve (int n_pages)
+do_reserve (int64_t n_pages, int64_t granule_pages)
 {
-	int ret = mb_reserve_pages (n_pages);
+	int n = (n_pages + granule_pages - 1) / granule_pages;
+	int ret = mb_reserve_pages (n);
 	if (ret < 0) {
 		error ("mb_reserve_pages() said %s\n",
 		       mb_error_to_string (ret));
 	}
 
-	printf ("Got %d of %d pages\n", ret, n_pages);
+	printf ("Got %lld of %lld pages\n", (long long) ret * granule_pages,
+		(long long) n * granule_pages);
 	if (ret == 0) {
-		error ("reserve of %d pages failed\n", n_pages);
+		error ("reserve of %lld pages failed\n", (long long) n_pages);
 	}
 }
 
 static void
-do_request (int n_pages)
+do_request (int64_t n_pages, int64_t granule_pages)
 {
-	int ret = mb_request_pages (n_pages);
+	int n = (n_pages + granule_pages - 1) / granule_pages;
+	int ret = mb_request_pages (n);
 	if (ret < 0) {
 		error ("mb_request_pages() said %s\n",
 		       mb_error_to_string (ret));
 	}
 
-	printf ("Got %d of %d pages\n", ret, n_pages);
+	printf ("Got %lld of %lld pages\n", (long long) ret * granule_pages,
+		(long long) n * granule_pages);
 	if (ret == 0) {
 		error ("request failed\n");
 	}
 }
 
-static int
+static int64_t
 check_pages (double d)
 {
-	int pages = (int) d;
+	int64_t pages;
+
+	if (d >= 0x1p63 || d < -0x1p63)
+		error ("%g pages is out of range\n", d);
 
+	pages = (int64_t) d;
 	if (d != (double) pages)
 		error ("Can't use fractional number of pages\n");
 
 	return pages;
 }
 
-static int
+static int64_t
 percentage_of_total_pages (double d,
                            const char * arg)
 {
-        int n_pages;
-        int total_pages;
+        MbSnapshot snapshot;
+        int64_t n_pages;
+        int64_t total_pages;
 
         /* Sanity check */
         if (d < 0.0 || d > 100.0) {
@@ -164,26 +192,28 @@ percentage_of_total_pages (double d,
          * And then terminate, because the main line code will attempt
          * to connect, as well.
          */
-        mb_register (0 /* sink */);
-        total_pages = mb_query_total ();
+        mb_connect (0 /* sink */, 0, 0);
+        mb_snapshot (&snapshot);
+        total_pages = snapshot.total >= 0 ? snapshot.total : mb_query_total ();
         mb_terminate ();
         if (total_pages < 0) {
                 error ("mb_query_total() said %s\n",
                        mb_error_to_string (total_pages));;
         }
 
-        n_pages = (int) (d * total_pages / 100.0);
+        n_pages = (int64_t) (d * total_pages / 100.0);
 
-        printf ("%s of total %d pages is %d pages (%g M)\n",
-                arg, total_pages, n_pages, pages_to_megabytes (n_pages));
+        printf ("%s of total %lld pages is %lld pages (%g M)\n",
+                arg, (long long) total_pages, (long long) n_pages,
+                pages_to_megabytes (n_pages));
 
         return n_pages;
 }
 
-static int
+static int64_t
 parse_n_pages (const char * arg)
 {
-	int n_pages = -1;
+	int64_t n_pages = -1;
 	double d;
 	char multiplier = '\0';
 
@@ -207,7 +237,8 @@ parse_n_pages (const char * arg)
 		case 'k':
 		case 'K':
 			d *= 1024;
-			n_pages = (int) (d / EXEC_PAGESIZE);
+			/* Whole pages; any part of one left over is dropped */
+			n_pages = check_pages ((int64_t) (d / EXEC_PAGESIZE));
 			break;
 
                 case '%': /* percent of total */
@@ -253,7 +284,8 @@ main (int argc,
       char *argv[])
 {
 	MbCodes command = INVALID;
-	int n_pages = -1;
+	int64_t n_pages = -1;
+	int64_t granule_pages;
 
 	progname = argv[0];
 
@@ -275,26 +307,30 @@ main (int argc,
 
 		n_pages = parse_n_pages (check_arg (argc, argv, argv[1], 2));
 
-		printf ("%s '%s' -> %d pages\n", argv[1], argv[2], n_pages);
+		printf ("%s '%s' -> %lld pages\n", argv[1], argv[2],
+			(long long) n_pages);
 
 	} else if (0 == strcmp (argv[1], "reserve")) {
 		command = RESERVE;
 
 		n_pages = parse_n_pages (check_arg (argc, argv, argv[1], 2));
 
-		printf ("%s '%s' -> %d pages\n", argv[1], argv[2], n_pages);
+		printf ("%s '%s' -> %lld pages\n", argv[1], argv[2],
+			(long long) n_pages);
 
 	} else {
 		error ("Unknown command '%s'\n", argv[1]);
 	}
 
 	if (n_pages <= 0 && command != QUERY) {
-		fprintf (stderr, "%s: Ignoring n_pages <= 0 (%d)\n",
-			 progname, n_pages);
+		fprintf (stderr, "%s: Ignoring n_pages <= 0 (%lld)\n",
+			 progname, (long long) n_pages);
 		return EXIT_SUCCESS;
 	}
 
-	mb_register (0 /* sink */);
+	granule_pages = granule_pages_for (n_pages);
+	mb_connect (0 /* sink */, 0, granule_pages > 1 ?
+		    (size_t) granule_pages * EXEC_PAGESIZE : 0);
 
 	switch (command) {
 	case QUERY:
@@ -303,11 +339,11 @@ main (int argc,
 		return EXIT_SUCCESS;
 
 	case RESERVE:
-		do_reserve (n_pages);
+		do_reserve (n_pages, granule_pages);
 		break;
 
 	case REQUEST:
-		do_request (n_pages);
+		do_request (n_pages, granule_pages);
 		break;
 
 	default:
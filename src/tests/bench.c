@@ -0,0 +1,610 @@
+#include "mbclient.h"
+#include "mbserver.h"
+#include "mbprivate.h"
+#include "mblog.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FAIL_UNLESS(condition) \
+do { \
+    if (! ( condition) ) { \
+      printf ("%s:%d: assertion `%s' failed\n", \
+        __func__, __LINE__, #condition); \
+      exit (1);            \
+     } \
+   } while(0)
+
+typedef struct
+{
+    const char* name;
+    int (*bench)();
+    int pages;
+} BenchLookup;
+
+/* How a benchmark wants the server set up; all off by default */
+typedef struct {
+    int quiet;
+    int fan_out;
+    int adaptive_downgrade;
+    int repay_keep;
+    int repay_delay_ms;
+    int repay_damping;
+} BenchConfig;
+
+static pthread_t serverThread;
+static struct server* server;
+static int serverPages;
+static int serverIoUring;
+static BenchConfig config;
+static int haveIoUring = 1;
+
+static int startServer(int pages, int io_uring)
+{
+    pthread_attr_t attr;
+    int rc;
+
+    server = mbs_init();
+    if (!server)
+        return 1;
+
+    serverPages = pages;
+    serverIoUring = io_uring;
+    mbs_set_pages(server, pages);
+    /* Also finds out whether there is an io_uring loop to compare against */
+    if (mbs_use_io_uring(server, 1) != 0)
+        haveIoUring = 0;
+    mbs_use_io_uring(server, io_uring);
+
+    if (config.quiet)
+        mbs_set_log_level(server, 0);
+    mbs_set_fan_out(server, config.fan_out);
+    mbs_set_adaptive_downgrade(server, config.adaptive_downgrade);
+    mbs_set_repayment(server, config.repay_keep, config.repay_delay_ms, 0);
+    mbs_set_repay_damping(server, config.repay_damping);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+    rc = pthread_create(&serverThread, &attr, &mbs_main, server);
+    if (rc < 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    return 0;
+}
+
+static int stopServer()
+{
+    int rc;
+
+    mbs_shutdown(server);
+
+    rc = pthread_join(serverThread, NULL);
+    if (rc < 0) {
+        perror("pthread_join");
+        return -1;
+    }
+
+    free(server);
+
+    return 0;
+}
+
+/* Starts the server over, to take up changes to config */
+static int restartServer()
+{
+    int rc;
+
+    if ((rc = stopServer()))
+        return rc;
+    return startServer(serverPages, serverIoUring);
+}
+
+static double now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void raiseFdLimit()
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/*
+ * Forks a process that registers n idle sink clients and then sleeps.
+ * Returns once all of them are connected.
+ */
+static pid_t spawnIdleClients(int n, int first_id)
+{
+    int ready[2];
+    pid_t pid;
+    char c;
+
+    FAIL_UNLESS(pipe(ready) == 0);
+
+    pid = fork();
+    FAIL_UNLESS(pid != -1);
+
+    if (pid == 0) {
+        int i;
+
+        close(ready[0]);
+        raiseFdLimit();
+        for (i = 0; i < n; i++) {
+            if (!mb_client_register(first_id + i, 0)) {
+                printf("idle client %d failed to register\n", i);
+                _exit(1);
+            }
+        }
+        c = 1;
+        if (write(ready[1], &c, 1) != 1)
+            _exit(1);
+        for (;;)
+            pause();
+    }
+
+    close(ready[1]);
+    FAIL_UNLESS(read(ready[0], &c, 1) == 1);
+    close(ready[0]);
+
+    return pid;
+}
+
+static void reapIdleClients(pid_t pid)
+{
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+/* Average round trip of a QUERY, in microseconds */
+static double queryLatency(MbClientHandle client, int iterations)
+{
+    double start;
+    int i;
+
+    for (i = 0; i < iterations / 10; i++)
+        FAIL_UNLESS(mb_client_query_server(client) > MB_BAD_PAGES);
+
+    start = now_us();
+    for (i = 0; i < iterations; i++)
+        FAIL_UNLESS(mb_client_query_server(client) > MB_BAD_PAGES);
+
+    return (now_us() - start) / iterations;
+}
+
+/*
+ * Cost of a wakeup as the number of connected (but idle) clients grows.
+ * The broker should only pay for the connection that is actually talking.
+ */
+int benchWakeup()
+{
+    static const int counts[] = { 0, 10, 100, 1000, 5000, 10000 };
+    MbClientHandle client;
+    unsigned int i;
+
+    raiseFdLimit();
+
+    client = mb_client_register(1, 0);
+    FAIL_UNLESS(client != NULL);
+
+    printf("%10s %16s\n", "idle", "us/wakeup");
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        pid_t pid = 0;
+        double us;
+
+        if (counts[i])
+            pid = spawnIdleClients(counts[i], 1000);
+
+        us = queryLatency(client, 20000);
+        printf("%10d %16.2f\n", counts[i], us);
+
+        if (pid)
+            reapIdleClients(pid);
+    }
+
+    mb_client_terminate(client);
+    return 0;
+}
+
+#define THROUGHPUT_CLIENTS 64
+#define THROUGHPUT_BURST 16
+
+/*
+ * Message throughput with many clients that take pages and hand them back
+ * in bursts of single page RETURNs.
+ */
+int benchThroughput()
+{
+    MbClientHandle clients[THROUGHPUT_CLIENTS];
+    int rounds = 200;
+    double start, us;
+    long messages;
+    int i, j, r;
+
+    for (i = 0; i < THROUGHPUT_CLIENTS; i++) {
+        clients[i] = mb_client_register(100 + i, 0);
+        FAIL_UNLESS(clients[i] != NULL);
+    }
+
+    start = now_us();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < THROUGHPUT_CLIENTS; i++)
+            FAIL_UNLESS(mb_client_request_pages(clients[i], THROUGHPUT_BURST)
+                        == THROUGHPUT_BURST);
+        for (i = 0; i < THROUGHPUT_CLIENTS; i++)
+            for (j = 0; j < THROUGHPUT_BURST; j++)
+                FAIL_UNLESS(mb_client_return_pages(clients[i], 1) == 0);
+        for (i = 0; i < THROUGHPUT_CLIENTS; i++)
+            FAIL_UNLESS(mb_client_query_server(clients[i]) > MB_BAD_PAGES);
+    }
+    us = now_us() - start;
+
+    /* a REQUEST, the RETURNs and a QUERY per client per round */
+    messages = (long)rounds * THROUGHPUT_CLIENTS * (THROUGHPUT_BURST + 2);
+    printf("%10s %10s %16s\n", "clients", "messages", "messages/sec");
+    printf("%10d %10ld %16.0f\n", THROUGHPUT_CLIENTS, messages,
+           messages / (us / 1e6));
+
+    for (i = 0; i < THROUGHPUT_CLIENTS; i++)
+        mb_client_terminate(clients[i]);
+    return 0;
+}
+
+static int compareDouble(const void * a, const void * b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+#define REGISTER_CLIENTS 1000
+
+/*
+ * Time from connecting to having a registered client answer a QUERY,
+ * for a burst of new clients.
+ */
+int benchRegister()
+{
+    static MbClientHandle clients[REGISTER_CLIENTS];
+    static double us[REGISTER_CLIENTS];
+    double start, total = 0;
+    int i;
+
+    raiseFdLimit();
+
+    for (i = 0; i < REGISTER_CLIENTS; i++) {
+        start = now_us();
+        clients[i] = mb_client_register(2000 + i, 0);
+        FAIL_UNLESS(clients[i] != NULL);
+        FAIL_UNLESS(mb_client_query_server(clients[i]) > MB_BAD_PAGES);
+        us[i] = now_us() - start;
+        total += us[i];
+    }
+
+    for (i = 0; i < REGISTER_CLIENTS; i++)
+        mb_client_terminate(clients[i]);
+
+    qsort(us, REGISTER_CLIENTS, sizeof(us[0]), compareDouble);
+    printf("%10s %10s %10s %10s\n", "clients", "mean us", "p99 us", "max us");
+    printf("%10d %10.2f %10.2f %10.2f\n", REGISTER_CLIENTS,
+           total / REGISTER_CLIENTS, us[REGISTER_CLIENTS * 99 / 100],
+           us[REGISTER_CLIENTS - 1]);
+    return 0;
+}
+
+/*
+ * Cost to the broker thread of logging a decision: the ring versus the
+ * line buffered fprintf() it replaced.
+ */
+int benchLogEvent()
+{
+    static const int events = 1000000;
+    struct mblog log;
+    struct mbname_cache names;
+    FILE * fp;
+    double start, ring_ns, fprintf_ns;
+    int i;
+
+    fp = fopen("/dev/null", "w");
+    FAIL_UNLESS(fp != NULL);
+    setlinebuf(fp);
+
+    FAIL_UNLESS(mbname_init(&names) == 0);
+    FAIL_UNLESS(mblog_init(&log, fp, &names) == 0);
+    FAIL_UNLESS(mblog_start(&log) == 0);
+    start = now_us();
+    for (i = 0; i < events; i++)
+        mblog_event(&log, LOG_RETURN, 0, 1234, i, 0, getpid(), 0);
+    ring_ns = (now_us() - start) * 1000 / events;
+    mblog_stop(&log);
+    free(log.ring);
+    free(names.table);
+
+    start = now_us();
+    for (i = 0; i < events; i++)
+        fprintf(fp, "mbserver: return %d pages to (%d)-\"%s\"\n",
+                i, 1234, "some_client");
+    fprintf_ns = (now_us() - start) * 1000 / events;
+    fclose(fp);
+
+    printf("%10s %16s\n", "", "ns/event");
+    printf("%10s %16.1f\n", "ring", ring_ns);
+    printf("%10s %16.1f\n", "fprintf", fprintf_ns);
+    return 0;
+}
+
+#define FAN_OUT_PAGES 64          /* each sharer lends this many */
+#define FAN_OUT_DELAY_US 1000     /* and takes this long to free them */
+#define FAN_OUT_ROUNDS 20
+
+typedef struct {
+    MbClientHandle client;
+    pthread_t thread;
+    volatile int stop;
+    int stingy;             /* only gives up half at REQUEST */
+    volatile int queries;   /* share queries it has answered */
+    volatile int repaid;    /* RETURNs of its pages it has had */
+} Sharer;
+
+/*
+ * A source that takes a while to free what it is asked for, then shares it;
+ * a stingy one only half of it at REQUEST
+ */
+static void* sharerThread(void* param)
+{
+    Sharer* sharer = param;
+    struct pollfd pfd;
+    MbOp op;
+
+    pfd.fd = mb_client_fd(sharer->client);
+    pfd.events = POLLIN;
+    while (!sharer->stop) {
+        if (!mb_client_pending(sharer->client) && poll(&pfd, 1, 10) <= 0)
+            continue;
+        if (mb_client_receive_op(sharer->client, &op) != 0)
+            break;
+        if (op.code == REQUEST || op.code == RESERVE) {
+            int pages = mb_client_query(sharer->client);
+
+            if (op.code == REQUEST && sharer->stingy)
+                op.param /= 2;
+            usleep(FAN_OUT_DELAY_US);
+            FAIL_UNLESS(mb_client_send(sharer->client, SHARE,
+                                       op.param < pages ? op.param : pages)
+                        == 0);
+            sharer->queries++;
+        } else if (op.code == RETURN) {
+            sharer->repaid++;
+        }
+    }
+    mb_client_terminate(sharer->client);
+    return NULL;
+}
+
+/* Mean time for a RESERVE that needs pages from every one of n sharers */
+static double reserveLatency(int n, int fan_out, int stingy, int adaptive)
+{
+    static Sharer sharers[16];
+    MbClientHandle sink;
+    double start, us = 0;
+    int i, r;
+
+    config.fan_out = fan_out;
+    config.adaptive_downgrade = adaptive;
+    FAIL_UNLESS(restartServer() == 0);
+    for (i = 0; i < n; i++) {
+        sharers[i].client = mb_client_connect(100 + i, 0, FAN_OUT_PAGES, 0);
+        FAIL_UNLESS(sharers[i].client != NULL);
+        sharers[i].stop = 0;
+        sharers[i].stingy = stingy;
+        FAIL_UNLESS(pthread_create(&sharers[i].thread, NULL, sharerThread,
+                                   &sharers[i]) == 0);
+    }
+    sink = mb_client_register(1, 0);
+    FAIL_UNLESS(sink != NULL);
+
+    for (r = 0; r < FAN_OUT_ROUNDS; r++) {
+        start = now_us();
+        FAIL_UNLESS(mb_client_reserve_pages(sink, n * FAN_OUT_PAGES)
+                    == n * FAN_OUT_PAGES);
+        us += now_us() - start;
+        FAIL_UNLESS(mb_client_return_pages(sink, n * FAN_OUT_PAGES) == 0);
+        /* Once this is answered, the broker has paid the sharers back */
+        FAIL_UNLESS(mb_client_query_server(sink) > MB_BAD_PAGES);
+    }
+    us /= FAN_OUT_ROUNDS;
+
+    mb_client_terminate(sink);
+    for (i = 0; i < n; i++) {
+        sharers[i].stop = 1;
+        pthread_join(sharers[i].thread, NULL);
+    }
+    return us;
+}
+
+/*
+ * RESERVE latency as the number of clients it has to gather pages from
+ * grows, asking them one after another and all at once.
+ */
+int benchFanOut()
+{
+    static const int counts[] = { 1, 2, 4, 8, 16 };
+    unsigned int i;
+
+    config.quiet = 1;
+    printf("%10s %16s %16s\n", "sharers", "serial us", "fan-out us");
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        double serial = reserveLatency(counts[i], 0, 0, 0);
+        double parallel = reserveLatency(counts[i], 1, 0, 0);
+
+        printf("%10d %16.0f %16.0f\n", counts[i], serial, parallel);
+    }
+    return 0;
+}
+
+/*
+ * RESERVE latency against sources that give up only half of what they are
+ * asked for at REQUEST, asking each of them at REQUEST first every time and
+ * going straight to RESERVE once they have shown that.
+ */
+int benchDowngrade()
+{
+    static const int counts[] = { 1, 2, 4 };
+    unsigned int i;
+
+    config.quiet = 1;
+    printf("%10s %16s %16s\n", "sources", "downgrade us", "adaptive us");
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        double always = reserveLatency(counts[i], 0, 1, 0);
+        double adaptive = reserveLatency(counts[i], 0, 1, 1);
+
+        printf("%10d %16.0f %16.0f\n", counts[i], always, adaptive);
+    }
+    return 0;
+}
+
+#define REPAY_ROUNDS 50
+#define REPAY_GAP_US 2000         /* between one RESERVE and the next */
+
+/*
+ * A sink that RESERVEs a source's pages, hands them back and comes back for
+ * them a little later, over and over.  Prints the messages to and from the
+ * source per round, the share query, the SHARE and any RETURN, and the mean
+ * RESERVE latency.
+ */
+static void repayRounds(const char* policy, int keep, int delay_ms,
+                        int damping)
+{
+    Sharer sharer;
+    MbClientHandle sink;
+    double start, us = 0;
+    int r;
+
+    config.repay_keep = keep;
+    config.repay_delay_ms = delay_ms;
+    config.repay_damping = damping;
+    FAIL_UNLESS(restartServer() == 0);
+    memset(&sharer, 0, sizeof(sharer));
+    sharer.client = mb_client_connect(100, 0, FAN_OUT_PAGES, 0);
+    FAIL_UNLESS(sharer.client != NULL);
+    FAIL_UNLESS(pthread_create(&sharer.thread, NULL, sharerThread,
+                               &sharer) == 0);
+    sink = mb_client_register(1, 0);
+    FAIL_UNLESS(sink != NULL);
+
+    for (r = 0; r < REPAY_ROUNDS; r++) {
+        start = now_us();
+        FAIL_UNLESS(mb_client_reserve_pages(sink, FAN_OUT_PAGES)
+                    == FAN_OUT_PAGES);
+        us += now_us() - start;
+        FAIL_UNLESS(mb_client_return_pages(sink, FAN_OUT_PAGES) == 0);
+        usleep(REPAY_GAP_US);
+    }
+
+    printf("%16s %16.1f %16.0f\n", policy,
+           (2.0 * sharer.queries + sharer.repaid) / REPAY_ROUNDS,
+           us / REPAY_ROUNDS);
+
+    mb_client_terminate(sink);
+    sharer.stop = 1;
+    pthread_join(sharer.thread, NULL);
+}
+
+/*
+ * Pages going back and forth between the pool and a source under a
+ * periodic load, repaying the source at once and holding back in the ways
+ * the broker can.
+ */
+int benchRepayment()
+{
+    config.quiet = 1;
+    printf("%16s %16s %16s\n", "repayment", "msgs/round", "reserve us");
+    repayRounds("at once", 0, 0, 0);
+    repayRounds("keep", FAN_OUT_PAGES, 0, 0);
+    repayRounds("delay 10 ms", 0, 10, 0);
+    repayRounds("damping", 0, 0, 1);
+    return 0;
+}
+
+static BenchLookup benchTable[] = {
+    { "benchWakeup", &benchWakeup, 100 },
+    { "benchThroughput", &benchThroughput,
+      THROUGHPUT_CLIENTS * THROUGHPUT_BURST },
+    { "benchLogEvent", &benchLogEvent, 0 },
+    { "benchRegister", &benchRegister, 100 },
+    { "benchFanOut", &benchFanOut, 0 },
+    { "benchDowngrade", &benchDowngrade, 0 },
+    { "benchRepayment", &benchRepayment, 0 }
+};
+
+#define N_ELEMENTS(ary)  (sizeof (ary) / sizeof (ary[0]))
+
+static const char * backends[] = { "epoll", "io_uring" };
+
+/* Runs a benchmark against each event loop the server was built with */
+static int runBench(int index)
+{
+    int rc, io_uring;
+
+    for (io_uring = 0; io_uring < (int)N_ELEMENTS(backends); io_uring++) {
+        printf("Running benchmark: %s (%s)\n", benchTable[index].name,
+               backends[io_uring]);
+
+        memset(&config, 0, sizeof(config));
+        if ((rc = startServer(benchTable[index].pages, io_uring)))
+            return rc;
+
+        if ((rc = benchTable[index].bench()))
+            return rc;
+
+        if ((rc = stopServer()))
+            return rc;
+
+        if (!haveIoUring)
+            break;
+    }
+    return 0;
+}
+
+int main(int argc, char ** argv)
+{
+    int rc = 0;
+    int index;
+
+    setlinebuf(stdout);
+
+    if (argc < 2) {
+        for (index = 0; index < (int)N_ELEMENTS(benchTable); index++)
+            if ((rc = runBench(index)))
+                return rc;
+        return 0;
+    }
+
+    for (index=0; index<(int)N_ELEMENTS(benchTable); index++)
+        if (strcmp(benchTable[index].name, argv[1]) == 0)
+            break;
+
+    if (index == N_ELEMENTS(benchTable)) {
+        printf("Could not find benchmark %s\n", argv[1]);
+        return -1;
+    }
+
+    return runBench(index);
+}
@@ -1,15 +1,20 @@
 #include "mbclient.h"
 #include "mbserver.h"
 #include "mbprivate.h"
+#include "mbname.h"
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <malloc.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #define min(a,b) a < b ? a:b
@@ -29,6 +34,8 @@ typedef struct
     const char* name;
     int (*test)();
     int pages;
+    int shards;
+    void (*setup)();    /* configures the server before it starts */
 } TestLookup;
 
 typedef struct
@@ -52,7 +59,7 @@ typedef struct
 static pthread_t serverThread;
 static struct server* server;
 
-static int startServer(int pages)
+static int startServer(int pages, int shards, void (*setup)())
 {
     pthread_attr_t attr;
     int rc;
@@ -62,6 +69,12 @@ static int startServer(int pages)
         return 1;
 
     mbs_set_pages(server, pages);
+    if (getenv("MBS_IO_URING") && mbs_use_io_uring(server, 1) != 0)
+        return 1;
+    if (shards && mbs_set_shards(server, shards) != 0)
+        return 1;
+    if (setup)
+        setup();
 
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
@@ -176,7 +189,10 @@ static void* clientThread(void* param)
                     tc->reserved_pages -= pages;
                     break;
                 case QUERY_AVAILABLE:
-                    pages = tc->reservable_pages-tc->reserved_pages;
+                    if (pages == REQUEST)
+                        pages = tc->requestable_pages-tc->requested_pages;
+                    else
+                        pages = tc->reservable_pages-tc->reserved_pages;
                     ret = mb_client_send (tc->client, AVAILABLE, pages);
 		    FAIL_UNLESS(ret == 0);
                     break;
@@ -1237,23 +1253,1314 @@ int testDumpDebug()
     return 0;
 }
 
+int testSteadyStateAllocs()
+{
+    TestClient* source = createTestClient(1, 1, 10);
+    TestClient* sink = createTestClient(2, 0, 0);
+    unsigned long allocs;
+    int i, rc;
+
+    // Warm up: the first request through the queue sizes everything
+    rc = mb_client_request_pages(sink->client, 5);
+    FAIL_UNLESS(rc == 5);
+    rc = mb_client_return_pages(sink->client, 5);
+    FAIL_UNLESS(rc == 0);
+    flushClient(sink);
+    flushClient(source);
+
+    allocs = mbs_get_alloc_count(server);
+
+    // Requests served by sharing, returns, and clients coming and going
+    // must all run out of the pools
+    for (i = 0; i < 20; i++) {
+        TestClient* other = createTestClient(3, 0, 0);
+
+        rc = mb_client_request_pages(sink->client, 5);
+        FAIL_UNLESS(rc == 5);
+        rc = mb_client_return_pages(sink->client, 5);
+        FAIL_UNLESS(rc == 0);
+        flushClient(sink);
+        flushClient(source);
+
+        terminateTestClient(other);
+    }
+
+    flushClient(sink);
+    FAIL_UNLESS(mbs_get_alloc_count(server) == allocs);
+
+    terminateTestClient(source);
+    terminateTestClient(sink);
+
+    return 0;
+}
+
+int testSlowReader()
+{
+    TestClient* jammed = createTestClient(1, 0, 0);
+    TestClient* sink = createTestClient(2, 0, 0);
+    int i, rc;
+
+    // A client that never reads its replies must not hold up the broker
+    for (i = 0; i < 2000; i++) {
+        rc = mb_client_send(jammed->client, QUERY, 0);
+        FAIL_UNLESS(rc == 0);
+    }
+
+    FAIL_UNLESS(mb_client_query_server(sink->client) == 5);
+    rc = mb_client_request_pages(sink->client, 5);
+    FAIL_UNLESS(rc == 5);
+    FAIL_UNLESS(mb_client_query_server(sink->client) == 0);
+
+    closeTestClient(jammed);
+    terminateTestClient(sink);
+
+    return 0;
+}
+
+int testJammedGrant()
+{
+    TestClient* jammed = createTestClient(1, 0, 0);
+    TestClient* sink = createTestClient(2, 0, 0);
+    MbCodes code;
+    int i, rc, param;
+
+    // Fill its queue with answers it does not read, then ask for pages
+    for (i = 0; i < 20000; i++) {
+        rc = mb_client_send(jammed->client, QUERY, 0);
+        FAIL_UNLESS(rc == 0);
+    }
+    rc = mb_client_send(jammed->client, REQUEST, 5);
+    FAIL_UNLESS(rc == 0);
+
+    for (i = 0; i < 1000 && mb_client_query_server(sink->client) != 0; i++)
+        usleep(1000);
+    FAIL_UNLESS(i < 1000);
+
+    // The grant must still be behind the answers that made it in
+    do {
+        rc = mb_client_receive(jammed->client, &code, &param);
+        FAIL_UNLESS(rc == 0);
+    } while (code == QUERY);
+    FAIL_UNLESS(code == SHARE);
+    FAIL_UNLESS(param == 5);
+
+    terminateTestClient(jammed);
+    terminateTestClient(sink);
+
+    return 0;
+}
+
+int testJammedReserve()
+{
+    TestClient* jammed = createTestClient(1, 0, 0);
+    TestClient* sink = createTestClient(2, 0, 0);
+    int i, rc;
+
+    rc = mb_client_request_pages(sink->client, 2);
+    FAIL_UNLESS(rc == 2);
+
+    // Fill its queue with answers it does not read, then RESERVE until the
+    // empty grants no longer fit either
+    for (i = 0; i < 20000; i++) {
+        rc = mb_client_send(jammed->client, QUERY, 0);
+        FAIL_UNLESS(rc == 0);
+    }
+    for (i = 0; i < 64; i++) {
+        rc = mb_client_send(jammed->client, RESERVE, 5);
+        FAIL_UNLESS(rc == 0);
+        usleep(2000);
+    }
+    FAIL_UNLESS(mb_client_query_server(sink->client) == 0);
+
+    // The RESERVE waiting to go out has completed with nothing, and stays
+    // that way; the pages are still there for anyone else
+    rc = mb_client_return_pages(sink->client, 2);
+    FAIL_UNLESS(rc == 0);
+    FAIL_UNLESS(mb_client_query_server(sink->client) == 2);
+    rc = mb_client_request_pages(sink->client, 2);
+    FAIL_UNLESS(rc == 2);
+
+    closeTestClient(jammed);
+    terminateTestClient(sink);
+
+    return 0;
+}
+
+static int connectDebug()
+{
+    struct sockaddr_un debug_addr;
+    const char * socket_dir;
+    int fd;
+
+    fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    assert (fd > -1);
+    memset (&debug_addr, 0, sizeof (debug_addr));
+    debug_addr.sun_family = AF_UNIX;
+    socket_dir = getenv ("LXK_RUNTIME_DIR");
+    if (! socket_dir)
+        socket_dir = ".";
+    snprintf (debug_addr.sun_path, sizeof (debug_addr.sun_path),
+              "%s/membroker.debug", socket_dir);
+    if (0 > connect (fd, (struct sockaddr *) &debug_addr,
+                     sizeof (debug_addr)))
+        abort ();
+    return fd;
+}
+
+#define DEBUG_READERS 8
+
+int testDebugReaders()
+{
+    TestClient* sink = createTestClient(1, 0, 0);
+    int fds[DEBUG_READERS];
+    int i, rc, dumps = 0, busy = 0;
+
+    // Debug readers that are in no hurry must not hold up the broker
+    for (i = 0; i < DEBUG_READERS; i++)
+        fds[i] = connectDebug();
+
+    rc = mb_client_request_pages(sink->client, 5);
+    FAIL_UNLESS(rc == 5);
+    FAIL_UNLESS(mb_client_query_server(sink->client) == 0);
+
+    // Each one gets either the whole dump or a polite refusal
+    for (i = 0; i < DEBUG_READERS; i++) {
+        char buf[4096];
+        int len = 0, n;
+
+        do {
+            n = read(fds[i], buf + len, sizeof(buf) - 1 - len);
+            if (n > 0)
+                len += n;
+        } while (n > 0 || (n == -1 && errno == EINTR));
+        buf[len] = '\0';
+        close(fds[i]);
+
+        if (strstr(buf, "busy"))
+            busy++;
+        else if (strstr(buf, "mbserver: CLIENTS"))
+            dumps++;
+    }
+    FAIL_UNLESS(dumps > 0);
+    FAIL_UNLESS(dumps + busy == DEBUG_READERS);
+
+    terminateTestClient(sink);
+
+    return 0;
+}
+
+int testNameCache()
+{
+    struct mbname_cache cache;
+    char name[MBNAME_MAX];
+    int pid;
+
+    FAIL_UNLESS(mbname_init(&cache) == 0);
+
+    // Resolved on first use, then served from the cache
+    mbname_lookup(&cache, getpid(), name, sizeof(name));
+    FAIL_UNLESS(strstr(name, "test_main") != NULL);
+    FAIL_UNLESS(cache.reads == 1);
+    mbname_lookup(&cache, getpid(), name, sizeof(name));
+    FAIL_UNLESS(strstr(name, "test_main") != NULL);
+    FAIL_UNLESS(cache.reads == 1);
+
+    // No pid, no lookup
+    mbname_lookup(&cache, 0, name, sizeof(name));
+    FAIL_UNLESS(strcmp(name, "unknown") == 0);
+    FAIL_UNLESS(cache.reads == 1);
+
+    // A registration re-reads the name, since pids get reused
+    mbname_refresh(&cache, getpid());
+    FAIL_UNLESS(cache.reads == 2);
+
+    // The table does not grow; old entries make way
+    for (pid = 1; pid <= 4 * MBNAME_SETS * MBNAME_WAYS; pid++)
+        mbname_lookup(&cache, 0x40000000 + pid, name, sizeof(name));
+    FAIL_UNLESS(strcmp(name, "unknown") == 0);
+    mbname_lookup(&cache, getpid(), name, sizeof(name));
+    FAIL_UNLESS(strstr(name, "test_main") != NULL);
+    FAIL_UNLESS(cache.reads == 3 + 4 * MBNAME_SETS * MBNAME_WAYS);
+
+    free(cache.table);
+    return 0;
+}
+
+static double elapsedMs(const struct timespec* start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 +
+           (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+#define DEADLINE_MS 200
+
+int testRequestDeadline()
+{
+    TestClient* wedged = createTestClient(1, 1, 0);
+    TestClient* stuck = createTestClient(4, 1, 0);
+    TestClient* sink = createTestClient(2, 0, 0);
+    struct timespec start;
+    int rc;
+
+    // Bidi clients that never answer their share queries; one is left to
+    // ask once the other sits on a RESERVE
+    pauseClient(wedged);
+    pauseClient(stuck);
+
+    FAIL_UNLESS(mb_client_set_deadline(sink->client, -1) == MB_BAD_PARAM);
+    FAIL_UNLESS(mb_client_set_deadline(sink->client, DEADLINE_MS) == 0);
+
+    // A RESERVE the pool only partly covers still gets all or nothing
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    rc = mb_client_reserve_pages(sink->client, 5);
+    FAIL_UNLESS(rc == 0);
+    FAIL_UNLESS(elapsedMs(&start) >= DEADLINE_MS * 3 / 4);
+    FAIL_UNLESS(mb_client_query(sink->client) == 0);
+    rc = mb_client_request_pages(sink->client, 3);
+    FAIL_UNLESS(rc == 3);
+
+    // Without a deadline these would wait on it for ever
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    rc = mb_client_request_pages(sink->client, 5);
+    FAIL_UNLESS(rc == 0);
+    FAIL_UNLESS(elapsedMs(&start) >= DEADLINE_MS * 3 / 4);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    rc = mb_client_reserve_pages(sink->client, 5);
+    FAIL_UNLESS(rc == 0);
+    FAIL_UNLESS(elapsedMs(&start) >= DEADLINE_MS * 3 / 4);
+
+    terminateTestClient(sink);
+    closeTestClient(stuck);
+    closeTestClient(wedged);
+
+    return 0;
+}
+
+static void setEscalation()
+{
+    mbs_set_request_timeout(server, 0, 1);
+}
+
+int testRequestEscalation()
+{
+    TestClient* wedged = createTestClient(1, 1, 0);
+    TestClient* source = createTestClient(3, 1, 10);
+    TestClient* sink = createTestClient(2, 0, 0);
+    struct timespec start;
+    int rc;
+
+    // A source that only gives pages up at RESERVE, and a bidi client that
+    // never answers, so the REQUEST only gets them once it has been
+    // escalated
+    FAIL_UNLESS(source != NULL);
+    pthread_mutex_lock(&(source->mutex));
+    source->requestable_pages = 0;
+    pthread_mutex_unlock(&(source->mutex));
+    pauseClient(wedged);
+    FAIL_UNLESS(mb_client_set_deadline(sink->client, DEADLINE_MS) == 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    rc = mb_client_request_pages(sink->client, 5);
+    FAIL_UNLESS(rc == 5);
+    FAIL_UNLESS(elapsedMs(&start) >= DEADLINE_MS * 3 / 4);
+    FAIL_UNLESS(page_count(source) == 5);
+
+    // The sink's pages go back to the source when it leaves
+    terminateTestClient(sink);
+    for (rc = 1000; page_count(source) != 10 && --rc; )
+        usleep(1000);
+    FAIL_UNLESS(rc > 0);
+    terminateTestClient(source);
+    closeTestClient(wedged);
+
+    return 0;
+}
+
+static void readDebug(char* buf, size_t size)
+{
+    int fd = connectDebug();
+    size_t len = 0;
+    int n;
+
+    do {
+        n = read(fd, buf + len, size - 1 - len);
+        if (n > 0)
+            len += n;
+    } while (n > 0 || (n == -1 && errno == EINTR));
+    buf[len] = '\0';
+    close(fd);
+}
+
+#define SHARE_TIMEOUT_MS 100
+
+static void setShareTimeout()
+{
+    mbs_set_share_timeout(server, SHARE_TIMEOUT_MS);
+}
+
+int testShareTimeout()
+{
+    TestClient* wedged = createTestClient(1, 1, 10);
+    TestClient* helper = createTestClient(2, 1, 5);
+    TestClient* sink = createTestClient(3, 0, 0);
+    struct timespec start;
+    char buf[4096];
+    int rc;
+
+    // Sources are asked first, in slot order, so the wedged one holds up
+    // each request unless it is cooling off.  A RESERVE asks a source at
+    // REQUEST first, so it stalls twice, and that makes it a repeat
+    // offender.
+    pauseClient(wedged);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    FAIL_UNLESS(mb_client_reserve_pages(sink->client, 5) == 5);
+    FAIL_UNLESS(elapsedMs(&start) >= 2 * SHARE_TIMEOUT_MS * 3 / 4);
+    FAIL_UNLESS(mb_client_return_pages(sink->client, 5) == 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    FAIL_UNLESS(mb_client_request_pages(sink->client, 5) == 5);
+    FAIL_UNLESS(elapsedMs(&start) < SHARE_TIMEOUT_MS * 3 / 4);
+    FAIL_UNLESS(mb_client_return_pages(sink->client, 5) == 0);
+
+    // Once the cooldown is over it gets asked, and stalls, again
+    usleep(SHARE_TIMEOUT_MS * 3 / 2 * 1000);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    FAIL_UNLESS(mb_client_request_pages(sink->client, 5) == 5);
+    FAIL_UNLESS(elapsedMs(&start) >= SHARE_TIMEOUT_MS * 3 / 4);
+    FAIL_UNLESS(mb_client_return_pages(sink->client, 5) == 0);
+
+    readDebug(buf, sizeof(buf));
+    FAIL_UNLESS(strstr(buf, "STALLS 3 ") != NULL);
+    FAIL_UNLESS(strstr(buf, "3 share queries stalled, 3 in a row; cooling off"));
+
+    // Its answers, when they come, go back into the pool and from there
+    // back to it
+    resumeClient(wedged);
+    for (rc = 1000; --rc; usleep(1000))
+        if (page_count(wedged) == 10 && page_count(helper) == 5 &&
+            mb_client_query_server(sink->client) == 0)
+            break;
+    FAIL_UNLESS(rc > 0);
+    FAIL_UNLESS(mb_client_query_total(sink->client) == 15);
+
+    terminateTestClient(sink);
+    terminateTestClient(helper);
+    terminateTestClient(wedged);
+
+    return 0;
+}
+
+#define SHARD_CLIENTS 8
+
+int testShards()
+{
+    MbClientHandle clients[SHARD_CLIENTS];
+    char buf[16384], expected[32];
+    int i, rc;
+
+    // The ids spread these over all four shards
+    for (i = 0; i < SHARD_CLIENTS; i++) {
+        clients[i] = mb_client_register(10 + i, 0);
+        FAIL_UNLESS(clients[i] != NULL);
+        rc = mb_client_request_pages(clients[i], 10);
+        FAIL_UNLESS(rc == 10);
+    }
+
+    // Every shard sees the same broker
+    for (i = 0; i < SHARD_CLIENTS; i++) {
+        FAIL_UNLESS(mb_client_query_total(clients[i]) == 100);
+        FAIL_UNLESS(mb_client_query_server(clients[i]) == 20);
+    }
+
+    // Whatever is spare is there for any shard to take
+    rc = mb_client_request_pages(clients[0], 20);
+    FAIL_UNLESS(rc == 20);
+    FAIL_UNLESS(mb_client_query_server(clients[7]) == 0);
+
+    rc = mb_client_return_pages(clients[7], 10);
+    FAIL_UNLESS(rc == 0);
+    // Answered once the RETURN has been dealt with
+    FAIL_UNLESS(mb_client_query_server(clients[7]) == 10);
+    FAIL_UNLESS(mb_client_query_server(clients[0]) == 10);
+    rc = mb_client_request_pages(clients[2], 10);
+    FAIL_UNLESS(rc == 10);
+    FAIL_UNLESS(mb_client_query_server(clients[5]) == 0);
+
+    // Pages come back from a client that goes away in any shard
+    mb_client_terminate(clients[0]);
+    for (i = 1; i < SHARD_CLIENTS; i++) {
+        int tries = 1000;
+
+        while (mb_client_query_server(clients[i]) != 30 && --tries)
+            usleep(1000);
+        FAIL_UNLESS(tries > 0);
+    }
+    FAIL_UNLESS(mb_client_query_total(clients[1]) == 100);
+
+    // The debug dump has every shard's clients in it
+    readDebug(buf, sizeof(buf));
+    for (i = 0; i < 4; i++) {
+        snprintf(expected, sizeof(expected), "SHARD %d of 4", i);
+        FAIL_UNLESS(strstr(buf, expected) != NULL);
+    }
+    for (i = 1; i < SHARD_CLIENTS; i++) {
+        snprintf(expected, sizeof(expected), "(%d)-", 10 + i);
+        FAIL_UNLESS(strstr(buf, expected) != NULL);
+    }
+
+    for (i = 1; i < SHARD_CLIENTS; i++)
+        mb_client_terminate(clients[i]);
+
+    return 0;
+}
+
+int testProtocolV2()
+{
+    MbClientHandle v1, v2, seq;
+    MbSnapshot snap;
+    MbOp ops[2], op;
+    int rc;
+
+    v1 = mb_client_register(1, 0);
+    FAIL_UNLESS(v1 != NULL);
+    FAIL_UNLESS(mb_client_protocol(v1) == 1);
+    FAIL_UNLESS(mb_client_request_pages(v1, 10) == 10);
+
+    // The registration comes back with the pool, no round trips needed
+    v2 = mb_client_connect(2, 0, 0, 0);
+    FAIL_UNLESS(v2 != NULL);
+    FAIL_UNLESS(mb_client_protocol(v2) == 2);
+    FAIL_UNLESS(mb_client_snapshot(v2, &snap) == 0);
+    FAIL_UNLESS(snap.caps & MB_CAP_V2);
+    FAIL_UNLESS(snap.caps & MB_CAP_SEQPACKET);
+    FAIL_UNLESS(snap.total == 100);
+    FAIL_UNLESS(snap.free == 90);
+
+    // The synchronous calls work as ever
+    FAIL_UNLESS(mb_client_request_pages(v2, 20) == 20);
+    FAIL_UNLESS(mb_client_query_server(v2) == 70);
+
+    // Hand some back and ask for more in one frame; the tag comes back
+    ops[0].code = RETURN;
+    ops[0].flags = 0;
+    ops[0].tag = 0;
+    ops[0].param = 20;
+    ops[1].code = REQUEST;
+    ops[1].flags = 0;
+    ops[1].tag = 77;
+    ops[1].param = 30;
+    FAIL_UNLESS(mb_client_send_ops(v2, ops, 2) == 0);
+    FAIL_UNLESS(mb_client_receive_op(v2, &op) == 0);
+    FAIL_UNLESS(op.code == SHARE && op.param == 30 && op.tag == 77);
+    FAIL_UNLESS(mb_client_query(v2) == 30);
+
+    // Replies to one frame come back in one frame
+    ops[0].code = REQUEST;
+    ops[0].tag = 78;
+    ops[0].param = 5;
+    ops[1].code = QUERY;
+    ops[1].param = 0;
+    FAIL_UNLESS(mb_client_send_ops(v2, ops, 2) == 0);
+    FAIL_UNLESS(mb_client_receive_op(v2, &op) == 0);
+    FAIL_UNLESS(op.code == SHARE && op.param == 5 && op.tag == 78);
+    FAIL_UNLESS(mb_client_pending(v2));
+    FAIL_UNLESS(mb_client_receive_op(v2, &op) == 0);
+    FAIL_UNLESS(op.code == QUERY && op.param == 55);
+    FAIL_UNLESS(!mb_client_pending(v2));
+
+    // A source over SOCK_SEQPACKET, seen by everyone else
+    seq = mb_client_connect(3, MB_CLIENT_SEQPACKET, 50, 0);
+    FAIL_UNLESS(seq != NULL);
+    FAIL_UNLESS(mb_client_protocol(seq) == 2);
+    FAIL_UNLESS(mb_client_snapshot(seq, &snap) == 0);
+    FAIL_UNLESS(snap.total == 150 && snap.free == 55);
+    FAIL_UNLESS(mb_client_query_total(v1) == 150);
+    FAIL_UNLESS(mb_client_query_total(v2) == 150);
+
+    // Short by 5, which the source is asked for
+    ops[0].tag = 79;
+    ops[0].param = 60;
+    FAIL_UNLESS(mb_client_send_ops(v2, ops, 1) == 0);
+    FAIL_UNLESS(mb_client_receive_op(seq, &op) == 0);
+    FAIL_UNLESS(op.code == REQUEST && op.param == 5);
+    FAIL_UNLESS(mb_client_send(seq, SHARE, 5) == 0);
+    FAIL_UNLESS(mb_client_receive_op(v2, &op) == 0);
+    FAIL_UNLESS(op.code == SHARE && op.param == 60 && op.tag == 79);
+    FAIL_UNLESS(mb_client_query_server(v1) == 0);
+
+    mb_client_terminate(v2);
+    rc = mb_client_terminate(seq);
+    FAIL_UNLESS(rc == 0);
+    mb_client_terminate(v1);
+    return 0;
+}
+
+/* Sends one op, with nothing else to say about it */
+static int sendOp(MbClientHandle client, MbCodes code, int flags, int tag,
+                  int pages)
+{
+    MbOp op;
+
+    op.code = code;
+    op.flags = flags;
+    op.tag = tag;
+    op.param = pages;
+    return mb_client_send_ops(client, &op, 1);
+}
+
+/* Registers a bidi v2 client and has it take pages from the pool */
+static MbClientHandle connectSharer(int id, int pages)
+{
+    MbClientHandle sharer = mb_client_connect(id, MB_CLIENT_BIDI, 0, 0);
+    MbOp op;
+
+    FAIL_UNLESS(sharer != NULL);
+    FAIL_UNLESS(sendOp(sharer, REQUEST, 0, 1, pages) == 0);
+    FAIL_UNLESS(mb_client_receive_op(sharer, &op) == 0);
+    FAIL_UNLESS(op.code == SHARE && op.param == pages);
+    return sharer;
+}
+
+#define FAN_OUT_SHARERS 3
+
+static void setFanOut()
+{
+    mbs_set_fan_out(server, 1);
+}
+
+int testFanOut()
+{
+    MbClientHandle sharers[FAN_OUT_SHARERS], sink;
+    MbOp op;
+    int i, asked = 0;
+
+    for (i = 0; i < FAN_OUT_SHARERS; i++)
+        sharers[i] = connectSharer(1 + i, 10);
+
+    // Every sharer is asked at once, for no more than it has
+    sink = mb_client_connect(4, 0, 0, 0);
+    FAIL_UNLESS(sink != NULL);
+    FAIL_UNLESS(sendOp(sink, RESERVE, 0, 1, 25) == 0);
+    for (i = 0; i < FAN_OUT_SHARERS; i++) {
+        FAIL_UNLESS(mb_client_receive_op(sharers[i], &op) == 0);
+        FAIL_UNLESS(op.code == RESERVE && op.param > 0 && op.param <= 10);
+        asked += op.param;
+    }
+    FAIL_UNLESS(asked == 25);
+
+    // Sharing more than was asked for leaves the rest in the pool
+    for (i = 0; i < FAN_OUT_SHARERS; i++)
+        FAIL_UNLESS(mb_client_send(sharers[i], SHARE, 10) == 0);
+    FAIL_UNLESS(mb_client_receive_op(sink, &op) == 0);
+    FAIL_UNLESS(op.code == SHARE && op.param == 25);
+    FAIL_UNLESS(mb_client_query_server(sink) == 5);
+
+    mb_client_terminate(sink);
+    for (i = 0; i < FAN_OUT_SHARERS; i++)
+        mb_client_terminate(sharers[i]);
+    return 0;
+}
+
+#define HUGE_PAGE (2 * 1024 * 1024)
+#define HUGE_PAGES(n) ((n) * (HUGE_PAGE / EXEC_PAGESIZE))
+
+int testGranules()
+{
+    MbClientHandle huge, small, source, fine, big;
+    MbSnapshot snap;
+    MbOp op;
+    int rc;
+
+    // Counts both ways are in huge pages, rounded down
+    huge = mb_client_connect(1, 0, 0, HUGE_PAGE);
+    FAIL_UNLESS(huge != NULL);
+    FAIL_UNLESS(mb_client_granule(huge) == HUGE_PAGE);
+    FAIL_UNLESS(mb_client_snapshot(huge, &snap) == 0);
+    FAIL_UNLESS(snap.caps & MB_CAP_GRANULE);
+    FAIL_UNLESS(snap.total == 1000 / HUGE_PAGES(1) && snap.free == 1);
+    FAIL_UNLESS(mb_client_request_pages(huge, 1) == 1);
+    FAIL_UNLESS(mb_client_query_server(huge) == 0);
+
+    small = mb_client_register(2, 0);
+    FAIL_UNLESS(small != NULL);
+    FAIL_UNLESS(mb_client_request_pages(small, 400) == 400);
+
+    // Less than a huge page is as good as none
+    FAIL_UNLESS(mb_client_request_pages(huge, 1) == 0);
+    FAIL_UNLESS(mb_client_query_server(small) == 88);
+    FAIL_UNLESS(mb_client_return_pages(huge, 1) == 0);
+    FAIL_UNLESS(mb_client_query_server(huge) == 1);
+    FAIL_UNLESS(mb_client_query_server(small) == 600);
+
+    // A source lending huge pages is asked for whole ones
+    source = mb_client_connect(3, MB_CLIENT_SEQPACKET, 4, HUGE_PAGE);
+    FAIL_UNLESS(source != NULL);
+    FAIL_UNLESS(mb_client_snapshot(source, &snap) == 0);
+    FAIL_UNLESS(snap.total == (1000 + HUGE_PAGES(4)) / HUGE_PAGES(1));
+    FAIL_UNLESS(snap.free == 1);
+    FAIL_UNLESS(mb_client_query_total(small) == 1000 + HUGE_PAGES(4));
+
+    fine = mb_client_connect(4, 0, 0, 0);
+    FAIL_UNLESS(fine != NULL);
+    FAIL_UNLESS(sendOp(fine, REQUEST, 0, 1, 700) == 0);
+    FAIL_UNLESS(mb_client_receive_op(source, &op) == 0);
+    FAIL_UNLESS(op.code == REQUEST && op.param == 1);
+    FAIL_UNLESS(mb_client_send(source, SHARE, 1) == 0);
+    FAIL_UNLESS(mb_client_receive_op(fine, &op) == 0);
+    FAIL_UNLESS(op.code == SHARE && op.param == 700);
+    FAIL_UNLESS(mb_client_query_server(small) == 600 + HUGE_PAGES(1) - 700);
+
+    // It gets its huge page back once there is a whole one to give
+    FAIL_UNLESS(mb_client_return_pages(fine, 700) == 0);
+    FAIL_UNLESS(mb_client_receive_op(source, &op) == 0);
+    FAIL_UNLESS(op.code == RETURN && op.param == 1);
+    FAIL_UNLESS(mb_client_query_server(small) == 600);
+
+    // 8 TiB in gigabyte pages is more than a v1 client can count
+    big = mb_client_connect(5, MB_CLIENT_SEQPACKET, 8192, 1 << 30);
+    FAIL_UNLESS(big != NULL);
+    FAIL_UNLESS(mb_client_snapshot(big, &snap) == 0);
+    FAIL_UNLESS(snap.total == 8192);
+    FAIL_UNLESS(mb_client_query_total(small) == INT_MAX);
+    FAIL_UNLESS(mb_client_query_total(huge) ==
+                (int) ((((int64_t) 8192 << 30) / EXEC_PAGESIZE + 1000 +
+                        HUGE_PAGES(4)) / HUGE_PAGES(1)));
+
+    // Granules are whole powers of two of pages
+    FAIL_UNLESS(mb_client_connect(6, 0, 0, 3 * EXEC_PAGESIZE) == NULL);
+    FAIL_UNLESS(mb_client_connect(6, 0, 0, EXEC_PAGESIZE / 2) == NULL);
+
+    mb_client_terminate(big);
+    mb_client_terminate(fine);
+    rc = mb_client_terminate(source);
+    FAIL_UNLESS(rc == 0);
+    mb_client_terminate(small);
+    mb_client_terminate(huge);
+    return 0;
+}
+
+#define AVAILABLE_SHARERS 3
+
+int testAvailable()
+{
+    MbClientHandle sharers[AVAILABLE_SHARERS], sink;
+    MbSnapshot snap;
+    MbOp op;
+    char buf[4096];
+    int i;
+
+    for (i = 0; i < AVAILABLE_SHARERS; i++)
+        sharers[i] = connectSharer(1 + i, 10);
+    FAIL_UNLESS(mb_client_snapshot(sharers[0], &snap) == 0);
+    FAIL_UNLESS(snap.caps & MB_CAP_AVAILABLE);
+    sink = mb_client_connect(4, 0, 0, 0);
+    FAIL_UNLESS(sink != NULL);
+
+    // The first has nothing to spare at REQUEST, the second has plenty and
+    // the third only says what it could do at RESERVE
+    FAIL_UNLESS(sendOp(sharers[0], AVAILABLE, REQUEST, 0, 0) == 0);
+    FAIL_UNLESS(sendOp(sharers[1], AVAILABLE, REQUEST, 0, 10) == 0);
+    FAIL_UNLESS(sendOp(sharers[2], AVAILABLE, RESERVE, 0, 10) == 0);
+    FAIL_UNLESS(mb_client_query_server(sink) == 0);
+
+    // A REQUEST goes to the one that can cover it, and the others are asked
+    // what they could do at both levels
+    FAIL_UNLESS(sendOp(sink, REQUEST, 0, 1, 8) == 0);
+    FAIL_UNLESS(mb_client_receive_op(sharers[1], &op) == 0);
+    FAIL_UNLESS(op.code == REQUEST && op.param == 8);
+    for (i = 0; i < AVAILABLE_SHARERS; i += 2) {
+        FAIL_UNLESS(mb_client_receive_op(sharers[i], &op) == 0);
+        FAIL_UNLESS(op.code == QUERY_AVAILABLE && op.param == REQUEST);
+        FAIL_UNLESS(mb_client_receive_op(sharers[i], &op) == 0);
+        FAIL_UNLESS(op.code == QUERY_AVAILABLE && op.param == RESERVE);
+    }
+    FAIL_UNLESS(mb_client_send(sharers[1], SHARE, 8) == 0);
+    FAIL_UNLESS(mb_client_receive_op(sink, &op) == 0);
+    FAIL_UNLESS(op.code == SHARE && op.param == 8);
+
+    // Answers come in the order the polls went out
+    FAIL_UNLESS(mb_client_send(sharers[0], AVAILABLE, 0) == 0);
+    FAIL_UNLESS(mb_client_send(sharers[0], AVAILABLE, 3) == 0);
+    FAIL_UNLESS(mb_client_query_server(sink) == 0);
+
+    // Nobody else is known to cover a RESERVE but the third, which has yet
+    // to answer
+    FAIL_UNLESS(sendOp(sink, RESERVE, 0, 2, 9) == 0);
+    FAIL_UNLESS(mb_client_receive_op(sharers[2], &op) == 0);
+    FAIL_UNLESS(op.code == RESERVE && op.param == 9);
+    FAIL_UNLESS(mb_client_send(sharers[2], SHARE, 9) == 0);
+    FAIL_UNLESS(mb_client_receive_op(sink, &op) == 0);
+    FAIL_UNLESS(op.code == SHARE && op.param == 9);
+
+    readDebug(buf, sizeof(buf));
+    FAIL_UNLESS(strstr(buf, "Could share 0 pages ") != NULL);
+    FAIL_UNLESS(strstr(buf, "at RESERVE; asked again") != NULL);
+
+    mb_client_terminate(sink);
+    for (i = 0; i < AVAILABLE_SHARERS; i++)
+        mb_client_terminate(sharers[i]);
+    return 0;
+}
+
+int testShareHistory()
+{
+    TestClient* denier = createTestClient(1, 1, 10);
+    TestClient* sink = createTestClient(2, 0, 0);
+    TestClient* sharer;
+    char buf[4096];
+    int i;
+
+    // It only ever says DENY to a REQUEST
+    pthread_mutex_lock(&(denier->mutex));
+    denier->requestable_pages = 0;
+    pthread_mutex_unlock(&(denier->mutex));
+    FAIL_UNLESS(mb_client_request_pages(sink->client, 1) == 0);
+
+    // So a source that has yet to be tried goes before it
+    sharer = createTestClient(3, 1, 10);
+    for (i = 1000; --i; usleep(1000))
+        if (mb_client_query_total(sink->client) == 20)
+            break;
+    FAIL_UNLESS(i > 0);
+    FAIL_UNLESS(mb_client_request_pages(sink->client, 1) == 1);
+    FAIL_UNLESS(mb_client_return_pages(sink->client, 1) == 0);
+    readDebug(buf, sizeof(buf));
+    FAIL_UNLESS(strstr(buf, "REQUEST: 1 answers in ") != NULL);
+    FAIL_UNLESS(strstr(buf, "REQUEST: 2 answers in ") == NULL);
+    terminateTestClient(sharer);
+
+    // Once it has said DENY often enough it is not asked at all
+    for (i = 1; i < 5; i++)
+        FAIL_UNLESS(mb_client_request_pages(sink->client, 1) == 0);
+    readDebug(buf, sizeof(buf));
+    FAIL_UNLESS(strstr(buf, "REQUEST: 4 answers in ") != NULL);
+    FAIL_UNLESS(strstr(buf, "100% denied; not asked") != NULL);
+
+    // It is still asked at RESERVE
+    FAIL_UNLESS(mb_client_reserve_pages(sink->client, 1) == 1);
+    FAIL_UNLESS(mb_client_return_pages(sink->client, 1) == 0);
+
+    terminateTestClient(sink);
+    terminateTestClient(denier);
+    return 0;
+}
+
+/* Reserves 5 pages from the source, which gets them back before returning */
+static int reserveFromSource(TestClient* sink)
+{
+    FAIL_UNLESS(mb_client_reserve_pages(sink->client, 5) == 5);
+    FAIL_UNLESS(mb_client_return_pages(sink->client, 5) == 0);
+    // Once this is answered, the broker has paid the source back
+    FAIL_UNLESS(mb_client_query_server(sink->client) > MB_BAD_PAGES);
+    return 0;
+}
+
+static void setAdaptiveDowngrade()
+{
+    mbs_set_adaptive_downgrade(server, 1);
+}
+
+int testAdaptiveDowngrade()
+{
+    TestClient* source = createTestClient(1, 1, 10);
+    TestClient* sink = createTestClient(2, 0, 0);
+    char buf[4096];
+
+    // It never has more than 2 pages to give at REQUEST
+    pthread_mutex_lock(&(source->mutex));
+    source->requestable_pages = 2;
+    pthread_mutex_unlock(&(source->mutex));
+
+    // The first RESERVE asks it at REQUEST, then at RESERVE for the rest
+    FAIL_UNLESS(reserveFromSource(sink) == 0);
+    readDebug(buf, sizeof(buf));
+    FAIL_UNLESS(strstr(buf, "REQUEST: 1 answers in ") != NULL);
+    FAIL_UNLESS(strstr(buf, "RESERVE: 1 answers in ") != NULL);
+
+    // After that it goes straight to RESERVE
+    FAIL_UNLESS(reserveFromSource(sink) == 0);
+    readDebug(buf, sizeof(buf));
+    FAIL_UNLESS(strstr(buf, "REQUEST: 1 answers in ") != NULL);
+    FAIL_UNLESS(strstr(buf, "RESERVE: 2 answers in ") != NULL);
+
+    terminateTestClient(sink);
+    terminateTestClient(source);
+    return 0;
+}
+
+int testNoDowngrade()
+{
+    TestClient* source = createTestClient(1, 1, 10);
+    TestClient* sink = createTestClient(2, 0, 0);
+    char buf[4096];
+
+    pthread_mutex_lock(&(source->mutex));
+    source->requestable_pages = 2;
+    pthread_mutex_unlock(&(source->mutex));
+
+    // Unless the server is told to, it asks at REQUEST every time
+    FAIL_UNLESS(reserveFromSource(sink) == 0);
+    FAIL_UNLESS(reserveFromSource(sink) == 0);
+    readDebug(buf, sizeof(buf));
+    FAIL_UNLESS(strstr(buf, "REQUEST: 2 answers in ") != NULL);
+    FAIL_UNLESS(strstr(buf, "RESERVE: 2 answers in ") != NULL);
+
+    terminateTestClient(sink);
+    terminateTestClient(source);
+    return 0;
+}
+
+#define BATCH_WINDOW_US 100000
+
+static void setBatchWindow()
+{
+    mbs_set_batch_window(server, BATCH_WINDOW_US);
+}
+
+static void setLongBatchWindow()
+{
+    mbs_set_batch_window(server, 100 * BATCH_WINDOW_US);
+}
+
+static int waitReadable(MbClientHandle client, int ms)
+{
+    struct pollfd pfd;
+
+    pfd.fd = mb_client_fd(client);
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, ms) == 1;
+}
+
+int testBatchWindow()
+{
+    MbClientHandle sharer, sinks[2];
+    char buf[4096];
+    MbOp op;
+
+    // The sharer holds the whole pool
+    sharer = connectSharer(1, 10);
+    sinks[0] = mb_client_connect(2, 0, 0, 0);
+    sinks[1] = mb_client_connect(3, 0, 0, 0);
+    FAIL_UNLESS(sinks[0] != NULL && sinks[1] != NULL);
+
+    // Two requests in quick succession make for one query
+    FAIL_UNLESS(sendOp(sinks[0], REQUEST, 0, 2, 3) == 0);
+    FAIL_UNLESS(sendOp(sinks[1], REQUEST, 0, 3, 4) == 0);
+    FAIL_UNLESS(mb_client_receive_op(sharer, &op) == 0);
+    FAIL_UNLESS(op.code == REQUEST && op.param == 7);
+    FAIL_UNLESS(mb_client_send(sharer, SHARE, 7) == 0);
+    FAIL_UNLESS(mb_client_receive_op(sinks[0], &op) == 0);
+    FAIL_UNLESS(op.code == SHARE && op.param == 3 && op.tag == 2);
+    FAIL_UNLESS(mb_client_receive_op(sinks[1], &op) == 0);
+    FAIL_UNLESS(op.code == SHARE && op.param == 4 && op.tag == 3);
+
+    readDebug(buf, sizeof(buf));
+    FAIL_UNLESS(strstr(buf, "BATCHING 1 share queries for 2 requests, 0.50 a request; 2.00 requests a query; window 100000 of 100000 us") != NULL);
+
+    // Pages shared unasked while a query is held back go to the pool, and
+    // the query still goes out when the window is up
+    FAIL_UNLESS(mb_client_return_pages(sinks[0], 3) == 0);
+    FAIL_UNLESS(sendOp(sharer, REQUEST, 0, 5, 3) == 0);
+    FAIL_UNLESS(mb_client_receive_op(sharer, &op) == 0);
+    FAIL_UNLESS(op.code == SHARE && op.param == 3);
+    FAIL_UNLESS(sendOp(sinks[1], REQUEST, 0, 6, 2) == 0);
+    usleep(BATCH_WINDOW_US / 5);
+    FAIL_UNLESS(mb_client_send(sharer, SHARE, 1) == 0);
+    FAIL_UNLESS(waitReadable(sharer, 10 * BATCH_WINDOW_US / 1000));
+    FAIL_UNLESS(mb_client_receive_op(sharer, &op) == 0);
+    FAIL_UNLESS(op.code == REQUEST && op.param == 2);
+    FAIL_UNLESS(mb_client_send(sharer, SHARE, 2) == 0);
+    FAIL_UNLESS(mb_client_receive_op(sinks[1], &op) == 0);
+    FAIL_UNLESS(op.code == SHARE && op.param == 2 && op.tag == 6);
+    FAIL_UNLESS(mb_client_query_server(sinks[0]) == 1);
+
+    mb_client_terminate(sinks[1]);
+    mb_client_terminate(sinks[0]);
+    mb_client_terminate(sharer);
+    return 0;
+}
+
+int testBatchDeadline()
+{
+    MbClientHandle sharer, sink;
+    struct timespec start;
+    MbOp op;
+
+    sharer = connectSharer(1, 10);
+    sink = mb_client_connect(2, 0, 0, 0);
+    FAIL_UNLESS(sink != NULL);
+
+    // A query waits no longer than half the time left to its request
+    FAIL_UNLESS(mb_client_set_deadline(sink, DEADLINE_MS) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    FAIL_UNLESS(sendOp(sink, REQUEST, 0, 2, 3) == 0);
+    FAIL_UNLESS(mb_client_receive_op(sharer, &op) == 0);
+    FAIL_UNLESS(op.code == REQUEST && op.param == 3);
+    FAIL_UNLESS(elapsedMs(&start) < DEADLINE_MS);
+    FAIL_UNLESS(mb_client_send(sharer, SHARE, 3) == 0);
+    FAIL_UNLESS(mb_client_receive_op(sink, &op) == 0);
+    FAIL_UNLESS(op.code == SHARE && op.param == 3 && op.tag == 2);
+
+    mb_client_terminate(sink);
+    mb_client_terminate(sharer);
+    return 0;
+}
+
+static void setLookahead()
+{
+    mbs_set_lookahead(server, 1);
+}
+
+int testLookahead()
+{
+    MbClientHandle sharer, sink;
+    char buf[4096];
+    MbOp op;
+    int i;
+
+    // The sharer takes the whole pool, in requests the size of the sink's
+    sharer = connectSharer(1, 2);
+    for (i = 0; i < 4; i++) {
+        FAIL_UNLESS(sendOp(sharer, REQUEST, 0, 1, 2) == 0);
+        FAIL_UNLESS(mb_client_receive_op(sharer, &op) == 0);
+        FAIL_UNLESS(op.code == SHARE && op.param == 2);
+    }
+    sink = mb_client_connect(2, 0, 0, 0);
+    FAIL_UNLESS(sink != NULL);
+
+    // A request asks for another like it while it is at it...
+    FAIL_UNLESS(sendOp(sink, REQUEST, 0, 2, 2) == 0);
+    FAIL_UNLESS(mb_client_receive_op(sharer, &op) == 0);
+    FAIL_UNLESS(op.code == REQUEST && op.param == 4);
+    FAIL_UNLESS(mb_client_send(sharer, SHARE, 4) == 0);
+    FAIL_UNLESS(mb_client_receive_op(sink, &op) == 0);
+    FAIL_UNLESS(op.code == SHARE && op.param == 2 && op.tag == 2);
+
+    // ...which is there for the next one
+    FAIL_UNLESS(mb_client_request_pages(sink, 2) == 2);
+    FAIL_UNLESS(mb_client_query_server(sink) == 0);
+
+    // A RESERVE asks for no more than it needs
+    FAIL_UNLESS(sendOp(sink, RESERVE, 0, 3, 3) == 0);
+    FAIL_UNLESS(mb_client_receive_op(sharer, &op) == 0);
+    FAIL_UNLESS(op.code == RESERVE && op.param == 3);
+    FAIL_UNLESS(mb_client_send(sharer, SHARE, 3) == 0);
+    FAIL_UNLESS(mb_client_receive_op(sink, &op) == 0);
+    FAIL_UNLESS(op.code == SHARE && op.param == 3 && op.tag == 3);
+
+    readDebug(buf, sizeof(buf));
+    FAIL_UNLESS(strstr(buf, "LOOKAHEAD 2 pages asked for ahead of demand, 2 shared") != NULL);
+
+    mb_client_terminate(sink);
+    mb_client_terminate(sharer);
+    return 0;
+}
+
+/* Polls the debug dump until it says what is expected */
+static int waitForDebug(const char* expected)
+{
+    char buf[4096];
+    int tries;
+
+    for (tries = 1000; tries; tries--) {
+        readDebug(buf, sizeof(buf));
+        if (strstr(buf, expected) != NULL)
+            return 0;
+        usleep(1000);
+    }
+    return -1;
+}
+
+int testShareChunks()
+{
+    MbClientHandle sharer, sink, v1;
+    MbSnapshot snap;
+    MbOp op;
+
+    sharer = connectSharer(1, 10);
+    FAIL_UNLESS(mb_client_snapshot(sharer, &snap) == 0);
+    FAIL_UNLESS(snap.caps & MB_CAP_CHUNKS);
+    sink = mb_client_connect(2, 0, 0, 0);
+    FAIL_UNLESS(sink != NULL);
+
+    FAIL_UNLESS(sendOp(sink, REQUEST, 0, 2, 5) == 0);
+    FAIL_UNLESS(mb_client_receive_op(sharer, &op) == 0);
+    FAIL_UNLESS(op.code == REQUEST && op.param == 5);
+
+    // Not enough yet
+    FAIL_UNLESS(sendOp(sharer, SHARE, MB_SHARE_MORE, 0, 2) == 0);
+    FAIL_UNLESS(waitForDebug("Requested to share 5 pages, 2 shared so far") == 0);
+    FAIL_UNLESS(!mb_client_pending(sink));
+
+    // The request has all it needs before the answer is over
+    FAIL_UNLESS(sendOp(sharer, SHARE, MB_SHARE_MORE, 0, 4) == 0);
+    FAIL_UNLESS(mb_client_receive_op(sink, &op) == 0);
+    FAIL_UNLESS(op.code == SHARE && op.param == 5 && op.tag == 2);
+    FAIL_UNLESS(waitForDebug("Requested to share 5 pages, 6 shared so far") == 0);
+
+    // The answer counts as a whole once it is over
+    FAIL_UNLESS(sendOp(sharer, SHARE, 0, 0, 0) == 0);
+    FAIL_UNLESS(waitForDebug("REQUEST: 1 answers in ") == 0);
+    FAIL_UNLESS(waitForDebug("100% of pages asked for, 0% denied") == 0);
+    FAIL_UNLESS(mb_client_query_server(sink) == 1);
+
+    // Chunks need a server that takes them
+    v1 = mb_client_register(3, 0);
+    FAIL_UNLESS(v1 != NULL);
+    FAIL_UNLESS(sendOp(v1, SHARE, MB_SHARE_MORE, 0, 1) == MB_BAD_PARAM);
+
+    mb_client_terminate(v1);
+    mb_client_terminate(sink);
+    mb_client_terminate(sharer);
+    return 0;
+}
+
+int testProgressive()
+{
+    MbClientHandle sharer, sink, v1;
+    MbOp op;
+
+    sharer = connectSharer(1, 10);
+    sink = mb_client_connect(2, 0, 0, 0);
+    FAIL_UNLESS(sink != NULL);
+
+    // The pages come through as the sharer frees them
+    FAIL_UNLESS(mb_client_request_progressive(sink, 6) == 0);
+    FAIL_UNLESS(mb_client_receive_op(sharer, &op) == 0);
+    FAIL_UNLESS(op.code == REQUEST && op.param == 6);
+    FAIL_UNLESS(sendOp(sharer, SHARE, MB_SHARE_MORE, 0, 2) == 0);
+    FAIL_UNLESS(mb_client_receive_op(sink, &op) == 0);
+    FAIL_UNLESS(op.code == SHARE && op.param == 2 && (op.flags & MB_SHARE_MORE));
+    FAIL_UNLESS(mb_client_granted(sink) == 2);
+    FAIL_UNLESS(waitForDebug("Progressive, 2 pages granted so far") == 0);
+    FAIL_UNLESS(sendOp(sharer, SHARE, MB_SHARE_MORE, 0, 3) == 0);
+    FAIL_UNLESS(mb_client_receive_op(sink, &op) == 0);
+    FAIL_UNLESS(op.code == SHARE && op.param == 3 && (op.flags & MB_SHARE_MORE));
+    FAIL_UNLESS(mb_client_granted(sink) == 5);
+
+    // The last of them says it is over
+    FAIL_UNLESS(sendOp(sharer, SHARE, 0, 0, 1) == 0);
+    FAIL_UNLESS(mb_client_receive_op(sink, &op) == 0);
+    FAIL_UNLESS(op.code == SHARE && op.param == 1 && !(op.flags & MB_SHARE_MORE));
+    FAIL_UNLESS(mb_client_granted(sink) == 6);
+    FAIL_UNLESS(mb_client_query(sink) == 6);
+
+    // A RESERVE is still all or nothing
+    FAIL_UNLESS(sendOp(sink, RESERVE, MB_REQUEST_PROGRESSIVE, 3, 4) == 0);
+    FAIL_UNLESS(mb_client_receive_op(sharer, &op) == 0);
+    FAIL_UNLESS(op.code == RESERVE && op.param == 4);
+    FAIL_UNLESS(sendOp(sharer, SHARE, MB_SHARE_MORE, 0, 2) == 0);
+    FAIL_UNLESS(waitForDebug("Reserving 2 of 4 pages") == 0);
+    FAIL_UNLESS(sendOp(sharer, SHARE, 0, 0, 2) == 0);
+    FAIL_UNLESS(mb_client_receive_op(sink, &op) == 0);
+    FAIL_UNLESS(op.code == SHARE && op.param == 4 && op.tag == 3);
+    FAIL_UNLESS(!(op.flags & MB_SHARE_MORE));
+
+    // It takes v2
+    v1 = mb_client_register(3, 0);
+    FAIL_UNLESS(v1 != NULL);
+    FAIL_UNLESS(mb_client_request_progressive(v1, 1) == MB_BAD_PARAM);
+
+    mb_client_terminate(v1);
+    mb_client_terminate(sink);
+    mb_client_terminate(sharer);
+    return 0;
+}
+
+/* Has the sink borrow pages from the source and hand them back */
+static int borrowFromSource(MbClientHandle source, MbClientHandle sink)
+{
+    MbOp op;
+
+    FAIL_UNLESS(sendOp(sink, REQUEST, 0, 1, 5) == 0);
+    FAIL_UNLESS(mb_client_receive_op(source, &op) == 0);
+    FAIL_UNLESS(op.code == REQUEST && op.param == 5);
+    FAIL_UNLESS(mb_client_send(source, SHARE, 5) == 0);
+    FAIL_UNLESS(mb_client_receive_op(sink, &op) == 0);
+    FAIL_UNLESS(op.code == SHARE && op.param == 5);
+    FAIL_UNLESS(mb_client_return_pages(sink, 5) == 0);
+    return 0;
+}
+
+static void setRepayDelay()
+{
+    mbs_set_repayment(server, 0, 10000, 0);
+}
+
+int testRepayDelay()
+{
+    MbClientHandle source, sink;
+
+    source = mb_client_connect(1, MB_CLIENT_BIDI, 10, 0);
+    sink = mb_client_connect(2, 0, 0, 0);
+    FAIL_UNLESS(source != NULL && sink != NULL);
+
+    // Held back until a while after the last request...
+    FAIL_UNLESS(borrowFromSource(source, sink) == 0);
+    FAIL_UNLESS(mb_client_query_server(sink) == 5);
+
+    // ...so the next one need not borrow them again
+    FAIL_UNLESS(mb_client_request_pages(sink, 5) == 5);
+    FAIL_UNLESS(mb_client_return_pages(sink, 5) == 0);
+    FAIL_UNLESS(mb_client_query_server(sink) == 5);
+    FAIL_UNLESS(!mb_client_pending(source));
+
+    mb_client_terminate(sink);
+    mb_client_terminate(source);
+    return 0;
+}
+
+static void setRepayKeep()
+{
+    mbs_set_repayment(server, 3, 0, 0);
+}
+
+int testRepayKeep()
+{
+    MbClientHandle source, sink;
+    struct timespec start;
+    MbOp op;
+
+    source = mb_client_connect(1, MB_CLIENT_BIDI, 10, 0);
+    sink = mb_client_connect(2, 0, 0, 0);
+    FAIL_UNLESS(source != NULL && sink != NULL);
+
+    // The pool keeps a few, and pays the rest back straight away
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    FAIL_UNLESS(borrowFromSource(source, sink) == 0);
+    FAIL_UNLESS(mb_client_receive_op(source, &op) == 0);
+    FAIL_UNLESS(op.code == RETURN && op.param == 2);
+    FAIL_UNLESS(elapsedMs(&start) < 1000);
+    FAIL_UNLESS(mb_client_query_server(sink) == 3);
+
+    mb_client_terminate(sink);
+    mb_client_terminate(source);
+    return 0;
+}
+
+static void setRepayRate()
+{
+    mbs_set_repayment(server, 0, 0, 4);
+}
+
+int testRepayRate()
+{
+    MbClientHandle source, sink;
+    struct timespec start;
+    MbOp op;
+
+    source = mb_client_connect(1, MB_CLIENT_BIDI, 10, 0);
+    sink = mb_client_connect(2, 0, 0, 0);
+    FAIL_UNLESS(source != NULL && sink != NULL);
+
+    // A second's worth goes back at once...
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    FAIL_UNLESS(borrowFromSource(source, sink) == 0);
+    FAIL_UNLESS(mb_client_receive_op(source, &op) == 0);
+    FAIL_UNLESS(op.code == RETURN && op.param == 4);
+    FAIL_UNLESS(elapsedMs(&start) < 200);
+
+    // ...and the rest a quarter of a second later
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    FAIL_UNLESS(mb_client_receive_op(source, &op) == 0);
+    FAIL_UNLESS(op.code == RETURN && op.param == 1);
+    FAIL_UNLESS(elapsedMs(&start) >= 150);
+    FAIL_UNLESS(elapsedMs(&start) < 1000);
+    FAIL_UNLESS(mb_client_query_server(sink) == 0);
+
+    mb_client_terminate(sink);
+    mb_client_terminate(source);
+    return 0;
+}
+
+static void setRepayDamping()
+{
+    mbs_set_repay_damping(server, 1);
+}
+
+int testRepayDamping()
+{
+    MbClientHandle source, sink;
+    MbOp op;
+    int repaid;
+
+    source = mb_client_connect(1, MB_CLIENT_BIDI, 10, 0);
+    sink = mb_client_connect(2, 0, 0, 0);
+    FAIL_UNLESS(source != NULL && sink != NULL);
+
+    FAIL_UNLESS(borrowFromSource(source, sink) == 0);
+    FAIL_UNLESS(mb_client_receive_op(source, &op) == 0);
+    FAIL_UNLESS(op.code == RETURN && op.param == 5);
+
+    // A source asked for pages again soon after it was repaid has to wait,
+    // longer each time
+    for (repaid = 1; repaid <= 2; repaid++) {
+        char expected[64];
+
+        FAIL_UNLESS(borrowFromSource(source, sink) == 0);
+        snprintf(expected, sizeof(expected), "; %d oscillations, damped",
+                 repaid);
+        FAIL_UNLESS(waitForDebug(expected) == 0);
+        snprintf(expected, sizeof(expected),
+                 "soon after repayment %d times in a row", repaid);
+        FAIL_UNLESS(waitForDebug(expected) == 0);
+        FAIL_UNLESS(mb_client_receive_op(source, &op) == 0);
+        FAIL_UNLESS(op.code == RETURN && op.param == 5);
+    }
+
+    mb_client_terminate(sink);
+    mb_client_terminate(source);
+    return 0;
+}
+
 static TestLookup testTable[] = {
-    { "initAndTerminate", &initAndTerminate, 0},
-    { "testNormalRequest", &testNormalRequest, 5 },
-    { "testNormalReserve", &testNormalReserve, 5 },
-    { "testRequestOnRequesting", &testRequestOnRequesting, 5 },
-    { "testReserveOnRequesting", &testReserveOnRequesting, 5 },
-    { "testRequestOnReserving", &testRequestOnReserving, 5 },
-    { "testReserveOnReserving", &testReserveOnReserving, 5 },
-    { "testRequestOnReserved", &testRequestOnReserved, 15 },
-    { "testRequestOnRequested", &testRequestOnRequested, 15 },
-    { "testReserveOnRequested", &testReserveOnRequested, 15 },
-    { "testReserveOnReserved", &testReserveOnReserved, 15 },
-    { "testReturnOnRequest", &testReturnOnRequest, 0 },
-    { "testMultipleRequests", &testMultipleRequests, 0 },
-    { "testClientTermination", &testClientTermination, 0 },
-    { "testIoErrors", &testIoErrors, 0 },
-    { "testDumpDebug", &testDumpDebug, 0 }
+    { "initAndTerminate", &initAndTerminate, 0, 0 },
+    { "testNormalRequest", &testNormalRequest, 5, 0 },
+    { "testNormalReserve", &testNormalReserve, 5, 0 },
+    { "testRequestOnRequesting", &testRequestOnRequesting, 5, 0 },
+    { "testReserveOnRequesting", &testReserveOnRequesting, 5, 0 },
+    { "testRequestOnReserving", &testRequestOnReserving, 5, 0 },
+    { "testReserveOnReserving", &testReserveOnReserving, 5, 0 },
+    { "testRequestOnReserved", &testRequestOnReserved, 15, 0 },
+    { "testRequestOnRequested", &testRequestOnRequested, 15, 0 },
+    { "testReserveOnRequested", &testReserveOnRequested, 15, 0 },
+    { "testReserveOnReserved", &testReserveOnReserved, 15, 0 },
+    { "testReturnOnRequest", &testReturnOnRequest, 0, 0 },
+    { "testMultipleRequests", &testMultipleRequests, 0, 0 },
+    { "testClientTermination", &testClientTermination, 0, 0 },
+    { "testIoErrors", &testIoErrors, 0, 0 },
+    { "testDumpDebug", &testDumpDebug, 0, 0 },
+    { "testSteadyStateAllocs", &testSteadyStateAllocs, 0, 0 },
+    { "testSlowReader", &testSlowReader, 5, 0 },
+    { "testJammedGrant", &testJammedGrant, 5, 0 },
+    { "testJammedReserve", &testJammedReserve, 2, 0 },
+    { "testNameCache", &testNameCache, 0, 0 },
+    { "testDebugReaders", &testDebugReaders, 5, 0 },
+    { "testShards", &testShards, 100, 4 },
+    { "testRequestDeadline", &testRequestDeadline, 3, 0 },
+    { "testRequestEscalation", &testRequestEscalation, 0, 0, &setEscalation },
+    { "testShareTimeout", &testShareTimeout, 0, 0, &setShareTimeout },
+    { "testProtocolV2", &testProtocolV2, 100, 0 },
+    { "testGranules", &testGranules, 1000, 0 },
+    { "testFanOut", &testFanOut, 30, 0, &setFanOut },
+    { "testAvailable", &testAvailable, 30, 0 },
+    { "testShareHistory", &testShareHistory, 0, 0 },
+    { "testAdaptiveDowngrade", &testAdaptiveDowngrade, 0, 0,
+      &setAdaptiveDowngrade },
+    { "testNoDowngrade", &testNoDowngrade, 0, 0 },
+    { "testBatchWindow", &testBatchWindow, 10, 0, &setBatchWindow },
+    { "testBatchDeadline", &testBatchDeadline, 10, 0, &setLongBatchWindow },
+    { "testLookahead", &testLookahead, 10, 0, &setLookahead },
+    { "testShareChunks", &testShareChunks, 10, 0 },
+    { "testProgressive", &testProgressive, 10, 0 },
+    { "testRepayDelay", &testRepayDelay, 0, 0, &setRepayDelay },
+    { "testRepayKeep", &testRepayKeep, 0, 0, &setRepayKeep },
+    { "testRepayRate", &testRepayRate, 0, 0, &setRepayRate },
+    { "testRepayDamping", &testRepayDamping, 0, 0, &setRepayDamping }
 };
 
 #define N_ELEMENTS(ary)  (sizeof (ary) / sizeof (ary[0]))
@@ -1282,7 +2589,8 @@ int main(int argc, char ** argv)
 
     printf("Running test: %s\n", argv[1]);
 
-    if ((rc = startServer(testTable[index].pages)))
+    if ((rc = startServer(testTable[index].pages, testTable[index].shards,
+                          testTable[index].setup)))
         return rc;
 
     if ((rc = testTable[index].test()))